@@ -3,20 +3,35 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "action.h"
+#include "copy.h"
+#include "archive.h"
 
 struct ActionDef actions[] = {
   {PUSH,        "push",  {NULL}, 0, 0},
   {DROP,        "drop",  {NULL}, 0, 0},
   {PRINT,       "print", {NULL}, 0, 0},
-  {COPY,        "copy",    {"/bin/cp", "-r", "--", NULL, NULL, NULL}, 3, 4},
-  {MOVE,        "move",    {"/bin/mv", "--", NULL, NULL, NULL},       2, 3},
+  {COPY,        "copy",    {"/bin/cp", "-r", "--", NULL, NULL, NULL}, 3, 4, copy_trees},
+  {MOVE,        "move",    {"/bin/mv", "--", NULL, NULL, NULL},       2, 3, move_trees},
   {SYMLINK,     "symlink", {"/bin/ln", "-s", "--", NULL, NULL, NULL}, 3, 4},
+  {ARCHIVE,     "archive", {NULL}, 0, 0, archive_trees},
+  {LINK,        "link",    {"/bin/cp", "-rl", "--", NULL, NULL, NULL}, 3, 4, link_trees},
+  {CLONE,       "clone",   {NULL}, 0, 0, clone_trees},
   {INTERACTIVE, "interactive mode", {NULL}, 0, 0},
   {STOP,        "terminate daemon", {NULL}, 0, 0},
+  {ROTATE,      "rotate",        {NULL}, 0, 0},
+  {STACKS,      "list stacks",   {NULL}, 0, 0},
+  {CREATE,      "create stack",  {NULL}, 0, 0},
+  {DESTROY,     "destroy stack", {NULL}, 0, 0},
+  {UNIQUE,      "set unique",    {NULL}, 0, 0},
+  {PROGRESS,    "show progress", {NULL}, 0, 0},
   {NOTHING}
 };
 
+/* MatchKinds, as the protocol names them */
+static const char *match_words[] = {"glob", "substr", "prefix", NULL};
+
 
 struct ActionDef *action_def(enum ActionType type) {
   /* Return a pointer to the ActionDef matching <type>, or NULL if there
@@ -41,3 +56,20 @@ char *action_verb(enum ActionType type) {
   }
   return def->verb;
 }
+
+const char *match_word(enum MatchKind kind) {
+  /* Return what the protocol calls <kind>. */
+
+  return match_words[kind];
+}
+
+int match_kind(const char *word) {
+  /* Return the MatchKind the protocol calls <word>, or -1. */
+  int i;
+
+  for( i = 0; match_words[i] != NULL; i++ ) {
+    if( strcmp(word, match_words[i]) == 0 )
+      return i;
+  }
+  return -1;
+}
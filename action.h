@@ -3,6 +3,28 @@
 
 #define EXEC_ARG_MAX 6
 
+/* Action.flags */
+#define ACTION_URING 0x1	/* copy through io_uring if we can */
+#define ACTION_VERIFY 0x2	/* hash copies, and check them on the disk */
+#define ACTION_PRESERVE 0x4	/* keep times and owners of copies */
+#define ACTION_SKIP_IDENTICAL 0x8 /* leave files that are already there */
+#define ACTION_FIFO 0x10	/* take files from the bottom of the stack */
+#define ACTION_LINK 0x20	/* hard-link files, rather than copy them */
+#define ACTION_CLONE 0x40	/* reflink them, copying only where we can't */
+#define ACTION_PROGRESS 0x80	/* draw a progress line while popping */
+#define ACTION_PLAN 0x100	/* say what popping would do, and don't */
+#define ACTION_PLAN_JSON 0x200	/* and say it in JSON */
+#define ACTION_PUSHFD 0x400	/* push descriptors, to follow files renamed */
+
+struct Progress;
+
+/* how Action.match is matched against the paths in the stack */
+enum MatchKind {
+  MATCH_GLOB,			/* the basename, or the whole path if it has a slash */
+  MATCH_SUBSTR,			/* anywhere in the path */
+  MATCH_PREFIX,			/* the start of the path */
+};
+
 struct Action {
   enum ActionType {
     NOTHING,
@@ -12,11 +34,27 @@ struct Action {
     COPY,
     MOVE,
     SYMLINK,
+    ARCHIVE,
+    LINK,
+    CLONE,
     INTERACTIVE,
     STOP,
+    ROTATE,
+    STACKS,
+    CREATE,
+    DESTROY,
+    UNIQUE,
+    PROGRESS,
   } type;
   int num;
   void *ptr;
+  int flags;
+  int ndest;			/* for COPY, MOVE, SYMLINK and ARCHIVE, <ptr> is char*[ndest] */
+  char *hashes;			/* cache file for ACTION_SKIP_IDENTICAL, or NULL */
+  char *index;			/* which entries, as "3,7..9,-1"; NULL for <num> */
+  char *match;			/* or all the entries that match this */
+  enum MatchKind match_kind;
+  struct Progress *progress;	/* for the copy engine to keep up to date, or NULL */
 };
 
 struct ActionDef {
@@ -24,10 +62,15 @@ struct ActionDef {
   char *verb;
   char *exargv[EXEC_ARG_MAX];
   int source_slot, dest_slot;
+  /* used instead of exargv if set; see copy_trees() */
+  int (*native)(struct Action action, char **sources, int n, char **dests,
+		int ndest, int *status);
 };
 
 
 struct ActionDef *action_def(enum ActionType type);
 char *action_verb(enum ActionType type);
+const char *match_word(enum MatchKind kind);
+int match_kind(const char *word);
 
 #endif
@@ -0,0 +1,585 @@
+/* Write files and directory trees into one POSIX tar stream, sending file
+   bodies through the kernel, and gzipping on a thread of its own if the
+   archive's name asks for it. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/sysmacros.h>
+#include "fls.h"
+#include "archive.h"
+#include "copy.h"
+
+#define PAX_MAX (3 * PATH_MAX)
+
+struct Tar {
+  int fd;			/* where the stream goes */
+  int out;			/* the archive; <fd> too, unless compressing */
+  char *path;			/* of the archive */
+  struct stat st;		/* of the archive, so it won't go in itself */
+  off_t len;			/* put in the stream so far */
+  int err;			/* writing <fd> failed; nothing more goes */
+  bool kernel;			/* file bodies can go by sendfile() */
+  char *buf;			/* of COPY_BUF_SIZE, when they can't */
+  long files;
+  long long bytes;
+  /* the compressor reads the other end of <fd> */
+  pthread_t gz;
+  int gzin, gzerr;
+  bool gzip;
+  /* the last owner looked up */
+  uid_t uid;
+  gid_t gid;
+  char uname[32], gname[32];
+};
+
+struct Header {
+  char name[100], mode[8], uid[8], gid[8], size[12], mtime[12];
+  char chksum[8], typeflag, linkname[100], magic[6], version[2];
+  char uname[32], gname[32], devmajor[8], devminor[8], prefix[155];
+  char pad[12];
+};
+
+
+static void archive_error(char *what, char *path, int err) {
+  fprintf(stderr, "archive_trees: %s `%s': %s\n", what, path, strerror(err));
+}
+
+static bool tar_write(struct Tar *tar, const void *data, size_t len) {
+  /* Put <len> bytes of <data> in <tar>'s stream.
+     Return false if it has failed, now or before. */
+  const char *p=data;
+  ssize_t w;
+
+  while( tar->err == 0 && len > 0 ) {
+    w = write(tar->fd, p, len);
+    if( w < 0 ) {
+      if( errno != EINTR )
+	tar->err = errno;
+      continue;
+    }
+    p += w;
+    len -= w;
+    tar->len += w;
+  }
+  return tar->err == 0;
+}
+
+static bool tar_zeros(struct Tar *tar, size_t len) {
+  /* Put <len> zero bytes in <tar>'s stream. */
+  static const char zeros[ARCHIVE_BLOCK];
+  size_t n;
+
+  for( ; len > 0; len -= n ) {
+    n = len < sizeof(zeros) ? len : sizeof(zeros);
+    if( !tar_write(tar, zeros, n) )
+      return false;
+  }
+  return true;
+}
+
+static bool octal(char *field, size_t width, unsigned long long value) {
+  /* Write <value> into the tar header <field> of <width> bytes.
+     Return false if it doesn't fit, leaving the field zero. */
+
+  if( value >> (3 * (width - 1)) != 0 ) {
+    memset(field, '0', width - 1);
+    return false;
+  }
+  snprintf(field, width, "%0*llo", (int)width - 1, value);
+  return true;
+}
+
+static void pax_add(char *pax, size_t *len, char *key, char *value,
+		    unsigned long long num) {
+  /* Add a "LEN KEY=VALUE\n" record to the <len> bytes of <pax>, where
+     LEN counts itself.  Without a <value>, it is <num>. */
+  char numbuf[24];
+  size_t body, total;
+
+  if( value == NULL ) {
+    sprintf(numbuf, "%llu", num);
+    value = numbuf;
+  }
+  body = 1 + strlen(key) + 1 + strlen(value) + 1;
+  /* adding the digits of the length can add a digit to it */
+  total = body + 1;
+  while( total != body + snprintf(NULL, 0, "%zu", total) )
+    total = body + snprintf(NULL, 0, "%zu", total);
+  if( *len + total > PAX_MAX )
+    return;
+  *len += sprintf(pax + *len, "%zu %s=%s\n", total, key, value);
+}
+
+static void owner_names(struct Tar *tar, struct stat *st) {
+  /* Look up the names of <st>'s owner and group, unless we just did. */
+  struct passwd *pw;
+  struct group *gr;
+
+  if( tar->uid != st->st_uid || tar->uname[0] == '\0' ) {
+    tar->uid = st->st_uid;
+    pw = getpwuid(st->st_uid);
+    snprintf(tar->uname, sizeof(tar->uname), "%s", pw ? pw->pw_name : "");
+  }
+  if( tar->gid != st->st_gid || tar->gname[0] == '\0' ) {
+    tar->gid = st->st_gid;
+    gr = getgrgid(st->st_gid);
+    snprintf(tar->gname, sizeof(tar->gname), "%s", gr ? gr->gr_name : "");
+  }
+}
+
+static bool split_name(struct Header *h, char *name) {
+  /* Put <name> in <h>, in its name and prefix if need be.
+     Return false if it won't go. */
+  size_t len=strlen(name);
+  char *slash;
+
+  if( len <= sizeof(h->name) ) {
+    memcpy(h->name, name, len);
+    return true;
+  }
+  /* the prefix goes before a slash; the rest must fit in the name */
+  for( slash = name + len - 1; slash > name; slash-- ) {
+    if( *slash != '/' )
+      continue;
+    if( (size_t)(name + len - slash - 1) > sizeof(h->name) )
+      break;
+    if( slash - name <= (long)sizeof(h->prefix) && slash[1] != '\0' ) {
+      memcpy(h->prefix, name, slash - name);
+      memcpy(h->name, slash + 1, name + len - slash - 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void checksum(struct Header *h) {
+  unsigned char *p=(unsigned char *)h;
+  unsigned sum=0;
+  size_t i;
+
+  memset(h->chksum, ' ', sizeof(h->chksum));
+  for( i = 0; i < sizeof(*h); i++ )
+    sum += p[i];
+  snprintf(h->chksum, 7, "%06o", sum);
+}
+
+static bool tar_header(struct Tar *tar, char *name, struct stat *st,
+		       char type, char *linkname) {
+  /* Put the header for <name>, a <type> of file like <st>, in <tar>'s
+     stream, and a pax header before it with whatever won't fit. */
+  struct Header h;
+  char *pax=NULL;
+  size_t paxlen=0, len;
+  bool name_ok, uid_ok, gid_ok, size_ok, link_ok;
+
+  memset(&h, 0, sizeof(h));
+  owner_names(tar, st);
+  name_ok = split_name(&h, name);
+  uid_ok = octal(h.uid, sizeof(h.uid), st->st_uid);
+  gid_ok = octal(h.gid, sizeof(h.gid), st->st_gid);
+  size_ok = type != '0' || octal(h.size, sizeof(h.size), st->st_size);
+  link_ok = linkname == NULL || strlen(linkname) <= sizeof(h.linkname);
+  if( !(name_ok && uid_ok && gid_ok && size_ok && link_ok) ) {
+    pax = malloc(PAX_MAX);
+    if( pax == NULL ) {
+      tar->err = ENOMEM;
+      return false;
+    }
+    if( !name_ok ) {
+      pax_add(pax, &paxlen, "path", name, 0);
+      memcpy(h.name, name, sizeof(h.name));
+    }
+    if( !uid_ok )
+      pax_add(pax, &paxlen, "uid", NULL, st->st_uid);
+    if( !gid_ok )
+      pax_add(pax, &paxlen, "gid", NULL, st->st_gid);
+    if( !size_ok )
+      pax_add(pax, &paxlen, "size", NULL, st->st_size);
+    if( !link_ok )
+      pax_add(pax, &paxlen, "linkpath", linkname, 0);
+  }
+  if( paxlen > 0 ) {
+    struct Header x;
+    memset(&x, 0, sizeof(x));
+    snprintf(x.name, sizeof(x.name), "PaxHeaders/%.88s", h.name);
+    octal(x.mode, sizeof(x.mode), 0644);
+    octal(x.uid, sizeof(x.uid), 0);
+    octal(x.gid, sizeof(x.gid), 0);
+    octal(x.size, sizeof(x.size), paxlen);
+    octal(x.mtime, sizeof(x.mtime), st->st_mtime);
+    x.typeflag = 'x';
+    memcpy(x.magic, "ustar", 6);
+    memcpy(x.version, "00", 2);
+    checksum(&x);
+    if( !tar_write(tar, &x, sizeof(x)) || !tar_write(tar, pax, paxlen)
+	|| !tar_zeros(tar, -paxlen & (ARCHIVE_BLOCK - 1)) ) {
+      free(pax);
+      return false;
+    }
+  }
+  free(pax);
+
+  octal(h.mode, sizeof(h.mode), st->st_mode & 07777);
+  if( type != '0' )
+    octal(h.size, sizeof(h.size), 0);
+  octal(h.mtime, sizeof(h.mtime), st->st_mtime < 0 ? 0 : st->st_mtime);
+  h.typeflag = type;
+  if( linkname != NULL ) {
+    len = strlen(linkname);
+    memcpy(h.linkname, linkname, len < sizeof(h.linkname) ? len : sizeof(h.linkname));
+  }
+  memcpy(h.magic, "ustar", 6);
+  memcpy(h.version, "00", 2);
+  memcpy(h.uname, tar->uname, strlen(tar->uname));
+  memcpy(h.gname, tar->gname, strlen(tar->gname));
+  if( type == '3' || type == '4' ) {
+    octal(h.devmajor, sizeof(h.devmajor), major(st->st_rdev));
+    octal(h.devminor, sizeof(h.devminor), minor(st->st_rdev));
+  }
+  checksum(&h);
+  return tar_write(tar, &h, sizeof(h));
+}
+
+static int tar_body(struct Tar *tar, int in, off_t size) {
+  /* Put the <size> bytes of <in> in <tar>'s stream, in the kernel if we
+     can, then pad them out to a block.  If <in> turns out shorter, pad it
+     to <size> with zeros.
+     Return 0, or an errno value if <in> couldn't be read. */
+  off_t left=size;
+  ssize_t n;
+  int err=0;
+
+  while( tar->kernel && left > 0 && tar->err == 0 ) {
+    n = sendfile(tar->fd, in, NULL, left);
+    if( n > 0 ) {
+      left -= n;
+      tar->len += n;
+      continue;
+    }
+    if( n == 0 )
+      break;
+    if( errno == EINTR || errno == EAGAIN )
+      continue;
+    if( left == size && (errno == EINVAL || errno == ENOSYS) )
+      tar->kernel = false;
+    else if( errno == EIO )
+      err = errno;
+    else
+      tar->err = errno;
+    break;
+  }
+  while( !tar->kernel && err == 0 && left > 0 && tar->err == 0 ) {
+    n = read(in, tar->buf, left < COPY_BUF_SIZE ? left : COPY_BUF_SIZE);
+    if( n < 0 && errno == EINTR )
+      continue;
+    if( n < 0 )
+      err = errno;
+    if( n <= 0 )
+      break;
+    tar_write(tar, tar->buf, n);
+    left -= n;
+  }
+  tar->bytes += size - left;
+  tar_zeros(tar, left + (-size & (ARCHIVE_BLOCK - 1)));
+  return err;
+}
+
+static int tar_entry(struct Tar *tar, int dirfd, char *name, char *arcname) {
+  /* Put <name> in <dirfd> in <tar>'s stream as <arcname>, and all that's
+     in it if it's a directory.
+     Return how many things couldn't go in. */
+  struct stat st;
+  struct dirent *dent;
+  DIR *dir;
+  char *link, *child;
+  int fd, err, errors=0;
+
+  if( fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 ) {
+    archive_error("cannot stat", arcname, errno);
+    return 1;
+  }
+  if( st.st_dev == tar->st.st_dev && st.st_ino == tar->st.st_ino ) {
+    fprintf(stderr, "archive_trees: `%s' is the archive; left out\n", arcname);
+    return 0;
+  }
+
+  if( S_ISREG(st.st_mode) ) {
+    fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if( fd == -1 || fstat(fd, &st) == -1 ) {
+      archive_error("cannot open", arcname, errno);
+      if( fd != -1 )
+	close(fd);
+      return 1;
+    }
+    if( tar_header(tar, arcname, &st, '0', NULL) ) {
+      err = tar_body(tar, fd, st.st_size);
+      if( err != 0 ) {
+	archive_error("cannot read", arcname, err);
+	errors++;
+      }
+    }
+    close(fd);
+    tar->files++;
+
+  } else if( S_ISDIR(st.st_mode) ) {
+    child = malloc(strlen(arcname) + 2);
+    if( child == NULL ) {
+      tar->err = ENOMEM;
+      return 1;
+    }
+    sprintf(child, "%s/", arcname);
+    tar_header(tar, child, &st, '5', NULL);
+    free(child);
+    fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    dir = fd == -1 ? NULL : fdopendir(fd);
+    if( dir == NULL ) {
+      archive_error("cannot open directory", arcname, errno);
+      if( fd != -1 )
+	close(fd);
+      return 1;
+    }
+    while( tar->err == 0 && (dent = readdir(dir)) != NULL ) {
+      if( strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0 )
+	continue;
+      child = malloc(strlen(arcname) + strlen(dent->d_name) + 2);
+      if( child == NULL ) {
+	tar->err = ENOMEM;
+	break;
+      }
+      sprintf(child, "%s/%s", arcname, dent->d_name);
+      errors += tar_entry(tar, fd, dent->d_name, child);
+      free(child);
+    }
+    closedir(dir);
+
+  } else if( S_ISLNK(st.st_mode) ) {
+    link = malloc(st.st_size + 1);
+    if( link == NULL || readlinkat(dirfd, name, link, st.st_size + 1) != st.st_size ) {
+      archive_error("cannot read link", arcname, link == NULL ? ENOMEM : errno);
+      free(link);
+      return 1;
+    }
+    link[st.st_size] = '\0';
+    tar_header(tar, arcname, &st, '2', link);
+    free(link);
+
+  } else if( S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode) ) {
+    tar_header(tar, arcname, &st,
+	       S_ISCHR(st.st_mode) ? '3' : S_ISBLK(st.st_mode) ? '4' : '6', NULL);
+
+  } else {
+    fprintf(stderr, "archive_trees: `%s' is a socket; left out\n", arcname);
+  }
+  return errors;
+}
+
+static void gz_out(struct Tar *tar, z_stream *z, unsigned char *out, int flush) {
+  /* Deflate what <z> has in with <flush>, and write it to the archive
+     through <out>, of COPY_BUF_SIZE. */
+  ssize_t w;
+  int got, done;
+
+  do {
+    z->next_out = out;
+    z->avail_out = COPY_BUF_SIZE;
+    deflate(z, flush);
+    got = COPY_BUF_SIZE - z->avail_out;
+    for( done = 0; done < got && tar->gzerr == 0; ) {
+      w = write(tar->out, out + done, got - done);
+      if( w < 0 && errno != EINTR )
+	tar->gzerr = errno;
+      else if( w > 0 )
+	done += w;
+    }
+  } while( z->avail_out == 0 && tar->gzerr == 0 );
+}
+
+static void *gz_run(void *arg) {
+  /* Gzip the stream coming in from the archiver to the archive, until it
+     ends.  Keep reading it after a failure, so the archiver can finish. */
+  struct Tar *tar=arg;
+  unsigned char *in, *out, drain[ARCHIVE_BLOCK];
+  z_stream z;
+  ssize_t n;
+  bool ready=false;
+
+  in = malloc(COPY_BUF_SIZE);
+  out = malloc(COPY_BUF_SIZE);
+  memset(&z, 0, sizeof(z));
+  if( in != NULL && out != NULL )
+    ready = deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+			 Z_DEFAULT_STRATEGY) == Z_OK;
+  if( !ready )
+    tar->gzerr = ENOMEM;
+  for( ;; ) {
+    if( tar->gzerr != 0 )
+      n = read(tar->gzin, drain, sizeof(drain));
+    else
+      n = read(tar->gzin, in, COPY_BUF_SIZE);
+    if( n == 0 || (n < 0 && errno != EINTR) )
+      break;
+    if( n < 0 || tar->gzerr != 0 )
+      continue;
+    z.next_in = in;
+    z.avail_in = n;
+    gz_out(tar, &z, out, Z_NO_FLUSH);
+  }
+  if( n < 0 && tar->gzerr == 0 )
+    tar->gzerr = errno;
+  if( ready ) {
+    if( tar->gzerr == 0 )
+      gz_out(tar, &z, out, Z_FINISH);
+    deflateEnd(&z);
+  }
+  free(in);
+  free(out);
+  return NULL;
+}
+
+static bool gzip_wanted(char *path) {
+  size_t len=strlen(path);
+
+  return (len > 3 && strcmp(path + len - 3, ".gz") == 0)
+    || (len > 4 && strcmp(path + len - 4, ".tgz") == 0);
+}
+
+static bool tar_open(struct Tar *tar, char *path) {
+  /* Start <tar> writing to a new archive at <path>, gzipped if its name
+     ends in .gz or .tgz.  Return false if we can't. */
+  int fds[2];
+
+  memset(tar, 0, sizeof(*tar));
+  tar->path = path;
+  tar->uname[0] = tar->gname[0] = '\0';
+  tar->kernel = true;
+  tar->buf = malloc(COPY_BUF_SIZE);
+  tar->out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if( tar->buf == NULL || tar->out == -1 || fstat(tar->out, &tar->st) == -1 ) {
+    archive_error("cannot create", path, tar->buf == NULL ? ENOMEM : errno);
+    goto fail;
+  }
+  tar->fd = tar->out;
+  tar->gzip = gzip_wanted(path);
+  if( !tar->gzip )
+    return true;
+  if( pipe2(fds, O_CLOEXEC) == -1 ) {
+    archive_error("cannot compress", path, errno);
+    goto fail;
+  }
+  /* a bigger pipe lets the two sides run further apart */
+  fcntl(fds[1], F_SETPIPE_SZ, ARCHIVE_PIPE_SIZE);
+  tar->gzin = fds[0];
+  tar->fd = fds[1];
+  if( (errno = pthread_create(&tar->gz, NULL, gz_run, tar)) != 0 ) {
+    archive_error("cannot compress", path, errno);
+    close(fds[0]);
+    close(fds[1]);
+    goto fail;
+  }
+  return true;
+
+ fail:
+  if( tar->out != -1 )
+    close(tar->out);
+  free(tar->buf);
+  return false;
+}
+
+static bool tar_close(struct Tar *tar) {
+  /* End <tar>'s stream, and wait for it all to reach the archive.
+     Return false if any of it didn't. */
+
+  /* two empty blocks, and the rest of the record */
+  tar_zeros(tar, 2 * ARCHIVE_BLOCK);
+  tar_zeros(tar, (ARCHIVE_RECORD - tar->len % ARCHIVE_RECORD) % ARCHIVE_RECORD);
+  if( tar->gzip ) {
+    close(tar->fd);
+    pthread_join(tar->gz, NULL);
+    close(tar->gzin);
+    if( tar->err == 0 )
+      tar->err = tar->gzerr;
+  }
+  if( close(tar->out) == -1 && tar->err == 0 )
+    tar->err = errno;
+  free(tar->buf);
+  if( tar->err != 0 )
+    archive_error("cannot write", tar->path, tar->err);
+  return tar->err == 0;
+}
+
+static char *arc_name(char *source) {
+  /* Return what <source> is called in the archive: its last part, without
+     the slash a directory ends with.  Return NULL if out of memory. */
+  char *name=strdup(source), *base;
+  size_t len;
+
+  if( name == NULL )
+    return NULL;
+  len = strlen(name);
+  while( len > 1 && name[len-1] == '/' )
+    name[--len] = '\0';
+  base = strrchr(name, '/');
+  if( base != NULL && base[1] != '\0' )
+    memmove(name, base + 1, strlen(base));
+  else if( strcmp(name, "/") == 0 )
+    strcpy(name, ".");
+  return name;
+}
+
+
+int archive_trees(struct Action action, char **sources, int n, char **dests,
+		  int ndest, int *status) {
+  /* Write each of the <n> <sources>, and everything under them, into a
+     tar archive at <dests>[0], named by their last parts as `cp -r' would
+     name their copies, and set <status>[i] to 0 for each that made it.
+     Return how many didn't. */
+  char *prefix="archive_trees:", *name;
+  struct Tar tar;
+  int i, failed=0;
+
+  for( i = 0; i < n; i++ )
+    status[i] = EXIT_FAILURE;
+  if( ndest != 1 ) {
+    fprintf(stderr, "%s can't archive to %d files\n", prefix, ndest);
+    return n;
+  }
+  if( !tar_open(&tar, dests[0]) )
+    return n;
+  for( i = 0; i < n; i++ ) {
+    name = arc_name(sources[i]);
+    if( name == NULL ) {
+      archive_error("cannot archive", sources[i], ENOMEM);
+      continue;
+    }
+    if( tar_entry(&tar, AT_FDCWD, sources[i], name) == 0 && tar.err == 0 )
+      status[i] = EXIT_SUCCESS;
+    free(name);
+  }
+  /* nothing is in until the whole archive is */
+  if( !tar_close(&tar) ) {
+    for( i = 0; i < n; i++ )
+      status[i] = EXIT_FAILURE;
+  }
+  if( verbose )
+    printf("%s %ld file%s, %lld bytes%s\n", prefix, tar.files,
+	   tar.files == 1 ? "" : "s", tar.bytes, tar.gzip ? ", gzipped" : "");
+  for( i = 0; i < n; i++ ) {
+    if( status[i] != EXIT_SUCCESS )
+      failed++;
+  }
+  return failed;
+}
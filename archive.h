@@ -0,0 +1,13 @@
+#ifndef archive_h
+#define archive_h
+
+#include "action.h"
+
+#define ARCHIVE_BLOCK 512
+#define ARCHIVE_RECORD (20 * ARCHIVE_BLOCK)	/* what tar pads the end to */
+#define ARCHIVE_PIPE_SIZE (1 << 20)	/* between the archiver and compressor */
+
+int archive_trees(struct Action action, char **sources, int n, char **dests,
+		  int ndest, int *status);
+
+#endif
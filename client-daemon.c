@@ -3,137 +3,250 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include "fls.h"
 #include "client.h"
 #include "comm.h"
-#include "file-info.h"
+#include "client-daemon.h"
 
 
-void push(int s, char *file) {
-  /* Instruct daemon to push <file> onto the stack.
-     Terminate on error. */
-  char buf[FILEPATH_MAX], *fullpath, *prefix="push:";
-  int okay;
-
-  soc_w(s, CMD_PUSH);
-  okay = read_status_okay(s);
-  if( !okay ) {
-    if( soc_r(s, buf, FILEPATH_MAX) <= 0 ) {
-      fprintf(stderr, "%s quitting for read error\n", prefix);
-      exit(EXIT_FAILURE);
+void push(struct Fls *fls, char *file, int at, bool by_fd) {
+  /* Instruct daemon to push <file> onto the stack, going in <at> that
+     many from the top (or from -1 at the bottom), and to hold a
+     descriptor for it if <by_fd>.
+     Terminate on error, other than <file> being in a unique stack already. */
+  char pushed[FILEPATH_MAX];
+  int ret;
+
+  /* a plain push needn't wait for another client to be done */
+  if( by_fd )
+    ret = fls_push_fd(fls, at, file, pushed, sizeof(pushed));
+  else if( at == 0 )
+    ret = fls_push(fls, file, pushed, sizeof(pushed));
+  else
+    ret = fls_insert(fls, at, file, pushed, sizeof(pushed));
+  if( ret == -1 ) {
+    if( strcmp(fls_error(fls), MSG_ERR_DUPLICATE) == 0 ) {
+      fprintf(stderr, "%s: skipping `%s': %s\n", program_name, file, MSG_ERR_DUPLICATE);
+      return;
     }
-    printf("Could not push; received error: `%s'\n", buf);
+    fprintf(stderr, "%s: could not push `%s': %s\n", program_name, file, fls_error(fls));
     exit(EXIT_FAILURE);
   }
+  char *fullpathcolr = color_string(COLR_PATH, pushed);
+  printf("Pushed `%s'\n", fullpathcolr);
+  free(fullpathcolr);
+}
 
-  fullpath = abs_path(file);
-  if( fullpath == NULL ) {
-    fprintf(stderr, "%s: file `%s' does not exist\n", program_name, file);
-    exit(EXIT_FAILURE);
+static void stale_add(int n, const char *now, void *arg) {
+  struct StaleList *list=arg;
+
+  if( list->len == list->cap ) {
+    list->cap = list->cap ? list->cap * 2 : 16;
+    list->v = xrealloc(list->v, list->cap * sizeof(*list->v));
   }
-  soc_w(s, fullpath);
+  list->v[list->len].n = n;
+  list->v[list->len++].now = now != NULL ? xstrdup((char *)now) : NULL;
+}
+
+void stale_get(struct Fls *fls, struct StaleList *list) {
+  /* Set <list> to the entries in the stack that have been deleted or
+     renamed since they were pushed.
+     Terminate on error. */
 
-  okay = read_status_okay(s);
-  if( soc_r(s, buf, FILEPATH_MAX) <= 0 ) {
-    fprintf(stderr, "%s quitting for read error\n", prefix);
+  list->v = NULL;
+  list->len = list->cap = 0;
+  if( fls_stale(fls, stale_add, list) == -1 ) {
+    fprintf(stderr, "%s: %s\n", program_name, fls_error(fls));
     exit(EXIT_FAILURE);
   }
-  if( !okay ) {
-    printf("received error `%s' (stack state debatable)\n", buf);
-  } else {
-    if( strcmp(buf, fullpath) != 0 ) {
-      fprintf(stderr, "%s error: path sent not the same as path pushed\n", prefix);
-      exit(EXIT_FAILURE);
-    }
-    char *fullpathcolr = color_string(COLR_PATH, fullpath);
-    printf("Pushed `%s'\n", fullpathcolr);
-    free(fullpathcolr);
+}
+
+struct Stale *stale_find(struct StaleList *list, int n) {
+  /* Return what <list> says about the <n>th entry, or NULL if it's fine. */
+  int lo=0, hi=list->len, mid;
 
+  while( lo < hi ) {
+    mid = (lo + hi) / 2;
+    if( list->v[mid].n < n )
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  free(fullpath);
+  return lo < list->len && list->v[lo].n == n ? &list->v[lo] : NULL;
 }
 
-bool drop(int s) {
-  /* Instruct daemon to pop a file from the stack.
-     Return whether it could. */
-  char buf[FILEPATH_MAX], *prefix="drop:";
-  int okay;
+void stale_free(struct StaleList *list) {
+  int i;
+
+  for( i = 0; i < list->len; i++ )
+    free(list->v[i].now);
+  free(list->v);
+}
 
-  soc_w(s, CMD_POP);
-  okay = read_status_okay(s);
-  if( soc_r(s, buf, FILEPATH_MAX) <= 0 ) {
-    fprintf(stderr, "%s quitting for read error\n", prefix);
+int stack_size(struct Fls *fls) {
+  /* Return how many files are in the stack.
+     Terminate on error. */
+  int n=fls_size(fls);
+
+  if( n == -1 ) {
+    fprintf(stderr, "%s: %s\n", program_name, fls_error(fls));
     exit(EXIT_FAILURE);
   }
-  if( okay ) {
-    printf("%s\n", buf);
-    return true;
-  } else {
-    fprintf(stderr, "error: `%s'\n", buf);
-    return false;
+  return n;
+}
+
+char *pick(struct Fls *fls, int n) {
+  /* Return a copy of the <n>th item in the stack.
+     Terminate on error. */
+  char buf[FILEPATH_MAX];
+
+  if( fls_pick(fls, n, buf, sizeof(buf)) == -1 ) {
+    printf("error: `%s'\n", fls_error(fls));
+    exit(EXIT_FAILURE);
   }
+  return xstrdup(buf);
 }
 
-void multidrop(int s, int num) {
-  /* Drop <num> files from stack. */
-  char buf[MSG_MAX];
-  int i, instack;
-
-  soc_w(s, CMD_SIZE);
-  soc_r(s, buf, MSG_MAX);
-  instack = atoi(buf);
-  if( num > instack ) {
-    if( instack == 0 )
-      fprintf(stderr, "%s: cannot pop, file stack empty\n", program_name);
-    else
-      fprintf(stderr, "%s: asked to drop %d file%s, only %d in stack\n",
-	      program_name, num, PLURALS(num), instack);
+static void print_dropped(int i, const char *path, int fd, void *arg) {
+  if( fd != -1 )
+    close(fd);
+  printf("%s\n", path);
+}
+
+void multidrop(struct Fls *fls, struct Action action) {
+  /* Drop the files <action> takes from the stack, printing each as it
+     was pushed; they needn't be there any more. */
+  int *positions;
+
+  positions = targets(fls, &action);
+  if( fls_picks(fls, positions, action.num, print_dropped, NULL) == -1 ) {
+    printf("error: `%s'\n", fls_error(fls));
     exit(EXIT_FAILURE);
   }
-  for( i = 0; i < num; i++ ) {
-    if( !drop(s) ) {
-      printf("popped %d file%s\n", i, PLURALS(i));
+  if( fls_remove_all(fls, positions, action.num) == -1 ) {
+    fprintf(stderr, "error: `%s'\n", fls_error(fls));
+    exit(EXIT_FAILURE);
+  }
+  free(positions);
+}
+
+static void print_found(int n, const char *path, void *arg) {
+  char *filecolr = color_string(COLR_PATH, (char *)path);
+  printf("%d: %s\n", n+1, filecolr);
+  free(filecolr);
+}
+
+struct Printing {
+  struct Fls *fls;
+  struct StaleList stale;
+};
+
+static void print_entry(int i, const char *file, int fd, void *arg) {
+  /* Print the <i>th entry, pushed as <file>, for print(). */
+  struct Printing *p=arg;
+  char now[FILEPATH_MAX], *filecolr;
+  struct Stale *st;
+
+  filecolr = color_string(COLR_PATH, (char *)file);
+  printf("%d: %s", i+1, filecolr);
+  free(filecolr);
+  /* say if it has gone anywhere since it was pushed; a descriptor
+     knows best, else the daemon may have seen */
+  st = stale_find(&p->stale, i);
+  if( fd != -1 ) {
+    if( fls_fd_path(p->fls, fd, now, sizeof(now)) == -1 )
+      strcpy(now, "");
+    close(fd);
+  } else if( st != NULL && st->now != NULL )
+    strcpy(now, st->now);
+  else if( st != NULL )
+    strcpy(now, "");
+  else
+    strcpy(now, file);
+  if( now[0] == '\0' ) {
+    filecolr = color_string(COLR_WARN, "deleted since it was pushed");
+    printf(" (%s)", filecolr);
+    free(filecolr);
+  } else if( strcmp(now, file) != 0 ) {
+    filecolr = color_string(COLR_PATH, now);
+    printf(" (now `%s')", filecolr);
+    free(filecolr);
+  }
+  putchar('\n');
+}
+
+void print(struct Fls *fls, struct Action action) {
+  /* Print the contents of the stack for the user, or just the files that
+     match <action.match>, if it has one. */
+  struct Printing p;
+  int i, *positions, stack_len;
+
+  if( action.match != NULL ) {
+    i = fls_find(fls, action.match_kind, action.match, print_found, NULL);
+    if( i == -1 ) {
+      fprintf(stderr, "%s: %s\n", program_name, fls_error(fls));
       exit(EXIT_FAILURE);
     }
+    printf("%d file%s matching `%s'\n", i, PLURALS(i), action.match);
+    return;
   }
+
+  stack_len = stack_size(fls);
+  if( fls->stack[0] != '\0' )
+    printf("%d file%s in stack `%s'\n", stack_len, PLURALS(stack_len), fls->stack);
+  else
+    printf("%d file%s in stack\n", stack_len, PLURALS(stack_len));
+  p.fls = fls;
+  stale_get(fls, &p.stale);
+  positions = xmalloc((stack_len + 1) * sizeof(*positions));
+  for( i = 0; i < stack_len; i++ )
+    positions[i] = i;
+  if( fls_picks(fls, positions, stack_len, print_entry, &p) == -1 ) {
+    printf("error: `%s'\n", fls_error(fls));
+    exit(EXIT_FAILURE);
+  }
+  free(positions);
+  stale_free(&p.stale);
 }
 
-void print(int s) {
-  /* Print the contents of the stack for the user. */
-  char buf[FILEPATH_MAX];
-  int i, stack_size;
-
-  soc_w(s, CMD_SIZE);
-  soc_r(s, buf, MSG_MAX);
-  stack_size = atoi(buf);
-  printf("%d file%s in stack\n", stack_size, PLURALS(stack_size));
-  for( i = 0; i < stack_size; i++ ) {
-    soc_w(s, CMD_PICK);
-    if( !read_status_okay(s) ) {
-      soc_r(s, buf, FILEPATH_MAX);
-      printf("received error `%s'\n", buf);
+static void show_frame(struct Fls *fls, bool quiet) {
+  /* Print the daemon's answer to what was last sent, unless <quiet>.
+     Terminate if there's none, or it isn't framed. */
+  char buf[MSG_MAX + FILEPATH_MAX];
+  bool first=true;
+  int read;
+
+  do {
+    read = soc_get(fls->soc, buf, sizeof(buf));
+    if( read <= 0 ) {
+      if( read < 0 )
+	fprintf(stderr, "Quitting for read error\n");
+      else
+	fprintf(stderr, "Server closed connection\n");
       exit(EXIT_FAILURE);
     }
-    sprintf(buf, "%d", i);
-    soc_w(s, buf);
-    if( !read_status_okay(s) ) {
-      soc_r(s, buf, FILEPATH_MAX);
-      printf("error: `%s'\n", buf);
+    if( buf[0] != FRAME_MORE && buf[0] != FRAME_LAST ) {
+      fprintf(stderr, "Daemon doesn't frame its answers: `%s'\n", buf);
       exit(EXIT_FAILURE);
     }
-    soc_r(s, buf, FILEPATH_MAX);
-    char *filecolr = color_string(COLR_PATH, buf);
-    printf("%d: %s\n", i+1, filecolr);
-    free(filecolr);
-  }
+    /* an empty frame just says it's read */
+    if( !quiet && !(first && buf[0] == FRAME_LAST && buf[1] == '\0') )
+      printf("recv> `%s'\n", buf + 1);
+    first = false;
+  } while( buf[0] == FRAME_MORE );
+  fflush(stdout);
 }
 
-void interactive(int s) {
+void interactive(struct Fls *fls) {
   /* Open an interactive terminal session with the daemon.
      Useful for debugging, not much else. */
   char buf[FILEPATH_MAX+1], *nl;
-  int c, read;
+  int c;
 
+  /* every line then gets one answer, so we know when it's all come */
+  soc_put(fls->soc, CMD_FRAME);
+  show_frame(fls, true);
   while( printf("> "), fgets(buf, FILEPATH_MAX+1, stdin) != NULL ) {
     nl = strchr(buf, '\n');
     if( nl == NULL ) {
@@ -145,48 +258,118 @@ void interactive(int s) {
     *nl = '\0';
     if( strcmp(buf, "q") == 0 )
       break;
-    soc_w(s, buf);
+    soc_put(fls->soc, buf);
+    show_frame(fls, false);
+  }
+}
+
+void rotate(struct Fls *fls, int n) {
+  /* Move the top <n> files to the bottom of the stack. */
 
-    do {
-      if( (read = soc_r(s, buf, FILEPATH_MAX)) > 0 ) {
-	printf("recv> `%s'\n", buf);
-      } else {
-	if( read < 0 )
-	  fprintf(stderr, "Quitting for read error\n");
-	else
-	  fprintf(stderr, "Server closed connection\n");
-	exit(EXIT_FAILURE);
-      }
-      /* check if there's more */
-    } while( readwait(s, 0.2) );
+  if( fls_rotate(fls, n) == -1 ) {
+    fprintf(stderr, "%s: cannot rotate: %s\n", program_name, fls_error(fls));
+    exit(EXIT_FAILURE);
   }
 }
 
-void stop_daemon(int s) {
-  /* Stop the daemon process.
-     Ask the user first, if the stack isn't empty. */
+static bool confirm(char *question) {
+  /* Ask the user <question>; Y is the default.
+     Terminate if they don't want to go on. */
   char buf[MSG_MAX];
 
-  soc_w(s, CMD_SIZE);
-  soc_r(s, buf, MSG_MAX);
-  if( atoi(buf) > 0 ) {
-    printf("Stack not empty, still stop daemon [Yn]?");
-    if( fgets(buf, MSG_MAX, stdin) == NULL ) {
-      printf("error reading from stdin\n");
-      exit(EXIT_FAILURE);
-    }
-    switch (buf[0]) {
-    case '\n':
-    case 'Y': case 'y':
-      break;
-    default:
-      printf("Canceled by user\n");
-      exit(EXIT_FAILURE);
-      break;
-    }
+  printf("%s [Yn]?", question);
+  if( fgets(buf, MSG_MAX, stdin) == NULL ) {
+    printf("error reading from stdin\n");
+    exit(EXIT_FAILURE);
+  }
+  switch (buf[0]) {
+  case '\n':
+  case 'Y': case 'y':
+    return true;
+  default:
+    printf("Canceled by user\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void add_files(const char *name, int files, size_t bytes, void *total) {
+  *(int *)total += files;
+}
+
+static void print_stack(const char *name, int files, size_t bytes, void *arg) {
+  char *namecolr = color_string(COLR_PATH, *name ? (char *)name : "(default)");
+  printf("%s: %d file%s, %zu bytes\n", namecolr, files, PLURALS(files), bytes);
+  free(namecolr);
+}
+
+void list_stacks(struct Fls *fls) {
+  /* Print every stack the daemon has, and what it holds. */
+  int n=fls_stacks(fls, print_stack, NULL);
+
+  if( n == -1 ) {
+    fprintf(stderr, "%s: %s\n", program_name, fls_error(fls));
+    exit(EXIT_FAILURE);
+  }
+  printf("%d stack%s\n", n, PLURALS(n));
+}
+
+void create_stack(struct Fls *fls) {
+  /* Make the selected stack. */
+
+  if( fls_create(fls) == -1 ) {
+    fprintf(stderr, "%s: cannot create stack `%s': %s\n", program_name, fls->stack, fls_error(fls));
+    exit(EXIT_FAILURE);
+  }
+  printf("Created stack `%s'\n", fls->stack);
+}
+
+void destroy_stack(struct Fls *fls) {
+  /* Get rid of the selected stack.
+     Ask the user first, if it isn't empty. */
+
+  if( stack_size(fls) > 0 )
+    confirm("Stack not empty, still destroy it");
+  if( fls_destroy(fls) == -1 ) {
+    fprintf(stderr, "%s: cannot destroy stack `%s': %s\n", program_name, fls->stack, fls_error(fls));
+    exit(EXIT_FAILURE);
+  }
+  printf("Destroyed stack `%s'\n", fls->stack);
+}
+
+void set_unique(struct Fls *fls, bool on) {
+  /* Have the selected stack refuse files in it already, if <on>, or not. */
+
+  if( fls_unique(fls, on) == -1 ) {
+    fprintf(stderr, "%s: cannot change stack `%s': %s\n", program_name, fls->stack, fls_error(fls));
+    exit(EXIT_FAILURE);
+  }
+  printf("Stack `%s' %s\n", fls->stack,
+	 on ? "now refuses files in it already" : "takes files in it already");
+}
+
+void show_progress(struct Fls *fls) {
+  /* Say how far the pop another client of ours is doing has got. */
+  char buf[FILEPATH_MAX];
+
+  if( fls_progress(fls, buf, sizeof(buf)) == -1 ) {
+    fprintf(stderr, "%s: %s\n", program_name, fls_error(fls));
+    exit(EXIT_FAILURE);
+  }
+  printf("%s\n", buf[0] != '\0' ? buf : "no transfer running");
+}
+
+void stop_daemon(struct Fls *fls) {
+  /* Stop the daemon process.
+     Ask the user first, if any of its stacks isn't empty. */
+  int total=0;
+
+  if( fls_stacks(fls, add_files, &total) == -1 ) {
+    fprintf(stderr, "%s: %s\n", program_name, fls_error(fls));
+    exit(EXIT_FAILURE);
   }
-  soc_w(s, CMD_STOP);
-  if( read_status_okay(s) )
+  if( total > 0 )
+    confirm("Stack not empty, still stop daemon");
+  if( fls_stop(fls) == 0 )
     printf("Server shutting down.\n");
   else
     printf("It doesn't want to.\n");
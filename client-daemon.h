@@ -1,6 +1,27 @@
-void push(int s, char *file);
-bool drop(int s);
-void multidrop(int s, int num);
-void print(int s);
-void interactive(int s);
-void stop_daemon(int s);
+struct Stale {
+  int n;			/* where it is in the stack */
+  char *now;			/* where it went, or NULL if it's gone */
+};
+
+struct StaleList {
+  /* Entries the daemon has seen deleted or renamed, in stack order. */
+  struct Stale *v;
+  int len, cap;
+};
+
+void push(struct Fls *fls, char *file, int at, bool by_fd);
+void stale_get(struct Fls *fls, struct StaleList *list);
+struct Stale *stale_find(struct StaleList *list, int n);
+void stale_free(struct StaleList *list);
+int stack_size(struct Fls *fls);
+void multidrop(struct Fls *fls, struct Action action);
+char *pick(struct Fls *fls, int n);
+void print(struct Fls *fls, struct Action action);
+void interactive(struct Fls *fls);
+void rotate(struct Fls *fls, int n);
+void list_stacks(struct Fls *fls);
+void create_stack(struct Fls *fls);
+void destroy_stack(struct Fls *fls);
+void set_unique(struct Fls *fls, bool on);
+void show_progress(struct Fls *fls);
+void stop_daemon(struct Fls *fls);
@@ -5,6 +5,10 @@
 #include <stdbool.h>
 #include <string.h>
 #include <libgen.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "fls.h"
 #include "client.h"
 #include "client-daemon.h"
@@ -12,54 +16,110 @@
 #include "stack.h"
 #include "cmdexec.h"
 #include "file-info.h"
+#include "progress.h"
+#include "plan.h"
 
+#define REPORT_TICK_MS 250	/* between redraws of the progress line */
+#define REPORT_EVERY 4		/* ticks between reports to the daemon */
 
-int collision_check(int s, int n, char *dest) {
-  /* Check if any of the top <n> files in the stack would collide with anything
-     if they were all moved to <dest>.
+struct Reporter {
+  struct Fls *fls;
+  struct Progress *pg;
+  char **sources;
+  int n;
+  bool draw;			/* on stderr, which is a terminal */
+  bool drawn;			/* something is on it */
+};
+
+
+int *targets(struct Fls *fls, struct Action *action) {
+  /* Return where the files <action> takes are in the stack, and set its
+     <num> to how many there are.
+     Terminate if they aren't all there. */
+  int *positions, n, instack;
+
+  n = fls_targets(fls, *action, &positions);
+  if( n == -1 ) {
+    instack = stack_size(fls);
+    if( instack == 0 )
+      fprintf(stderr, "%s: cannot %s, file stack empty\n", program_name, action_verb(action->type));
+    else
+      fprintf(stderr, "%s: cannot %s: %s\n", program_name, action_verb(action->type), fls_error(fls));
+    exit(EXIT_FAILURE);
+  }
+  action->num = n;
+  return positions;
+}
+
+static void clash_add(const char *name, void *arg) {
+  deque_push(arg, xstrdup((char *)name));
+}
+
+static void strings_free(struct Deque *dq) {
+  /* Free <dq>, and the strings in it. */
+  char *dat;
+
+  while( (dat = deque_pop(dq)) != NULL )
+    free(dat);
+  deque_free(dq);
+}
+
+static bool clashing(struct Deque *clashes, char *name) {
+  /* Return whether <name> is one of the <clashes>. */
+  int i;
+
+  for( i = 0; i < clashes->len; i++ ) {
+    if( strcmp(name, deque_nth(clashes, i)) == 0 )
+      return true;
+  }
+  return false;
+}
+
+int collision_check(struct Fls *fls, char **sources, int *positions, int n,
+		    char *dest, bool into_file) {
+  /* Check if any of the <n> <sources>, at <positions> in the stack, would
+     collide with anything if they were all moved to <dest>, or into it,
+     as an archive, if <into_file>.
      Return the number of collisions with files in <dest>.
      Terminate if any of said stack-files would collide with each other. */
   char buf[FILEPATH_MAX], *collisions[n];
-  Node **stack=stack_new();
+  struct Deque names, clashes;
   int i, ncol=0;
-  bool dest_is_dir=isdir(dest);
+  bool dest_is_dir=!into_file && isdir(dest);
 
-  if( n > 1 && !dest_is_dir ) {
+  if( n > 1 && !dest_is_dir && !into_file ) {
     fprintf(stderr, "%s: multi-file target `%s' is not a directory\n",
 	    program_name, dest);
     exit(EXIT_FAILURE);
   }
 
+  /* the daemon knows which names come up more than once in the whole
+     stack, usually none; only sources with one of those can collide */
+  deque_init(&clashes);
+  if( n > 1 && fls_clashes(fls, clash_add, &clashes) == -1 ) {
+    fprintf(stderr, "%s: %s\n", program_name, fls_error(fls));
+    exit(EXIT_FAILURE);
+  }
+  deque_init(&names);
   for( i = 0; i < n; i++ ) {
     int j;
     char *to_push;
-    soc_w(s, CMD_PICK);
-    if( !read_status_okay(s) ) {
-      soc_r(s, buf, FILEPATH_MAX);
-      printf("received error `%s'\n", buf);
-      exit(EXIT_FAILURE);
-    }
-    sprintf(buf, "%d", i);
-    soc_w(s, buf);
-    if( !read_status_okay(s) ) {
-      soc_r(s, buf, FILEPATH_MAX);
-      printf("received error `%s'\n", buf);
-      exit(EXIT_FAILURE);
-    }
-    soc_r(s, buf, FILEPATH_MAX);
+    strcpy(buf, sources[i]);
     to_push = basename(buf);
 
-    for( j = 0; j < i; j++ ) {
-      int ndx=i-j-1;	   /* where stack(j) is, in the daemon's stack */
-      if( strcmp(to_push, stack_nth(j, stack)) == 0 ) {
+    for( j = 0; j < i && clashing(&clashes, to_push); j++ ) {
+      int ndx=i-j-1;	   /* the source names(j) is from */
+      if( strcmp(to_push, deque_nth(&names, j)) == 0 ) {
 	char *collisioncolr = color_string(COLR_PATH, to_push);
+	/* numbered as PRINT numbers them */
 	fprintf(stderr, "%s: Stack items %d and %d are both named `%s', \
-so I'm not going to let you do that.\n", program_name, i, ndx, collisioncolr);
+so I'm not going to let you do that.\n", program_name, positions[ndx] + 1,
+		positions[i] + 1, collisioncolr);
 	free(collisioncolr);
 	usage(EXIT_FAILURE);
       }
     }
-    stack_push(to_push, stack);
+    deque_push(&names, xstrdup(to_push));
   }
 
   if( dest_is_dir ) {
@@ -69,7 +129,7 @@ so I'm not going to let you do that.\n", program_name, i, ndx, collisioncolr);
 	struct dirent *dent;
 	while( (dent = readdir(dir)) ) {
 	  char *dir_basename=dent->d_name;
-	  char *stack_basename=stack_nth(i, stack);
+	  char *stack_basename=deque_nth(&names, i);
 	  if( strcmp(dir_basename, stack_basename) == 0 ) {
 	    collisions[ncol++] = stack_basename;
 	    break;
@@ -105,110 +165,411 @@ so I'm not going to let you do that.\n", program_name, i, ndx, collisioncolr);
     }
     free(ow);
   }
-  stack_free(stack);
+  strings_free(&names);
+  strings_free(&clashes);
   return ncol;
 }
 
-void action_pop(int s, struct Action action, bool interactive) {
-  /* <action> the top file from the stack, and pop it. */
-  char *prefix="action_pop:", *stack_state="stack not altered";
-  char buf[FILEPATH_MAX], *source, *dest, **exargv, *verb=action_verb(action.type);
-  bool remote_error=false;
-  int instack;
-
-  soc_w(s, CMD_SIZE);
-  soc_r(s, buf, MSG_MAX);
-  instack = atoi(buf);
-  if( action.num > instack ) {
-    if( instack == 0 )
-      fprintf(stderr, "%s: cannot pop, file stack empty\n", program_name);
-    else
-      fprintf(stderr, "%s: asked to %s %d file%s, only %d in stack\n",
-	      program_name, verb, action.num, PLURALS(action.num), instack);
+static void print_dests(char **dests, int ndest) {
+  /* Print the quoted list of <dests>. */
+  int i;
+
+  for( i = 0; i < ndest; i++ ) {
+    char *destcolr = color_string(COLR_PATH, dests[i]);
+    printf("%s`%s'", i > 0 ? ", " : "", destcolr);
+    free(destcolr);
+  }
+}
+
+bool cmd_report(struct Action action, char *source, char **dests, int ndest,
+		bool interactive) {
+  /* Report to the user what the command is about to do to the <ndest>
+     <dests>,
+     and, if <interactive>, ask the user whether to continue.
+     Return true if everything's normal,
+     false if user wants to drop without performing the action,
+     or terminate if user didn't want to continue. */
+  char buf[MSG_MAX], *verb=action_verb(action.type);
+  bool cancel=false, do_action=true;
+
+  if( interactive ) {
+    if( action.num > 1 ) {
+      int read_again=true;
+      while( read_again == true ) {
+	printf("%s %d files to ", verb, action.num);
+	print_dests(dests, ndest);
+	printf(" [Yn]?");
+
+	if( fgets(buf, MSG_MAX, stdin) == NULL ) {
+	  printf("error reading from stdin\n");
+	  exit(EXIT_FAILURE);
+	}
+	switch (buf[0]) {
+	case '\n':
+	case 'Y': case 'y':
+	  read_again = false;
+	  break;
+	case 'N': case 'n':
+	  read_again = false;
+	  cancel = true;
+	  break;
+	default:
+	  printf("What?\n");
+	  break;
+	}
+	if( !cancel ) {
+	  char *sourcecolr = color_string(COLR_PATH, source);
+	  printf("%s `%s' to ", verb, sourcecolr);
+	  print_dests(dests, ndest);
+	  printf("\n");
+	  free(sourcecolr);
+	  /* rest of operations are reported noninteractively */
+	}
+      }
+    } else {
+      int read_again=true;
+      while( read_again == true ) {
+	char *sourcecolr = color_string(COLR_PATH, source);
+	printf("%s `%s' to ", verb, sourcecolr);
+	print_dests(dests, ndest);
+	printf(" [Ynd]?");
+	free(sourcecolr);
+	if( fgets(buf, MSG_MAX, stdin) == NULL ) {
+	  printf("error reading from stdin\n");
+	  exit(EXIT_FAILURE);
+	}
+	switch (buf[0]) {
+	case '\n':
+	case 'Y': case 'y':
+	  read_again = false;
+	  break;
+	case 'N': case 'n':
+	  cancel = true;
+	  read_again = false;
+	  break;
+	case 'D': case 'd':
+	  do_action = false;
+	  printf("drop `%s'\n", source);
+	  read_again = false;
+	  break;
+	default:
+	  printf("What?\n");
+	  break;
+	}
+      }
+    }
+  } else { 			/* !interactive */
+    char *sourcecolr = color_string(COLR_PATH, source);
+    printf("%s `%s' to ", verb, sourcecolr);
+    print_dests(dests, ndest);
+    printf("\n");
+    free(sourcecolr);
+  }
+  if( cancel ) {
+    printf("%s canceled by user\n", verb);
     exit(EXIT_FAILURE);
   }
+  return do_action;
+}
+
+static void *count_sources(void *arg) {
+  /* Count what the pop has to do, for the progress line. */
+  struct Reporter *rep=arg;
 
-  soc_w(s, CMD_PEEK);
-  if( !read_status_okay(s) )
-    remote_error = true;
-  if( soc_r(s, buf, FILEPATH_MAX) <= 0 ) {
-    fprintf(stderr, "%s quitting for read error (%s)\n", prefix, stack_state);
+  progress_count(rep->pg, rep->sources, rep->n);
+  return NULL;
+}
+
+static void *report(void *arg) {
+  /* Redraw the progress line now and then until the pop is over, and
+     tell the daemon how it's going, for `fls --progress' elsewhere. */
+  struct Reporter *rep=arg;
+  struct timespec tick={0, REPORT_TICK_MS * 1000000L};
+  char line[FILEPATH_MAX];
+  int ticks;
+
+  for( ticks = 1; !__atomic_load_n(&rep->pg->stop, __ATOMIC_RELAXED); ticks++ ) {
+    nanosleep(&tick, NULL);
+    progress_line(rep->pg, line, sizeof(line));
+    if( rep->draw ) {
+      fprintf(stderr, "\r%s\033[K", line);
+      rep->drawn = true;
+    }
+    if( ticks % REPORT_EVERY == 0 )
+      fls_report(rep->fls, line);
+  }
+  return NULL;
+}
+
+static void show_plan(struct Action action, char **sources, char **dests,
+		      int ndest, const char *rates) {
+  /* Print what <action> would do with <sources>, as text or JSON. */
+  struct Plan plan;
+
+  if( plan_build(&plan, action, sources, action.num, dests, ndest, rates) == -1 )
     exit(EXIT_FAILURE);
+  if( action.flags & ACTION_PLAN_JSON )
+    plan_print_json(&plan, stdout);
+  else
+    plan_print(&plan, stdout);
+  plan_free(&plan);
+}
+
+static void record_rate(struct Action action, struct Progress *pg,
+			char *source, char *dest, const char *rates) {
+  /* Remember how fast the pop <pg> counted went from the device of
+     <source> to that of <dest>, for plans to go by. */
+  struct timespec now;
+  struct stat src, dst;
+  char *dir;
+  double secs;
+
+  if( action.type == SYMLINK || action.type == LINK )
+    return;
+  dir = xstrdup(dest);
+  if( stat(source, &src) == 0
+      && (stat(dest, &dst) == 0 || stat(dirname(dir), &dst) == 0) ) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec - pg->start.tv_sec) + (now.tv_nsec - pg->start.tv_nsec) / 1e9;
+    plan_rate_record(rates, src.st_dev, dst.st_dev, pg->bytes, secs);
   }
-  if( remote_error ) {
-    if( strcmp(buf, MSG_ERR_STACK_EMPTY) == 0 )
-      printf("Could not %s; file stack empty\n", verb);
-    else
-      fprintf(stderr, "%s received error `%s' (%s)\n", prefix, buf, stack_state);
+  free(dir);
+}
+
+struct Sourcing {
+  struct Fls *fls;
+  struct StaleList *stale;
+  int *positions;
+  char **sources;
+  bool *gone;
+};
+
+static void source_of(int i, const char *file, int fd, void *arg) {
+  /* Set the <i>th source to where to take the file picked as <file> from:
+     where its descriptor <fd> says it is, if it was pushed with one, or
+     else where the daemon saw it renamed to.  Mark it gone if it has been
+     deleted since it was pushed, and keep it as it was pushed. */
+  struct Sourcing *sc=arg;
+  char now[FILEPATH_MAX];
+  struct Stale *st;
+
+  sc->gone[i] = false;
+  if( fd != -1 ) {
+    sc->gone[i] = fls_fd_path(sc->fls, fd, now, sizeof(now)) == -1;
+    close(fd);
+    sc->sources[i] = xstrdup(sc->gone[i] ? (char *)file : now);
+    return;
+  }
+  st = stale_find(sc->stale, sc->positions[i]);
+  if( st == NULL || st->now == NULL ) {
+    sc->gone[i] = st != NULL;
+    sc->sources[i] = xstrdup((char *)file);
+    return;
+  }
+  if( verbose )
+    printf("`%s' was renamed to `%s'\n", file, st->now);
+  sc->sources[i] = xstrdup(st->now);
+}
+
+void action_pop(struct Fls *fls, struct Action action, bool interactive) {
+  /* <action> the files it takes from the stack to each of its
+     destinations, and take them out; or, for ACTION_PLAN, only say
+     what that would do. */
+  char *prefix="action_pop:", *stack_state="stack not altered";
+  char buf[FILEPATH_MAX], **sources, **todo=NULL, **dests, *verb=action_verb(action.type);
+  bool *dropped=NULL, *gone, asked=false;
+  int i, j, ntodo, ndest, *status=NULL, *positions;
+  struct StaleList stale;
+  struct Sourcing sc;
+  struct Progress pg;
+  struct Reporter rep;
+  pthread_t counter, reporter;
+  bool counting, reporting;
+
+  positions = targets(fls, &action);
+  /* files renamed since they were pushed are taken from where they went */
+  stale_get(fls, &stale);
+  sources = xmalloc(action.num * sizeof(*sources));
+  gone = xmalloc(action.num * sizeof(*gone));
+  sc = (struct Sourcing){fls, &stale, positions, sources, gone};
+  if( fls_picks(fls, positions, action.num, source_of, &sc) == -1 ) {
+    printf("error: `%s'\n", fls_error(fls));
     exit(EXIT_FAILURE);
   }
-  source = buf;
 
-  dest = real_target(action.ptr);
-  if( interactive )
-    collision_check(s, action.num, dest);
-  if( verbose ) {
-    printf("src: %s\n", source);
-    printf("dst: %s\n", dest);
+  /* no destination means the current directory */
+  ndest = action.ndest > 0 ? action.ndest : 1;
+  dests = xmalloc(ndest * sizeof(*dests));
+  for( i = 0; i < ndest; i++ ) {
+    dests[i] = real_target(action.ndest > 0 ? ((char **)action.ptr)[i] : NULL);
+    for( j = 0; j < i; j++ ) {
+      if( strcmp(dests[i], dests[j]) == 0 ) {
+	fprintf(stderr, "%s: destination `%s' given twice\n", program_name, dests[i]);
+	exit(EXIT_FAILURE);
+      }
+    }
+    if( interactive && !(action.flags & ACTION_PLAN) )
+      collision_check(fls, sources, positions, action.num, dests[i],
+		      action.type == ARCHIVE);
+  }
+  if( action.flags & ACTION_PLAN ) {
+    show_plan(action, sources, dests, ndest, fls->rates);
+    goto out;
   }
 
-  exargv = cmd_gen(action, source, dest); /* copies references, not data */
+  /* only the first report is interactive; it covers the whole lot */
+  todo = xmalloc(action.num * sizeof(*todo));
+  dropped = xmalloc(action.num * sizeof(*dropped));
+  ntodo = 0;
+  for( i = 0; i < action.num; i++ ) {
+    if( verbose ) {
+      printf("src: %s\n", sources[i]);
+      for( j = 0; j < ndest; j++ )
+	printf("dst: %s\n", dests[j]);
+    }
+    if( gone[i] ) {
+      fprintf(stderr, "%s: dropping `%s': deleted since it was pushed\n",
+	      program_name, sources[i]);
+      dropped[i] = true;
+      continue;
+    }
+    dropped[i] = !cmd_report(action, sources[i], dests, ndest, interactive && !asked);
+    asked = true;
+    if( !dropped[i] )
+      todo[ntodo++] = sources[i];
+  }
+
+  status = xmalloc(action.num * sizeof(*status));
+  if( action.hashes == NULL )
+    action.hashes = fls->hashes;
+  progress_init(&pg);
+  action.progress = &pg;
+  rep = (struct Reporter){fls, &pg, todo, ntodo,
+			  (action.flags & ACTION_PROGRESS) && isatty(STDERR_FILENO)};
+  /* progress is only a nicety; pop without it if need be */
+  counting = pthread_create(&counter, NULL, count_sources, &rep) == 0;
+  reporting = pthread_create(&reporter, NULL, report, &rep) == 0;
+  action_run(action, todo, ntodo, dests, ndest, status);
+  __atomic_store_n(&pg.stop, true, __ATOMIC_RELAXED);
+  if( counting )
+    pthread_join(counter, NULL);
+  if( reporting ) {
+    pthread_join(reporter, NULL);
+    fls_report(fls, "");
+  }
+  if( rep.drawn )
+    fputc('\n', stderr);
+  if( action.type == CLONE && !verbose )
+    printf("%s %ld of %ld file%s cloned%s\n", prefix, pg.cloned, pg.files,
+	   PLURALS(pg.files), pg.cloned < pg.files ? ", the rest copied" : "");
+  if( ntodo > 0 )
+    record_rate(action, &pg, todo[0], dests[0], fls->rates);
+  progress_free(&pg);
 
-  if( cmd_report(action, source, dest, interactive)
-      && action_exec(exargv) != 0 ) {
-    fprintf(stderr, "%s copy unsuccessful, aborting... (%s)\n", prefix, stack_state);
+  /* everything up to the first failure comes out of the stack */
+  for( i = j = 0; i < action.num; i++ ) {
+    if( !dropped[i] && status[j++] != 0 )
+      break;
+  }
+  if( fls_remove_all(fls, positions, i) == -1 ) {
+    fprintf(stderr, "%s could not confirm pop from stack (stack state debatable)\n", prefix);
     exit(EXIT_FAILURE);
   }
-  free(dest);
-  free(exargv);
-  soc_w(s, CMD_POP);
-  stack_state = "stack state debatable";
-  if( !read_status_okay(s) ) {
-    fprintf(stderr, "%s could not confirm pop from stack (%s)\n", prefix, stack_state);
+  if( i < action.num ) {
+    if( i > 0 ) {
+      sprintf(buf, "popped %d file%s", i, PLURALS(i));
+      stack_state = buf;
+    }
+    fprintf(stderr, "%s %s unsuccessful, aborting... (%s)\n", prefix, verb, stack_state);
     exit(EXIT_FAILURE);
   }
-  soc_r(s, buf, FILEPATH_MAX);
-  if( --(action.num) > 0 )
-    action_pop(s, action, false);
+
+ out:
+  for( i = 0; i < action.num; i++ )
+    free(sources[i]);
+  free(sources);
+  free(gone);
+  stale_free(&stale);
+  free(todo);
+  free(dropped);
+  free(status);
+  free(positions);
+  for( i = 0; i < ndest; i++ )
+    free(dests[i]);
+  free(dests);
 }
 
-void action_do(struct Action action, int s) {
+void action_do(struct Action action, struct Fls *fls) {
   /* Invoke the proper handler for <action>. */
-  int i;
+  int i, at;
+  char *end;
 
   switch (action.type) {
   case PUSH:
     if( verbose )
       printf("push\n");
+    at = 0;
+    if( action.index != NULL ) {
+      /* one place, in the same terms as fls_targets() */
+      at = strtol(action.index, &end, 10);
+      if( *end != '\0' || at == 0 ) {
+	fprintf(stderr, "%s: FILEs pushed go in at one INDEX, not `%s'\n",
+		program_name, action.index);
+	exit(EXIT_FAILURE);
+      }
+      if( at > 0 )
+	at--;
+    }
     for( i = 0; i < action.num; i++ ) {
-      push(s, ((char**)action.ptr)[i]);
+      push(fls, ((char**)action.ptr)[i], at, action.flags & ACTION_PUSHFD);
     }
     break;
   case DROP:
     if( verbose )
       printf("drop\n");
-    multidrop(s, action.num);
+    multidrop(fls, action);
     break;
   case NOTHING:
   case PRINT:
     if( verbose )
       printf("print\n");
-    print(s);
+    print(fls, action);
     break;
   case COPY:
   case MOVE:
   case SYMLINK:
+  case LINK:
+  case CLONE:
+  case ARCHIVE:
     if( verbose )
       printf("action_pop\n");
-    action_pop(s, action, true);
+    action_pop(fls, action, true);
     break;
   case INTERACTIVE:
     if( verbose )
       printf("interactive mode\n");
-    interactive(s);
+    interactive(fls);
     break;
   case STOP:
-    stop_daemon(s);
+    stop_daemon(fls);
+    break;
+  case ROTATE:
+    rotate(fls, action.num);
+    break;
+  case STACKS:
+    list_stacks(fls);
+    break;
+  case CREATE:
+    create_stack(fls);
+    break;
+  case DESTROY:
+    destroy_stack(fls);
+    break;
+  case UNIQUE:
+    set_unique(fls, action.num);
+    break;
+  case PROGRESS:
+    show_progress(fls);
     break;
   }
 }
@@ -1,7 +1,11 @@
 #include <dirent.h>
 #include "action.h"
+#include "libfls.h"
 
 #define PLURALS(int) (int == 1 ? "" : "s")
 
 
-void action_do(struct Action action, int s);
+int *targets(struct Fls *fls, struct Action *action);
+void action_do(struct Action action, struct Fls *fls);
+bool cmd_report(struct Action action, char *source, char **dests, int ndest,
+		bool interactive);
@@ -6,13 +6,13 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include "fls.h"
-#include "comm.h"
 #include "action.h"
 
 
 char **cmd_gen(struct Action action, char *source, char *dest) {
   /* Return the shell command (in the form of a null-terminated argv)
-     that would perform <action> between <source> and <dest>. */
+     that would perform <action> between <source> and <dest>,
+     or NULL if there isn't one. */
   char **exargv, *prefix="cmd_gen:";
   struct ActionDef *def;
   int i;
@@ -20,10 +20,14 @@ char **cmd_gen(struct Action action, char *source, char *dest) {
   def = action_def(action.type);
   if( def == NULL ) {
     fprintf(stderr, "%s error: unsupported action\n", prefix);
-    exit(EXIT_FAILURE);
+    return NULL;
   }
 
-  exargv = xmalloc(sizeof(char*) * EXEC_ARG_MAX);
+  exargv = malloc(sizeof(char*) * EXEC_ARG_MAX);
+  if( exargv == NULL ) {
+    fprintf(stderr, "%s error: out of memory\n", prefix);
+    return NULL;
+  }
   for( i = 0; i < EXEC_ARG_MAX; i++ ) {
     exargv[i] = def->exargv[i];
   }
@@ -41,10 +45,10 @@ int action_exec(char **exargv) {
 
   pid = fork();
   if( pid == 0 ) {
-    if( execv(exargv[0], exargv) == -1 ) {
-      perror("execv");
-      return -1;
-    }
+    execv(exargv[0], exargv);
+    /* never return into the caller's copy of the program */
+    perror("execv");
+    _exit(127);
   } else if( pid < 0 ) {
     fprintf(stderr,"%s error: couldn't fork\n", prefix);
     return -1;
@@ -71,91 +75,28 @@ int action_exec(char **exargv) {
   return -1;
 }
 
-bool cmd_report(struct Action action, char *source, char *dest, bool interactive) {
-  /* Report to the user what the command is about to do,
-     and, if <interactive>, ask the user whether to continue.
-     Return true if everything's normal,
-     false if user wants to drop without performing the action,
-     or terminate if user didn't want to continue. */
-  char buf[MSG_MAX], *verb=action_verb(action.type);
-  bool cancel=false, do_action=true;
+int action_run(struct Action action, char **sources, int n, char **dests,
+	       int ndest, int *status) {
+  /* Perform <action> from each of the <n> <sources> to the <ndest> <dests>,
+     natively if we know how, otherwise by running its command (which only
+     knows about the first destination) for one source at a time.
+     Set <status>[i] to 0 for each source that made it, and stop running
+     commands after the first one that doesn't.
+     Return 0 if they all made it. */
+  struct ActionDef *def=action_def(action.type);
+  char **exargv;
+  int i;
 
-  if( interactive ) {
-    if( action.num > 1 ) {
-      int read_again=true;
-      while( read_again == true ) {
-	char *destcolr = color_string(COLR_PATH, dest);
-	printf("%s %d files to `%s' [Yn]?", verb, action.num, destcolr);
-	free(destcolr);
-	
-	if( fgets(buf, MSG_MAX, stdin) == NULL ) {
-	  printf("error reading from stdin\n");
-	  exit(EXIT_FAILURE);
-	}
-	switch (buf[0]) {
-	case '\n':
-	case 'Y': case 'y':
-	  read_again = false;
-	  break;
-	case 'N': case 'n':
-	  read_again = false;
-	  cancel = true;
-	  break;
-	default:
-	  printf("What?\n");
-	  break;
-	}
-	if( !cancel ) {
-	  char *sourcecolr = color_string(COLR_PATH, source);
-	  char *destcolr = color_string(COLR_PATH, dest);
-	  printf("%s `%s' to `%s'\n", verb, sourcecolr, destcolr);
-	  free(sourcecolr);
-	  free(destcolr);
-	  /* rest of operations are reported noninteractively */
-	}
-      }
-    } else {
-      int read_again=true;
-      while( read_again == true ) {
-	char *sourcecolr = color_string(COLR_PATH, source);
-	char *destcolr = color_string(COLR_PATH, dest);
-	printf("%s `%s' to `%s' [Ynd]?", verb, sourcecolr, destcolr);
-	free(sourcecolr);
-	free(destcolr);
-	if( fgets(buf, MSG_MAX, stdin) == NULL ) {
-	  printf("error reading from stdin\n");
-	  exit(EXIT_FAILURE);
-	}
-	switch (buf[0]) {
-	case '\n':
-	case 'Y': case 'y':
-	  read_again = false;
-	  break;
-	case 'N': case 'n':
-	  cancel = true;
-	  read_again = false;
-	  break;
-	case 'D': case 'd':
-	  do_action = false;
-	  printf("drop `%s'\n", source);
-	  read_again = false;
-	  break;
-	default:
-	  printf("What?\n");
-	  break;
-	}
-      }
-    }
-  } else { 			/* !interactive */
-    char *sourcecolr = color_string(COLR_PATH, source);
-    char *destcolr = color_string(COLR_PATH, dest);
-    printf("%s `%s' to `%s'\n", verb, sourcecolr, destcolr);
-    free(sourcecolr);
-    free(destcolr);
-  }
-  if( cancel ) {
-    printf("%s canceled by user\n", verb);
-    exit(EXIT_FAILURE);
+  if( def != NULL && def->native != NULL )
+    return def->native(action, sources, n, dests, ndest, status);
+  for( i = 0; i < n; i++ )
+    status[i] = -1;
+  for( i = 0; i < n; i++ ) {
+    exargv = cmd_gen(action, sources[i], dests[0]); /* copies references, not data */
+    status[i] = exargv ? action_exec(exargv) : -1;
+    free(exargv);
+    if( status[i] != 0 )
+      return status[i];
   }
-  return do_action;
+  return 0;
 }
@@ -1,3 +1,4 @@
 char **cmd_gen(struct Action action, char *source, char *dest);
 int action_exec(char **exargv);
-bool cmd_report(struct Action action, char *source, char *dest, bool interactive);
+int action_run(struct Action action, char **sources, int n, char **dests,
+	       int ndest, int *status);
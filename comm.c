@@ -1,162 +1,382 @@
-/* Provide a simple socket communication system. */
+/* Provide a simple socket communication system.  Strings go both ways
+   null-terminated, read and written in bulk through a Soc, so that a run
+   of them costs one system call rather than one each (or one a byte).
+   Someone typing at the daemon can have its answers framed, to know
+   where each ends without waiting to see if there's more. */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include "comm.h"
 #include "fls.h"
 
+/* shared by the client, the daemon and libfls */
+const char *program_name=PROGRAM_NAME;
+int verbose=0;
+bool am_daemon=false;
+const char *soc_path;
 
-int soc_r(int s, char *buf, int blen) {
-  /* Read a string to <buf> from <s>.
-     Return the number of bytes read (including null) on success,
-     0 on broken socket, or -1 on general failure. */
-  char *last_read, *prefix;
-  bool garbage=false;
-  int n;
+static const char *who(void) {
+  return am_daemon ? "daemon: " : "";
+}
 
-  if( am_daemon )
-    prefix = "daemon: revc";
-  else
-    prefix = "recv";
+void soc_init(struct Soc *soc, int s) {
+  /* Set up <soc> for talking over <s>, with nothing in or out yet. */
 
-  if( blen < 1 ) {
-    fprintf(stderr, "%s: unacceptable buffer size of %d\n", prefix, blen);
-    return -1;
+  soc->s = s;
+  soc->in_start = soc->in_end = 0;
+  soc->garbage = false;
+  soc->nfds = soc->nfds_out = 0;
+  soc->out_len = 0;
+  soc->framed = soc->owed = soc->holding = false;
+  soc->held = NULL;
+}
+
+void soc_free(struct Soc *soc) {
+  /* Close the descriptors that came in and weren't taken, or never went
+     out; the socket is the caller's. */
+  int i;
+
+  for( i = 0; i < soc->nfds; i++ ) {
+    if( soc->fds[i] != -1 )
+      close(soc->fds[i]);
   }
-  last_read = buf;
-  n = recv(s, last_read, 1, 0);
+  for( i = 0; i < soc->nfds_out; i++ )
+    close(soc->fds_out[i]);
+  soc->nfds = soc->nfds_out = 0;
+  free(soc->held);
+  soc->held = NULL;
+}
 
-  while(1) {
+int soc_fill(struct Soc *soc, bool wait) {
+  /* Read what there is from the socket into <soc>, waiting for something
+     if <wait>; descriptors that come with it queue up in the order they
+     were sent, a -1 standing in for any there was no room for.
+     Return the number of bytes read, 0 if the other side has gone, or -1
+     on error (with errno EAGAIN if there was nothing, and we weren't to
+     wait). */
+  char cbuf[CMSG_SPACE(SOC_FDS * sizeof(int))];
+  struct iovec iov;
+  struct msghdr msg={0};
+  struct cmsghdr *cmsg;
+  int n, i, nfds, *fds;
+  bool got=false;
 
-    /* check error */
+  if( soc->in_start > 0 ) {
+    memmove(soc->in, soc->in + soc->in_start, soc->in_end - soc->in_start);
+    soc->in_end -= soc->in_start;
+    soc->in_start = 0;
+  }
+  if( soc->in_end == SOC_BUF && !soc_ready(soc) ) {
+    /* no string is this long, so what's there can only be garbage */
+    if( !soc->garbage )
+      fprintf(stderr, "%srecv filled buffer before getting full string\n", who());
+    soc->garbage = true;
+    soc->in_end = 0;
+  }
+  iov.iov_base = soc->in + soc->in_end;
+  iov.iov_len = SOC_BUF - soc->in_end;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  n = recvmsg(soc->s, &msg, MSG_CMSG_CLOEXEC | (wait ? 0 : MSG_DONTWAIT));
+  if( n <= 0 ) {
+    if( n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+      fprintf(stderr, "%s", who());
+      perror("recvmsg");
+    }
+    return n;
+  }
+  soc->in_end += n;
+  for( cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+    if( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS )
+      continue;
+    fds = (int *)CMSG_DATA(cmsg);
+    nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for( i = 0; i < nfds; i++ ) {
+      if( soc->nfds < SOC_FDS_IN )
+	soc->fds[soc->nfds++] = fds[i];
+      else
+	close(fds[i]);
+    }
+    got = true;
+  }
+  if( (msg.msg_flags & MSG_CTRUNC) && !got && soc->nfds < SOC_FDS_IN )
+    soc->fds[soc->nfds++] = -1;
+  return n;
+}
+
+bool soc_ready(struct Soc *soc) {
+  /* Is a whole string waiting in <soc>? */
+
+  return memchr(soc->in + soc->in_start, '\0', soc->in_end - soc->in_start) != NULL;
+}
+
+int soc_get(struct Soc *soc, char *buf, int blen) {
+  /* Take the next string from <soc> into <buf> of <blen> bytes, sending
+     whatever has been put first if we have to wait for it.
+     Return the number of bytes taken (including the null), 0 if the
+     other side has gone, or -1 on error, or if it didn't fit. */
+  char *start, *end;
+  int len, n;
+
+  /* whatever was put since the last one answers it */
+  if( !soc_end(soc) )
+    return -1;
+  while( !soc_ready(soc) ) {
+    if( soc->out_len > 0 || soc->nfds_out > 0 ) {
+      if( !soc_flush(soc) )
+	return -1;
+    }
+    n = soc_fill(soc, true);
     if( n <= 0 ) {
-      if( n == -1 ) {
-	if( errno == EAGAIN || errno == EWOULDBLOCK ) {
-	  /* end of sent */
-	  fprintf(stderr,"%s didn't get full string (%d bytes, no null)\n", prefix, (int)(last_read - buf));
-	  *last_read = 0;
-	  fprintf(stderr,"%s partial message: `%s'\n", prefix, buf);
-	} else
-	  perror(prefix);
-      }
+      if( n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+	fprintf(stderr, "%srecv didn't get full string (%d bytes, no null)\n",
+		who(), soc->in_end - soc->in_start);
       return n;
     }
+  }
+  start = soc->in + soc->in_start;
+  end = memchr(start, '\0', soc->in_end - soc->in_start);
+  len = end - start + 1;
+  soc->in_start += len;
+  if( soc->garbage ) {
+    soc->garbage = false;
+    return -1;
+  }
+  if( len > blen ) {
+    fprintf(stderr, "%srecv string of %d bytes too long for %d\n", who(), len, blen);
+    return -1;
+  }
+  memcpy(buf, start, len);
+  if( verbose )
+    printf("%srecv `%s'\n", who(), buf);
+  soc->owed = soc->framed;
+  return len;
+}
 
-    /* check null */
-    if( *last_read == 0 ) {
-      if( verbose > 1 )
-	printf("%s read null\n", prefix);
-      break;
-    } else {
-      if( verbose > 1 )
-	printf("%s read char %#04x `%c'; %d in string\n", prefix, *last_read, *last_read, (int)(last_read - buf) +1);
-    }
+int soc_get_fd(struct Soc *soc, char *buf, int blen, int *fd) {
+  /* Like soc_get(), for a string that was put with soc_put_fd(): set <fd>
+     to the descriptor that went with it, or -1 if it didn't get here. */
+  int n;
+
+  *fd = -1;
+  n = soc_get(soc, buf, blen);
+  if( soc->nfds > 0 ) {
+    *fd = soc->fds[0];
+    memmove(soc->fds, soc->fds + 1, --soc->nfds * sizeof(*soc->fds));
+  }
+  if( n <= 0 && *fd != -1 ) {
+    close(*fd);
+    *fd = -1;
+  }
+  return n;
+}
 
-    /* check buffer length before reading char */
-    if( ++last_read - buf >= blen ) {
-      /* clear the stream buffer til the next null, what's left can only possibly be garbage */
-      if( !garbage ) {
-	garbage = true;
-	fprintf(stderr,"%s filled buffer before getting full string (%d bytes, no null)\n", prefix, (int)(last_read - buf));
-	*--last_read = 0;
-	fprintf(stderr,"%s first %d bytes of lost message: `%s'\n", prefix, (int)(last_read - buf), buf);
-      } else
-	fprintf(stderr,"%s flopped around a bit while cleaning read buffer\n", prefix);
-      last_read = buf;
+static bool soc_send(struct Soc *soc) {
+  /* Send everything put in <soc> so far, and the descriptors that go with
+     it, in one go as far as the socket will have it.
+     Return whether it all went. */
+  char cbuf[CMSG_SPACE(SOC_FDS * sizeof(int))];
+  struct iovec iov={soc->out, soc->out_len};
+  struct msghdr msg={0};
+  struct cmsghdr *cmsg;
+  bool okay=true;
+  int i, n;
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if( soc->nfds_out > 0 ) {
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(soc->nfds_out * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(soc->nfds_out * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), soc->fds_out, soc->nfds_out * sizeof(int));
+  }
+  while( iov.iov_len > 0 ) {
+    /* a vanished peer is an error to report, not a reason to die */
+    n = sendmsg(soc->s, &msg, MSG_NOSIGNAL);
+    if( n == -1 && errno == EINTR )
+      continue;
+    if( n == -1 ) {
+      fprintf(stderr, "%s", who());
+      perror("send");
+      okay = false;
+      break;
     }
-    n = recv(s, last_read, 1, MSG_DONTWAIT);
+    /* the descriptors went with the first of it */
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+    iov.iov_base = (char *)iov.iov_base + n;
+    iov.iov_len -= n;
   }
+  for( i = 0; i < soc->nfds_out; i++ )
+    close(soc->fds_out[i]);
+  soc->nfds_out = 0;
+  soc->out_len = 0;
+  return okay;
+}
 
-  if( garbage )
-    return -1;
+bool soc_flush(struct Soc *soc) {
+  /* Send everything put in <soc> so far, ending the frame if one is owed.
+     Return whether it all went. */
 
-  if( verbose )
-    printf("%s `%s'\n", prefix, buf);
-  /* +1 to count last_read */
-  return last_read +1 - buf;
+  return soc_end(soc) && soc_send(soc);
 }
 
-void soc_w(int s, char *buf) {
-  /* Quick and dirty write string to socket -
-     expect most error handling to happen on the other side. */
-  char *prefix;
-  int len, n;
+static bool put(struct Soc *soc, char *buf) {
+  /* soc_put(), as it is, framed or not. */
+  int len=strlen(buf) + 1;
+
+  if( len > SOC_BUF - soc->out_len && !soc_send(soc) )
+    return false;
+  /* longer than there is room for, it goes by itself */
+  if( len > SOC_BUF ) {
+    soc->out_len = 0;
+    while( len > 0 ) {
+      memcpy(soc->out, buf, len < SOC_BUF ? len : SOC_BUF);
+      soc->out_len = len < SOC_BUF ? len : SOC_BUF;
+      buf += soc->out_len;
+      len -= soc->out_len;
+      if( !soc_send(soc) )
+	return false;
+    }
+    return true;
+  }
+  memcpy(soc->out + soc->out_len, buf, len);
+  soc->out_len += len;
+  return true;
+}
+
+bool soc_put(struct Soc *soc, char *buf) {
+  /* Put the string <buf> in <soc>, to be sent when the reply to it is
+     wanted, or when there's no room for more.  Framing, it is held back
+     till the next, so that it can say whether it's the last.
+     Return false if sending what was there before failed. */
+  size_t len=strlen(buf);
 
-  if( am_daemon )
-    prefix = "daemon: send";
-  else
-    prefix = "send";
   if( verbose )
-    printf("%sing `%s'\n", prefix, buf);
-  /* add one for the null */
-  len = strlen(buf) +1;
-  n = write(s, buf, len);
-  if( n != len ) {
-    if( n == -1 ) {
-      perror(prefix);
-    } else
-      /* FIXME: should resend the rest */
-      fprintf(stderr, "%s short by %d bytes\n", prefix, len - n);
+    printf("%ssending `%s'\n", who(), buf);
+  if( !soc->framed )
+    return put(soc, buf);
+  if( soc->holding ) {
+    soc->held[0] = FRAME_MORE;
+    soc->holding = false;
+    if( !put(soc, soc->held) )
+      return false;
+  }
+  if( len + 2 > SOC_BUF ) {
+    fprintf(stderr, "%sstring of %zu bytes too long to frame\n", who(), len);
+    return false;
   }
+  /* the first byte is for the mark */
+  memcpy(soc->held + 1, buf, len + 1);
+  soc->holding = true;
+  return true;
 }
 
-bool readwait(int s, float timeout) {
-  /* Return whether socket <s> is ready for reading, after waiting
-     up to <timeout> seconds for that to become true. */
-  struct timeval tv;
-  fd_set readfds;
+bool soc_frame(struct Soc *soc) {
+  /* Answer each string taken from <soc> from now on, the last included,
+     with one frame of what's put before the next is taken.
+     Return false if there's no room to. */
 
-  tv.tv_sec = (int)timeout;
-  tv.tv_usec = (timeout - tv.tv_sec) * 1000000;
+  if( soc->held == NULL )
+    soc->held = malloc(SOC_BUF);
+  if( soc->held == NULL ) {
+    fprintf(stderr, "%s%s\n", who(), strerror(ENOMEM));
+    return false;
+  }
+  soc->framed = soc->owed = true;
+  return true;
+}
 
-  FD_ZERO(&readfds);
-  FD_SET(s, &readfds);
+bool soc_end(struct Soc *soc) {
+  /* End the frame owed for the last string taken from <soc>, if any;
+     it goes with the next flush. */
+  char empty[]={FRAME_LAST, '\0'};
 
-  if( select(s+1, &readfds, NULL, NULL, &tv) )
+  if( !soc->owed )
     return true;
-  return false;
+  soc->owed = false;
+  if( !soc->holding )
+    return put(soc, empty);
+  soc->held[0] = FRAME_LAST;
+  soc->holding = false;
+  return put(soc, soc->held);
 }
 
-bool read_status_okay(int s) {
-  /* Read status message from socket <s>.
-     Return true if successfully read MSG_SUCCESS,
-     false otherwise. */
-  char buf[MSG_MAX];
-  if( soc_r(s, buf, MSG_MAX) > 0 && strcmp(buf, MSG_SUCCESS) == 0 )
-    return true;
-  return false;
+bool soc_put_fd(struct Soc *soc, char *buf, int fd) {
+  /* Like soc_put(), but send <fd> along with the string, unless it is -1.
+     It goes as it is now; the caller can close it. */
+
+  if( fd == -1 )
+    return soc_put(soc, buf);
+  if( soc->nfds_out == SOC_FDS && !soc_send(soc) )
+    return false;
+  fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if( fd == -1 ) {
+    fprintf(stderr, "%s", who());
+    perror("dup");
+    return false;
+  }
+  /* with its string, so they go together if the string won't fit */
+  if( strlen(buf) + 1 > (size_t)(SOC_BUF - soc->out_len) && !soc_send(soc) ) {
+    close(fd);
+    return false;
+  }
+  soc->fds_out[soc->nfds_out++] = fd;
+  return soc_put(soc, buf);
 }
 
-int client_connect() {
-  /* Return a socket that is connected to the daemon. */
+int soc_connect(const char *path) {
+  /* Return a socket connected to the daemon listening at <path>,
+     or -1 (with errno set) if there isn't one. */
   struct sockaddr_un sockaddr;
-  int s, len;
+  int s, len, err;
 
-  s = socket(AF_UNIX,SOCK_STREAM, 0);
-  if( s == -1 ) {
-    perror("socket");
-    exit(EXIT_FAILURE);
+  if( strlen(path) >= sizeof(sockaddr.sun_path) ) {
+    errno = ENAMETOOLONG;
+    return -1;
   }
+  s = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if( s == -1 )
+    return -1;
 
   if( verbose )
     printf("Trying to connect...\n");
   sockaddr.sun_family = AF_UNIX;
-  strcpy(sockaddr.sun_path, soc_path);
+  strcpy(sockaddr.sun_path, path);
   len = strlen(sockaddr.sun_path) + sizeof(sockaddr.sun_family);
   if( connect(s, (struct sockaddr*)&sockaddr, len) == -1 ) {
-    if( errno == ECONNREFUSED ){
-      fprintf(stderr, "No-one listening at `%s'.\n", soc_path);
-      exit(EXIT_FAILURE);
-    }
-    perror("connect");
-    exit(EXIT_FAILURE);
+    err = errno;
+    close(s);
+    errno = err;
+    return -1;
   }
   if( verbose )
     printf("Connected.\n");
   return s;
 }
+
+bool stack_name_okay(const char *name) {
+  /* Return whether <name> can name a stack: short enough, and with no
+     spaces or control characters to confuse the protocol. */
+  const char *c;
+
+  if( strlen(name) >= STACK_NAME_MAX )
+    return false;
+  for( c = name; *c; c++ ) {
+    if( (unsigned char)*c <= ' ' || *c == 0x7f )
+      return false;
+  }
+  return true;
+}
@@ -3,20 +3,88 @@
 #define FILEPATH_MAX 2000
 #define MSG_MAX 100
 #define MSG_SUCCESS "okay"
+#define MSG_SUCCESS_FD "okay fd"	/* and what follows comes with a descriptor */
 #define MSG_ERROR "error"
 #define MSG_ERR_STACK_EMPTY "file stack empty"
 #define MSG_ERR_STACK_FULL "file stack full"
 #define MSG_ERR_LENGTH "file path too long"
+#define MSG_ERR_DEPTH "stack is not quite that deep"
+#define MSG_ERR_MATCH "bad match, want \"glob|substr|prefix PATTERN\""
+#define MSG_ERR_TOO_FEW "fewer than two files in stack"
+#define MSG_ERR_NO_STACK "no such stack"
+#define MSG_ERR_STACK_EXISTS "stack already exists"
+#define MSG_ERR_STACK_NAME "bad stack name"
+#define MSG_ERR_NO_ROOM "daemon out of room"
+#define MSG_ERR_DUPLICATE "already in the stack"
+#define MSG_ERR_FDS "too many files held open"
+#define STACK_NAME_MAX 64	/* FLS_NAME_MAX in libfls.h */
+/* every command may be followed by a space and the name of the stack it
+   is for; without one it is for the default stack */
 #define CMD_PUSH "push"
 #define CMD_POP  "pop"
+#define CMD_UNSHIFT "unshift"	/* push, and pop, at the bottom */
+#define CMD_SHIFT   "shift"
+#define CMD_INSERT  "insert"	/* and take out, anywhere in the stack */
+#define CMD_PUSHFD  "pushfd"	/* insert, with an O_PATH descriptor to hold */
+#define CMD_REMOVE  "remove"
+#define CMD_TAKE    "take"	/* a range of them: "FROM TO", inclusive */
+#define CMD_FIND    "find"	/* entries matching "KIND PATTERN" */
+#define CMD_ROTATE  "rotate"
+#define CMD_SWAP    "swap"
+#define CMD_UNIQUE  "unique"	/* "1" to refuse paths in already, "0" not to */
+#define CMD_CLASHES "clashes"	/* the names more than one entry has */
+#define CMD_STALE   "stale"	/* entries deleted or renamed since they were pushed */
 #define CMD_PEEK "peek"
-#define CMD_PICK "pick"
+#define CMD_PICK "pick"		/* with the descriptor it was pushed with, if any (MSG_SUCCESS_FD) */
 #define CMD_SIZE "size"
 #define CMD_STOP "stop"
+#define CMD_CREATE  "create"
+#define CMD_DESTROY "destroy"
+#define CMD_STACKS  "stacks"
+#define CMD_REPORT   "report"	/* how the sender's transfer is going */
+#define CMD_PROGRESS "progress"	/* the last report, even while the stack is busy */
+#define CMD_FRAME "frame"	/* from now on, answer each string sent with a frame */
+#define CMD_RELEASE "release"	/* let the user's other connections in until the next command */
 
-const char *soc_path;
-int soc_r(int s, char *buf, int blen);
-void soc_w(int s, char *buf);
-bool readwait(int s, float timeout);
-bool read_status_okay(int s);
-int client_connect();
+/* In a frame, every string starts with FRAME_MORE but the last, which
+   starts with FRAME_LAST; that alone is a frame with nothing in it. */
+#define FRAME_MORE '+'
+#define FRAME_LAST '.'
+
+#define SOC_BUF 8192		/* buffered each way; room for a few paths */
+#define SOC_FDS 16		/* descriptors sent at once */
+#define SOC_FDS_IN 64		/* come in and not taken yet */
+
+struct Soc {
+  /* A connection, with what has come in and not been taken yet, and what
+     has been put to go out and not sent yet. */
+  int s;
+  char in[SOC_BUF];
+  int in_start, in_end;
+  bool garbage;			/* skipping the rest of a string too long to take */
+  int fds[SOC_FDS_IN];		/* came in, oldest first */
+  int nfds;
+  char out[SOC_BUF];
+  int out_len;
+  int fds_out[SOC_FDS];		/* to go with what's in <out> */
+  int nfds_out;
+  bool framed;			/* answering in frames */
+  bool owed;			/* a frame, for the last string taken */
+  char *held;			/* the last string put, till we know if it ends the frame */
+  bool holding;
+};
+
+extern const char *soc_path;
+void soc_init(struct Soc *soc, int s);
+void soc_free(struct Soc *soc);
+int soc_fill(struct Soc *soc, bool wait);
+bool soc_ready(struct Soc *soc);
+int soc_get(struct Soc *soc, char *buf, int blen);
+int soc_get_fd(struct Soc *soc, char *buf, int blen, int *fd);
+bool soc_put(struct Soc *soc, char *buf);
+bool soc_put_fd(struct Soc *soc, char *buf, int fd);
+bool soc_flush(struct Soc *soc);
+bool soc_frame(struct Soc *soc);
+bool soc_end(struct Soc *soc);
+int soc_connect(const char *path);
+bool stack_name_okay(const char *name);
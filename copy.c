@@ -0,0 +1,1706 @@
+/* Copy files and directory trees natively, walking directories on a
+   work-stealing pool of threads. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/fs.h>
+#include "fls.h"
+#include "copy.h"
+#include "uring.h"
+#include "hash.h"
+#include "hashcache.h"
+#include "progress.h"
+
+#define DENTS_BUF_SIZE (32 * 1024)
+#define LINKMAP_MIN 64
+#define PART_SUFFIX ".fls-part"	/* resumable copies, until they're done */
+#define PART_REC_MAX 128
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct Root {
+  /* One popped entry: the directory it is copied from, and the <ndst>
+     it is copied into. */
+  int srcfd;
+  char *src, *srcname;
+  int ndst;
+  int dstfd[COPY_DEST_MAX];
+  int treefd[COPY_DEST_MAX];	/* each copy, once it's a directory */
+  char *dst[COPY_DEST_MAX], *dstname[COPY_DEST_MAX];
+  bool isdir;
+  int errors;
+};
+
+struct DirRef {
+  /* A source directory and its copies, open, and shared by every task
+     that still needs to create something inside them. */
+  struct Root *root;
+  int srcfd, dstfd[COPY_DEST_MAX];
+  char *path;			/* relative to the root's copies */
+  mode_t mode;
+  bool fixmode;
+  struct stat *keep;		/* times and owner to put back, or NULL */
+  int refs;
+};
+
+struct Task {
+  struct DirRef *parent;
+  char *name;
+  bool isroot;			/* named after Root.dstname in each copy */
+  bool isdir;
+};
+
+struct Deque {
+  /* Owner pushes and pops at the tail, thieves take from the head. */
+  pthread_mutex_t lock;
+  struct Task *items;
+  int head, tail, cap;
+};
+
+struct LinkEnt {
+  dev_t dev;
+  ino_t ino;
+  struct Root *root;
+  char *path;			/* relative to root->treefd, or "" for the root */
+};
+
+struct LinkMap {
+  /* Open-addressed (dev, ino, root) -> destination path, for hard links
+     within each tree. */
+  pthread_mutex_t lock;
+  struct LinkEnt *ents;
+  size_t cap, len;
+};
+
+struct Pool {
+  int nworkers;
+  struct Deque *deques;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int pending;			/* tasks queued or running */
+  int queued;			/* tasks sitting in a deque */
+  long files, bytes, skipped, cloned;
+  struct LinkMap links;
+  struct HashCache *hashes;	/* for --skip-identical */
+  struct Uring *uring;		/* NULL for synchronous copies */
+  int flags;			/* from Action.flags */
+  struct Progress *progress;	/* from Action.progress */
+};
+
+struct Worker {
+  struct Pool *pool;
+  int id;
+  char *buf;
+};
+
+struct FileJob {
+  struct UringJob job;		/* must be first */
+  struct Pool *pool;
+  struct DirRef *src, *dst;
+  int dest[COPY_DEST_MAX];	/* which of the root's each job.dstdir is */
+  char *path;
+  struct stat st;
+  struct Hash hash;
+};
+
+
+static char *full_path(struct Root *root, int d, char *path, char *buf) {
+  /* Return <path> under the root's copy in destination <d> (or under its
+     source, if <d> is -1) as the user would know it, using <buf> of
+     PATH_MAX bytes if need be. */
+  char *base=(d < 0 ? root->src : root->dst[d]);
+
+  if( *path == '\0' )
+    return base;
+  snprintf(buf, PATH_MAX, "%s/%s", base, path);
+  return buf;
+}
+
+static void copy_error(struct Root *root, int d, char *what, char *path,
+		       int err) {
+  /* Complain about <path> in destination <d> (see full_path()), and
+     remember that <root> went wrong. */
+  char buf[PATH_MAX];
+
+  fprintf(stderr, "%s: %s `%s': %s\n", program_name, what,
+	  full_path(root, d, path, buf), strerror(err));
+  __atomic_add_fetch(&root->errors, 1, __ATOMIC_RELAXED);
+}
+
+static char *path_join(char *dir, char *name) {
+  /* Return a new string "<dir>/<name>", or just <name> if <dir> is empty. */
+  char *joined;
+
+  if( *dir == '\0' )
+    return strdup(name);
+  joined = malloc(strlen(dir) + 1 + strlen(name) +1);
+  if( joined != NULL )
+    sprintf(joined, "%s/%s", dir, name);
+  return joined;
+}
+
+
+static struct DirRef *dirref_new(struct Root *root, int srcfd, int *dstfd,
+				 char *path, mode_t mode, bool fixmode) {
+  /* Return a DirRef holding one reference, and each of the root's
+     destinations in <dstfd>, or NULL on allocation failure. */
+  struct DirRef *ref=malloc(sizeof(*ref));
+  int d;
+
+  if( ref == NULL )
+    return NULL;
+  ref->root = root;
+  ref->srcfd = srcfd;
+  for( d = 0; d < root->ndst; d++ )
+    ref->dstfd[d] = dstfd[d];
+  ref->path = path;
+  ref->mode = mode;
+  ref->fixmode = fixmode;
+  ref->keep = NULL;
+  ref->refs = 1;
+  return ref;
+}
+
+static void dirref_hold(struct DirRef *ref) {
+  __atomic_add_fetch(&ref->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void dirref_release(struct DirRef *ref) {
+  /* Drop a reference to <ref>; the last one out restores the directory's
+     real permissions and closes it. */
+
+  int d;
+
+  if( __atomic_sub_fetch(&ref->refs, 1, __ATOMIC_ACQ_REL) > 0 )
+    return;
+  for( d = 0; d < ref->root->ndst; d++ ) {
+    if( ref->fixmode )
+      fchmod(ref->dstfd[d], ref->mode);
+    if( ref->keep != NULL ) {
+      struct timespec times[2]={ref->keep->st_atim, ref->keep->st_mtim};
+      if( geteuid() == 0 )
+	fchown(ref->dstfd[d], ref->keep->st_uid, ref->keep->st_gid);
+      futimens(ref->dstfd[d], times);
+    }
+    close(ref->dstfd[d]);
+  }
+  free(ref->keep);
+  close(ref->srcfd);
+  free(ref->path);
+  free(ref);
+}
+
+
+static bool deque_push(struct Deque *dq, struct Task task) {
+  /* Push <task> onto the tail of <dq>.  Return false if out of memory. */
+  bool okay=true;
+
+  pthread_mutex_lock(&dq->lock);
+  if( dq->tail == dq->cap ) {
+    int live = dq->tail - dq->head;
+    if( dq->head > 0 && live < dq->cap / 2 ) {
+      memmove(dq->items, &dq->items[dq->head], live * sizeof(*dq->items));
+    } else {
+      int cap = dq->cap ? dq->cap * 2 : 64;
+      struct Task *items = realloc(dq->items, cap * sizeof(*items));
+      if( items == NULL ) {
+	okay = false;
+	goto out;
+      }
+      memmove(items, &items[dq->head], live * sizeof(*items));
+      dq->items = items;
+      dq->cap = cap;
+    }
+    dq->head = 0;
+    dq->tail = live;
+  }
+  dq->items[dq->tail++] = task;
+ out:
+  pthread_mutex_unlock(&dq->lock);
+  return okay;
+}
+
+static bool deque_take(struct Deque *dq, struct Task *task, bool steal) {
+  /* Take a task from <dq>: from the tail if we own it, the head if we
+     are stealing.  Return whether there was one. */
+  bool found=false;
+
+  pthread_mutex_lock(&dq->lock);
+  if( dq->tail > dq->head ) {
+    *task = steal ? dq->items[dq->head++] : dq->items[--dq->tail];
+    found = true;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return found;
+}
+
+
+static void pool_push(struct Pool *pool, int self, struct DirRef *parent,
+		      char *name) {
+  /* Queue the directory <name> in <parent> for worker <self>. */
+  struct Task task;
+
+  task.parent = parent;
+  task.name = strdup(name);
+  task.isroot = false;
+  task.isdir = true;
+  if( task.name == NULL ) {
+    copy_error(parent->root, -1, "cannot queue", name, ENOMEM);
+    return;
+  }
+  dirref_hold(parent);
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+  if( !deque_push(&pool->deques[self], task) ) {
+    copy_error(parent->root, -1, "cannot queue", name, ENOMEM);
+    free(task.name);
+    dirref_release(parent);
+    __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+    return;
+  }
+  __atomic_add_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static bool pool_take(struct Pool *pool, int self, struct Task *task) {
+  /* Find work for worker <self>, stealing from the others if our own
+     deque is empty. */
+  int i;
+
+  if( deque_take(&pool->deques[self], task, false) )
+    goto found;
+  for( i = 1; i < pool->nworkers; i++ ) {
+    if( deque_take(&pool->deques[(self + i) % pool->nworkers], task, true) )
+      goto found;
+  }
+  return false;
+ found:
+  __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_ACQ_REL);
+  return true;
+}
+
+
+static void open_outs(struct DirRef *dst, char **names, bool *wanted,
+		      struct stat *st, int *out, int *err) {
+  /* Create <names>[d] in each destination of <dst> that is <wanted>,
+     setting <out>[d] to it, or -1 and <err>[d] to why not. */
+  int d;
+
+  for( d = 0; d < dst->root->ndst; d++ ) {
+    if( !wanted[d] )
+      continue;
+    out[d] = openat(dst->dstfd[d], names[d], O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,
+		    st->st_mode & 07777);
+    if( out[d] == -1 )
+      err[d] = errno;
+  }
+}
+
+static size_t link_hash(dev_t dev, ino_t ino, struct Root *root) {
+  return ino * 31 + dev + (uintptr_t)root / sizeof(*root);
+}
+
+static struct LinkEnt *linkmap_claim(struct Pool *pool, struct stat *st,
+				     struct DirRef *dst, char *path,
+				     char **names, bool *wanted, int *out,
+				     int *err) {
+  /* Remember that (dev, ino) of <st> is being copied to <path>, and create
+     its copies (see open_outs()) while nobody else can see the entry.
+     If it was already claimed in the same tree, return the first copy
+     instead: separate entries on the stack get copies of their own, as
+     they would from separate `cp -r's. */
+  struct LinkMap *map=&pool->links;
+  struct LinkEnt *ent;
+  size_t i;
+
+  pthread_mutex_lock(&map->lock);
+  if( (map->len + 1) * 2 > map->cap ) {
+    size_t cap = map->cap ? map->cap * 2 : LINKMAP_MIN;
+    struct LinkEnt *ents = calloc(cap, sizeof(*ents));
+    if( ents == NULL )
+      goto create;		/* just don't preserve this one */
+    for( i = 0; i < map->cap; i++ ) {
+      size_t j;
+      if( map->ents[i].path == NULL )
+	continue;
+      j = link_hash(map->ents[i].dev, map->ents[i].ino, map->ents[i].root) & (cap - 1);
+      while( ents[j].path != NULL )
+	j = (j + 1) & (cap - 1);
+      ents[j] = map->ents[i];
+    }
+    free(map->ents);
+    map->ents = ents;
+    map->cap = cap;
+  }
+  i = link_hash(st->st_dev, st->st_ino, dst->root) & (map->cap - 1);
+  for( ent = &map->ents[i]; ent->path != NULL; ent = &map->ents[i] ) {
+    if( ent->ino == st->st_ino && ent->dev == st->st_dev && ent->root == dst->root ) {
+      pthread_mutex_unlock(&map->lock);
+      return ent;
+    }
+    i = (i + 1) & (map->cap - 1);
+  }
+  ent->path = strdup(path);
+  if( ent->path != NULL ) {
+    ent->dev = st->st_dev;
+    ent->ino = st->st_ino;
+    ent->root = dst->root;
+    map->len++;
+  }
+ create:
+  open_outs(dst, names, wanted, st, out, err);
+  pthread_mutex_unlock(&map->lock);
+  return NULL;
+}
+
+static bool make_room(int dirfd, char *name) {
+  /* Creating <name> in <dirfd> just failed: if that was because something
+     is there already, take it away, unless it's a directory, the way
+     `cp' replaces what it copies over.  Return whether to try again. */
+
+  return errno == EEXIST && unlinkat(dirfd, name, 0) == 0;
+}
+
+static int link_first(struct LinkEnt *first, int d, int dirfd, char *name) {
+  /* Hard link <name> in <dirfd> to the copy of <first> in destination <d>. */
+
+  if( *first->path == '\0' )
+    return linkat(first->root->dstfd[d], first->root->dstname[d], dirfd, name, 0);
+  return linkat(first->root->treefd[d], first->path, dirfd, name, 0);
+}
+
+static void linkmap_free(struct LinkMap *map) {
+  size_t i;
+
+  for( i = 0; i < map->cap; i++ )
+    free(map->ents[i].path);
+  free(map->ents);
+}
+
+
+static int copy_data(int in, int *out, int *err, int nout, char *buf,
+		     long *copied, struct Hash *hash, struct Progress *pg,
+		     int slot) {
+  /* Copy everything from <in> to each of the <nout> <out>s that isn't -1,
+     setting <err>[i] if writing <out>[i] fails.  A lone destination is
+     copied in-kernel if we can, unless the data has to go past <hash> on
+     the way; any more share one read of the source.  Count it in <pg>
+     (if not NULL) for the copier in <slot> as it goes.
+     Return 0, or an errno value if <in> couldn't be read. */
+  ssize_t n;
+  int i, live=0, only=-1;
+  bool kernel;
+
+  for( i = 0; i < nout; i++ ) {
+    if( out[i] != -1 )
+      live++, only = i;
+  }
+  kernel = (live == 1 && hash == NULL);
+  *copied = 0;
+  while( kernel ) {
+    n = copy_file_range(in, NULL, out[only], NULL,
+			pg != NULL ? PROGRESS_CHUNK : SIZE_MAX >> 2, 0);
+    if( n == 0 )
+      return 0;
+    if( n < 0 ) {
+      if( *copied == 0 && (errno == EXDEV || errno == ENOSYS
+			   || errno == EINVAL || errno == EOPNOTSUPP) )
+	kernel = false;
+      else {
+	err[only] = errno;
+	return 0;
+      }
+    } else {
+      *copied += n;
+      progress_add(pg, slot, n);
+    }
+  }
+  while( live > 0 && (n = read(in, buf, COPY_BUF_SIZE)) != 0 ) {
+    if( n < 0 ) {
+      if( errno == EINTR )
+	continue;
+      return errno;
+    }
+    if( hash != NULL )
+      hash_update(hash, buf, n);
+    for( i = 0; i < nout; i++ ) {
+      char *p=buf;
+      ssize_t left=n;
+      if( out[i] == -1 || err[i] != 0 )
+	continue;
+      while( left > 0 ) {
+	ssize_t w = write(out[i], p, left);
+	if( w < 0 ) {
+	  if( errno == EINTR )
+	    continue;
+	  err[i] = errno;
+	  live--;
+	  break;
+	}
+	p += w;
+	left -= w;
+      }
+    }
+    *copied += n;
+    progress_add(pg, slot, n);
+  }
+  return 0;
+}
+
+static bool file_hash(struct Pool *pool, int dirfd, char *name,
+		      struct stat *st, char *buf, uint64_t *hash) {
+  /* Set <hash> to the content hash of <name> in <dirfd>, which <st>
+     describes, reading it only if the cache doesn't know it already.
+     Return false if it couldn't be read. */
+  struct Hash h;
+  ssize_t n;
+  int fd;
+
+  if( pool->hashes != NULL && hashcache_get(pool->hashes, st, hash) )
+    return true;
+  fd = openat(dirfd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+  if( fd == -1 )
+    return false;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  hash_init(&h);
+  while( (n = read(fd, buf, COPY_BUF_SIZE)) != 0 ) {
+    if( n < 0 ) {
+      if( errno == EINTR )
+	continue;
+      close(fd);
+      return false;
+    }
+    hash_update(&h, buf, n);
+  }
+  close(fd);
+  *hash = hash_final(&h);
+  if( pool->hashes != NULL )
+    hashcache_put(pool->hashes, st, *hash);
+  return true;
+}
+
+static bool identical(struct Worker *w, struct DirRef *src, char *srcname,
+		      struct stat *st, int dstfd, char *dstname) {
+  /* Return whether <dstname> in <dstfd> already holds what <srcname> in
+     <src> does: the same size and mtime, or, if only the size matches,
+     the same contents. */
+  struct stat dst_st;
+  uint64_t srchash, dsthash;
+
+  if( fstatat(dstfd, dstname, &dst_st, AT_SYMLINK_NOFOLLOW) == -1
+      || !S_ISREG(dst_st.st_mode) || dst_st.st_size != st->st_size )
+    return false;
+  if( dst_st.st_mtim.tv_sec == st->st_mtim.tv_sec
+      && dst_st.st_mtim.tv_nsec == st->st_mtim.tv_nsec )
+    return true;
+  if( !file_hash(w->pool, src->srcfd, srcname, st, w->buf, &srchash)
+      || !file_hash(w->pool, dstfd, dstname, &dst_st, w->buf, &dsthash)
+      || srchash != dsthash )
+    return false;
+  /* line the times up, so next time the quick check is enough */
+  if( w->pool->flags & ACTION_PRESERVE ) {
+    struct timespec times[2]={st->st_atim, st->st_mtim};
+    utimensat(dstfd, dstname, times, AT_SYMLINK_NOFOLLOW);
+  }
+  return true;
+}
+
+static bool same_link(int dstfd, char *dstname, char *target) {
+  /* Return whether <dstname> in <dstfd> is a symlink to <target> already. */
+  char now[PATH_MAX];
+  ssize_t n;
+
+  n = readlinkat(dstfd, dstname, now, sizeof(now) - 1);
+  if( n < 0 )
+    return false;
+  now[n] = '\0';
+  return strcmp(now, target) == 0;
+}
+
+static void keep_attrs(struct Root *root, int d, int dirfd, char *name,
+		       char *path, struct stat *st) {
+  /* Give <name> in <dirfd>, destination <d>'s <path>, the times (and
+     owner, if we can) of <st>. */
+  struct timespec times[2]={st->st_atim, st->st_mtim};
+
+  if( geteuid() == 0
+      && fchownat(dirfd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW) == -1 )
+    copy_error(root, d, "cannot keep owner of", path, errno);
+  if( utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW) == -1 )
+    copy_error(root, d, "cannot keep times of", path, errno);
+}
+
+static void verify_file(struct Root *root, int d, int dirfd, char *name,
+			char *path, uint64_t want) {
+  /* Read <name> in <dirfd>, destination <d>'s <path>, back from the disk,
+     and complain unless it hashes to <want>. */
+  struct Hash hash;
+  char *buf, full[PATH_MAX];
+  ssize_t n;
+  int fd;
+
+  fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC);
+  if( fd == -1 ) {
+    copy_error(root, d, "cannot verify", path, errno);
+    return;
+  }
+  if( posix_memalign((void **)&buf, 4096, COPY_BUF_SIZE) != 0 ) {
+    copy_error(root, d, "cannot verify", path, ENOMEM);
+    close(fd);
+    return;
+  }
+  /* get it onto the disk, then skip the page cache on the way back */
+  if( fdatasync(fd) == -1 ) {
+    copy_error(root, d, "cannot sync", path, errno);
+    goto out;
+  }
+  if( fcntl(fd, F_SETFL, O_DIRECT) == -1 )
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  hash_init(&hash);
+  while( (n = read(fd, buf, COPY_BUF_SIZE)) != 0 ) {
+    if( n < 0 ) {
+      if( errno == EINTR )
+	continue;
+      copy_error(root, d, "cannot verify", path, errno);
+      goto out;
+    }
+    hash_update(&hash, buf, n);
+  }
+  if( hash_final(&hash) != want ) {
+    fprintf(stderr, "%s: verification failed for `%s'\n", program_name,
+	    full_path(root, d, path, full));
+    __atomic_add_fetch(&root->errors, 1, __ATOMIC_RELAXED);
+  }
+
+ out:
+  free(buf);
+  close(fd);
+}
+
+static void file_free(struct FileJob *fj) {
+  dirref_release(fj->src);
+  dirref_release(fj->dst);
+  free(fj->job.srcname);
+  free(fj->job.dstname);
+  free(fj->path);
+  free(fj);
+}
+
+static void file_finish(struct FileJob *fj) {
+  /* Put back what the ring didn't, check it, and let go of <fj>. */
+  struct Root *root=fj->dst->root;
+  uint64_t want=hash_final(&fj->hash);
+  int i;
+
+  for( i = 0; i < fj->job.ndst; i++ ) {
+    int d=fj->dest[i];
+    if( fj->pool->flags & ACTION_PRESERVE )
+      keep_attrs(root, d, fj->job.dstdir[i], fj->job.dstname, fj->path, &fj->st);
+    if( fj->pool->flags & ACTION_VERIFY )
+      verify_file(root, d, fj->job.dstdir[i], fj->job.dstname, fj->path, want);
+  }
+  file_free(fj);
+}
+
+static void file_done(struct UringJob *job, int err, long bytes) {
+  /* Account for a file the uring engine copied, and finish it there and
+     then, so its directories are let go of as the copy goes. */
+  struct FileJob *fj=(struct FileJob *)job;
+  struct Pool *pool=fj->pool;
+
+  /* the ring doesn't say which destination failed */
+  if( err != 0 )
+    copy_error(fj->dst->root, job->ndst == 1 ? fj->dest[0] : -1,
+	       "cannot copy", fj->path, err);
+  __atomic_add_fetch(&pool->files, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&pool->bytes, bytes, __ATOMIC_RELAXED);
+  progress_add(pool->progress, -1, bytes);
+  progress_done(pool->progress, -1);
+  if( err == 0 )
+    file_finish(fj);
+  else
+    file_free(fj);
+}
+
+static bool file_submit(struct Pool *pool, struct DirRef *src, char *srcname,
+			struct DirRef *dst, char **names, bool *wanted,
+			struct stat *st, char *path) {
+  /* Hand a plain file over to the uring engine, to be copied to each
+     destination it is <wanted> in; the engine owns <path> from now on.
+     Return false if we have to copy it ourselves. */
+  struct FileJob *fj;
+  char *dstname=NULL;
+  int d, n=0;
+
+  /* the ring creates the same name in every directory */
+  for( d = 0; d < dst->root->ndst; d++ ) {
+    if( !wanted[d] )
+      continue;
+    if( dstname != NULL && strcmp(dstname, names[d]) != 0 )
+      return false;
+    dstname = names[d];
+  }
+  fj = calloc(1, sizeof(*fj));
+  if( fj == NULL )
+    return false;
+  fj->job.srcname = strdup(srcname);
+  fj->job.dstname = strdup(dstname);
+  if( fj->job.srcname == NULL || fj->job.dstname == NULL ) {
+    free(fj->job.srcname);
+    free(fj->job.dstname);
+    free(fj);
+    return false;
+  }
+  fj->job.srcdir = src->srcfd;
+  for( d = 0; d < dst->root->ndst; d++ ) {
+    if( !wanted[d] )
+      continue;
+    fj->job.dstdir[n] = dst->dstfd[d];
+    fj->dest[n++] = d;
+  }
+  fj->job.ndst = n;
+  fj->job.mode = st->st_mode;
+  fj->job.done = file_done;
+  if( pool->flags & ACTION_VERIFY ) {
+    hash_init(&fj->hash);
+    fj->job.hash = &fj->hash;
+  }
+  fj->st = *st;
+  fj->pool = pool;
+  fj->src = src;
+  fj->dst = dst;
+  fj->path = path;
+  dirref_hold(src);
+  dirref_hold(dst);
+  uring_submit(pool->uring, &fj->job);
+  return true;
+}
+
+static char *part_name(char *name, char *suffix) {
+  /* Return ".<name><suffix>", the hidden file beside <name> that a
+     resumable copy uses, or NULL if out of memory. */
+  char *part=malloc(1 + strlen(name) + strlen(suffix) + 1);
+
+  if( part != NULL )
+    sprintf(part, ".%s%s", name, suffix);
+  return part;
+}
+
+static bool part_checkpoint(int sidefd, int partfd, struct stat *st, off_t done) {
+  /* Get the first <done> bytes of the part copy of the file <st>
+     describes onto the disk, then record in <sidefd> that they are there.
+     The record is always the same length for the one file, so it is
+     simply written over. */
+  char rec[PART_REC_MAX];
+  int len;
+
+  if( fdatasync(partfd) == -1 )
+    return false;
+  len = snprintf(rec, sizeof(rec), "fls-part %lld %lld %09ld %llu %020lld\n",
+		 (long long)st->st_size, (long long)st->st_mtim.tv_sec,
+		 st->st_mtim.tv_nsec, (unsigned long long)st->st_ino,
+		 (long long)done);
+  return pwrite(sidefd, rec, len, 0) == len && fdatasync(sidefd) == 0;
+}
+
+static int part_open(int dirfd, char *partname, char *sidename, struct stat *st,
+		     off_t *done) {
+  /* Open the part copy <partname> in <dirfd> of the file <st> describes.
+     If <sidename> says some of it was copied already, and the file hasn't
+     changed since, set <done> to how much; otherwise start it afresh.
+     Return it, or -1. */
+  char rec[PART_REC_MAX];
+  long long size, sec, nsec, got;
+  unsigned long long ino;
+  struct stat part;
+  ssize_t n;
+  int fd;
+
+  *done = 0;
+  fd = openat(dirfd, sidename, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+  if( fd != -1 ) {
+    n = read(fd, rec, sizeof(rec) - 1);
+    close(fd);
+    rec[n > 0 ? n : 0] = '\0';
+    if( sscanf(rec, "fls-part %lld %lld %lld %llu %lld", &size, &sec, &nsec, &ino, &got) == 5
+	&& size == st->st_size && sec == st->st_mtim.tv_sec
+	&& nsec == st->st_mtim.tv_nsec && ino == st->st_ino ) {
+      fd = openat(dirfd, partname, O_WRONLY|O_NOFOLLOW|O_CLOEXEC);
+      if( fd != -1 && fstat(fd, &part) == 0 && S_ISREG(part.st_mode)
+	  && got <= part.st_size && got <= size ) {
+	*done = got;
+	return fd;
+      }
+      if( fd != -1 )
+	close(fd);
+    }
+  }
+  return openat(dirfd, partname, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC,
+		0600);
+}
+
+static void copy_resumable(struct Worker *w, struct DirRef *src, char *srcname,
+			   struct DirRef *dst, int d, char *name,
+			   struct stat *st, char *path) {
+  /* Copy the big plain file <srcname> in <src>, which <st> describes, to
+     <name> in destination <d> of <dst>, by way of a part copy beside it.
+     What's in that is checkpointed as it goes, so if we're cut short,
+     the next try carries on from there.  Only once it is all there does
+     it take <name>'s place. */
+  struct Pool *pool=w->pool;
+  struct Root *root=dst->root;
+  struct stat now;
+  char *partname, *sidename, full[PATH_MAX];
+  int dirfd=dst->dstfd[d], in=-1, out=-1, side=-1, errors=root->errors;
+  off_t done, start, since=0;
+  ssize_t n;
+  size_t want;
+  uint64_t hash;
+  bool kernel=true;
+
+  partname = part_name(name, PART_SUFFIX);
+  sidename = part_name(name, PART_SUFFIX ".ckpt");
+  if( partname == NULL || sidename == NULL ) {
+    copy_error(root, d, "cannot copy", path, ENOMEM);
+    goto out;
+  }
+  in = openat(src->srcfd, srcname, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+  if( in == -1 ) {
+    copy_error(root, -1, "cannot open", path, errno);
+    goto out;
+  }
+  out = part_open(dirfd, partname, sidename, st, &done);
+  side = out == -1 ? -1 : openat(dirfd, sidename, O_WRONLY|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600);
+  if( out == -1 || side == -1 ) {
+    copy_error(root, d, "cannot create", path, errno);
+    goto out;
+  }
+  start = done;
+  progress_file(pool->progress, w->id, *path ? path : srcname, st->st_size - start);
+  if( done > 0 ) {
+    if( verbose )
+      printf("resuming `%s' at %lld of %lld bytes\n", full_path(root, d, path, full),
+	     (long long)done, (long long)st->st_size);
+  } else if( ioctl(out, FICLONE, in) == 0 ) {
+    __atomic_add_fetch(&pool->cloned, 1, __ATOMIC_RELAXED);
+    progress_cloned(pool->progress);
+    progress_add(pool->progress, -1, st->st_size);
+    done = st->st_size;
+  }
+
+  while( done < st->st_size ) {
+    want = st->st_size - done;
+    if( want > (size_t)(COPY_CHECKPOINT - since) )
+      want = COPY_CHECKPOINT - since;
+    if( kernel ) {
+      off_t inoff=done, outoff=done;
+      n = copy_file_range(in, &inoff, out, &outoff, want, 0);
+      if( n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+		    || errno == EOPNOTSUPP) ) {
+	kernel = false;
+	continue;
+      }
+    } else {
+      n = pread(in, w->buf, want < COPY_BUF_SIZE ? want : COPY_BUF_SIZE, done);
+      if( n > 0 && pwrite(out, w->buf, n, done) != n ) {
+	copy_error(root, d, "cannot write", path, errno ? errno : EIO);
+	break;
+      }
+    }
+    if( n < 0 && errno == EINTR )
+      continue;
+    if( n < 0 ) {
+      copy_error(root, -1, "cannot copy", path, errno);
+      break;
+    }
+    if( n == 0 )
+      break;			/* shorter than it was; caught below */
+    done += n;
+    since += n;
+    progress_add(pool->progress, w->id, n);
+    if( since >= COPY_CHECKPOINT ) {
+      if( !part_checkpoint(side, out, st, done) ) {
+	copy_error(root, d, "cannot checkpoint", path, errno);
+	break;
+      }
+      since = 0;
+    }
+  }
+  __atomic_add_fetch(&pool->files, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&pool->bytes, done - start, __ATOMIC_RELAXED);
+  progress_done(pool->progress, w->id);
+  if( root->errors != errors ) {
+    /* keep what made it, for next time */
+    part_checkpoint(side, out, st, done);
+    goto out;
+  }
+
+  if( fstat(in, &now) == -1 || now.st_size != st->st_size
+      || now.st_mtim.tv_sec != st->st_mtim.tv_sec
+      || now.st_mtim.tv_nsec != st->st_mtim.tv_nsec || done != st->st_size ) {
+    fprintf(stderr, "%s: `%s' changed while it was copied\n", program_name,
+	    full_path(root, -1, path, full));
+    __atomic_add_fetch(&root->errors, 1, __ATOMIC_RELAXED);
+    /* what's there is no good to carry on from */
+    unlinkat(dirfd, partname, 0);
+    unlinkat(dirfd, sidename, 0);
+    goto out;
+  }
+  if( fchmod(out, st->st_mode & 07777) == -1 )
+    copy_error(root, d, "cannot keep mode of", path, errno);
+  if( close(out) == -1 )
+    copy_error(root, d, "cannot write", path, errno);
+  out = -1;
+  if( pool->flags & ACTION_PRESERVE )
+    keep_attrs(root, d, dirfd, partname, path, st);
+  /* the part copy wasn't all read in this run, so hash the source again */
+  if( pool->flags & ACTION_VERIFY ) {
+    if( !file_hash(pool, src->srcfd, srcname, st, w->buf, &hash) )
+      copy_error(root, -1, "cannot verify", path, errno);
+    else
+      verify_file(root, d, dirfd, partname, path, hash);
+  }
+  if( root->errors != errors )
+    goto out;
+  if( renameat(dirfd, partname, dirfd, name) == -1 ) {
+    copy_error(root, d, "cannot put in place", path, errno);
+    goto out;
+  }
+  unlinkat(dirfd, sidename, 0);
+
+ out:
+  if( in != -1 )
+    close(in);
+  if( out != -1 )
+    close(out);
+  if( side != -1 )
+    close(side);
+  free(partname);
+  free(sidename);
+}
+
+static void copy_file(struct Worker *w, struct DirRef *src, char *srcname,
+		      struct DirRef *dst, bool isroot) {
+  /* Copy the non-directory <srcname> in <src> into each destination of
+     <dst>, under the root's own names if <isroot>. */
+  struct Pool *pool=w->pool;
+  struct Root *root=dst->root;
+  struct LinkEnt *first;
+  struct stat st;
+  struct Hash hash;
+  char *path, *names[COPY_DEST_MAX];
+  int in=-1, out[COPY_DEST_MAX], err[COPY_DEST_MAX], d, todo=0, nclone=0, rerr;
+  bool wanted[COPY_DEST_MAX], cloned[COPY_DEST_MAX];
+  long copied;
+
+  for( d = 0; d < root->ndst; d++ ) {
+    names[d] = isroot ? root->dstname[d] : srcname;
+    out[d] = -1;
+    err[d] = 0;
+    wanted[d] = true;
+    cloned[d] = false;
+  }
+  path = isroot ? strdup("") : path_join(dst->path, srcname);
+  if( path == NULL ) {
+    copy_error(root, -1, "cannot copy", srcname, ENOMEM);
+    return;
+  }
+  if( fstatat(src->srcfd, srcname, &st, AT_SYMLINK_NOFOLLOW) == -1 ) {
+    copy_error(root, -1, "cannot stat", path, errno);
+    goto out;
+  }
+
+  /* a hard link shares everything, symlinks and devices included */
+  if( pool->flags & ACTION_LINK ) {
+    for( d = 0; d < root->ndst; d++ ) {
+      int r = linkat(src->srcfd, srcname, dst->dstfd[d], names[d], 0);
+      if( r == -1 && make_room(dst->dstfd[d], names[d]) )
+	r = linkat(src->srcfd, srcname, dst->dstfd[d], names[d], 0);
+      if( r == -1 )
+	copy_error(root, d, "cannot link", path, errno);
+    }
+    __atomic_add_fetch(&pool->files, 1, __ATOMIC_RELAXED);
+    progress_done(pool->progress, -1);
+    goto out;
+  }
+
+  if( S_ISLNK(st.st_mode) ) {
+    char target[PATH_MAX];
+    ssize_t n = readlinkat(src->srcfd, srcname, target, sizeof(target) -1);
+    if( n < 0 ) {
+      copy_error(root, -1, "cannot read link", path, errno);
+      goto out;
+    }
+    target[n] = '\0';
+    for( d = 0; d < root->ndst; d++ ) {
+      if( pool->flags & ACTION_SKIP_IDENTICAL
+	  && same_link(dst->dstfd[d], names[d], target) ) {
+	if( verbose > 1 ) {
+	  char full[PATH_MAX];
+	  printf("skipping identical `%s'\n", full_path(root, d, path, full));
+	}
+	__atomic_add_fetch(&pool->skipped, 1, __ATOMIC_RELAXED);
+      } else if( symlinkat(target, dst->dstfd[d], names[d]) == -1
+	  && (!make_room(dst->dstfd[d], names[d])
+	      || symlinkat(target, dst->dstfd[d], names[d]) == -1) )
+	copy_error(root, d, "cannot create link", path, errno);
+      else if( pool->flags & ACTION_PRESERVE )
+	keep_attrs(root, d, dst->dstfd[d], names[d], path, &st);
+    }
+    goto out;
+  }
+
+  for( d = 0; d < root->ndst; d++ ) {
+    if( S_ISREG(st.st_mode) && pool->flags & ACTION_SKIP_IDENTICAL
+	&& identical(w, src, srcname, &st, dst->dstfd[d], names[d]) ) {
+      if( verbose > 1 ) {
+	char full[PATH_MAX];
+	printf("skipping identical `%s'\n", full_path(root, d, path, full));
+      }
+      __atomic_add_fetch(&pool->skipped, 1, __ATOMIC_RELAXED);
+      wanted[d] = false;
+    } else
+      todo++;
+  }
+  if( todo == 0 ) {
+    progress_add(pool->progress, -1, st.st_size);
+    progress_done(pool->progress, -1);
+    goto out;
+  }
+
+  if( st.st_nlink > 1 ) {
+    first = linkmap_claim(pool, &st, dst, path, names, wanted, out, err);
+    if( first != NULL ) {
+      for( d = 0; d < root->ndst; d++ ) {
+	if( wanted[d] && link_first(first, d, dst->dstfd[d], names[d]) == -1
+	    && (!make_room(dst->dstfd[d], names[d])
+		|| link_first(first, d, dst->dstfd[d], names[d]) == -1) )
+	  copy_error(root, d, "cannot link", path, errno);
+      }
+      goto out;
+    }
+  } else if( S_ISREG(st.st_mode) ) {
+    if( st.st_size >= COPY_RESUME_MIN && todo == 1 ) {
+      for( d = 0; !wanted[d]; d++ )
+	;
+      copy_resumable(w, src, srcname, dst, d, names[d], &st, path);
+      goto out;
+    }
+    if( pool->uring != NULL
+	&& file_submit(pool, src, srcname, dst, names, wanted, &st, path) )
+      return;
+    open_outs(dst, names, wanted, &st, out, err);
+  }
+
+  if( !S_ISREG(st.st_mode) ) {
+    for( d = 0; d < root->ndst; d++ ) {
+      if( !wanted[d] )
+	continue;
+      if( out[d] != -1 )	/* a hard-linked fifo or device */
+	close(out[d]), unlinkat(dst->dstfd[d], names[d], 0);
+      out[d] = -1;
+      if( mknodat(dst->dstfd[d], names[d], st.st_mode, st.st_rdev) == -1
+	  && (!make_room(dst->dstfd[d], names[d])
+	      || mknodat(dst->dstfd[d], names[d], st.st_mode, st.st_rdev) == -1) )
+	copy_error(root, d, "cannot create", path, errno);
+      else if( pool->flags & ACTION_PRESERVE )
+	keep_attrs(root, d, dst->dstfd[d], names[d], path, &st);
+    }
+    goto out;
+  }
+  for( d = 0; d < root->ndst; d++ ) {
+    if( wanted[d] && out[d] == -1 ) {
+      copy_error(root, d, "cannot create", path, err[d]);
+      wanted[d] = false;
+      todo--;
+    }
+  }
+  if( todo == 0 )
+    goto out;
+  in = openat(src->srcfd, srcname, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+  if( in == -1 ) {
+    copy_error(root, -1, "cannot open", path, errno);
+    goto out;
+  }
+
+  /* a clone shares the source's blocks, so there's nothing to write */
+  for( d = 0; d < root->ndst; d++ ) {
+    if( wanted[d] && ioctl(out[d], FICLONE, in) == 0 ) {
+      cloned[d] = true;
+      nclone++;
+      if( close(out[d]) == -1 )
+	err[d] = errno;
+      out[d] = -1;
+    }
+  }
+  if( nclone > 0 ) {
+    __atomic_add_fetch(&pool->cloned, 1, __ATOMIC_RELAXED);
+    progress_cloned(pool->progress);
+  }
+  if( pool->flags & ACTION_VERIFY )
+    hash_init(&hash);
+  progress_file(pool->progress, w->id, *path ? path : srcname,
+		nclone == todo ? 0 : st.st_size);
+  rerr = copy_data(in, out, err, root->ndst, w->buf, &copied,
+		   pool->flags & ACTION_VERIFY ? &hash : NULL, pool->progress, w->id);
+  if( nclone == todo )
+    progress_add(pool->progress, -1, st.st_size);
+  progress_done(pool->progress, w->id);
+  if( rerr != 0 )
+    copy_error(root, -1, "cannot read", path, rerr);
+  __atomic_add_fetch(&pool->files, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&pool->bytes, copied, __ATOMIC_RELAXED);
+  for( d = 0; d < root->ndst; d++ ) {
+    if( !wanted[d] )
+      continue;
+    if( out[d] != -1 && close(out[d]) == -1 && err[d] == 0 )
+      err[d] = errno;
+    out[d] = -1;
+    if( err[d] != 0 ) {
+      copy_error(root, d, "cannot copy", path, err[d]);
+      continue;
+    }
+    if( rerr != 0 && !cloned[d] )
+      continue;
+    if( pool->flags & ACTION_PRESERVE )
+      keep_attrs(root, d, dst->dstfd[d], names[d], path, &st);
+    if( pool->flags & ACTION_VERIFY && !cloned[d] )
+      verify_file(root, d, dst->dstfd[d], names[d], path, hash_final(&hash));
+  }
+
+ out:
+  if( in != -1 )
+    close(in);
+  for( d = 0; d < root->ndst; d++ ) {
+    if( out[d] != -1 && close(out[d]) == -1 )
+      copy_error(root, d, "cannot write", path, errno);
+  }
+  free(path);
+}
+
+static void copy_dir(struct Worker *w, struct Task *task) {
+  /* Create the directory <task> in each destination, copy its plain
+     files, and queue its subdirectories. */
+  struct Pool *pool=w->pool;
+  struct DirRef *parent=task->parent, *ref;
+  struct Root *root=parent->root;
+  struct stat st;
+  char *path, dents[DENTS_BUF_SIZE];
+  int srcfd=-1, dstfd[COPY_DEST_MAX], d;
+  long n;
+
+  for( d = 0; d < root->ndst; d++ )
+    dstfd[d] = -1;
+  path = task->isroot ? strdup("") : path_join(parent->path, task->name);
+  if( path == NULL ) {
+    copy_error(root, -1, "cannot copy", task->name, ENOMEM);
+    goto out;
+  }
+  srcfd = openat(parent->srcfd, task->name,
+		 O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+  if( srcfd == -1 || fstat(srcfd, &st) == -1 ) {
+    copy_error(root, -1, "cannot open", path, errno);
+    goto out;
+  }
+  for( d = 0; d < root->ndst; d++ ) {
+    char *name=(task->isroot ? root->dstname[d] : task->name);
+    /* keep it writable while we fill it in */
+    if( mkdirat(parent->dstfd[d], name, (st.st_mode & 07777) | S_IRWXU) == -1
+	&& errno != EEXIST ) {
+      copy_error(root, d, "cannot create directory", path, errno);
+      goto out;
+    }
+    dstfd[d] = openat(parent->dstfd[d], name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if( dstfd[d] == -1 ) {
+      copy_error(root, d, "cannot open", path, errno);
+      goto out;
+    }
+    /* hard links anywhere below are made relative to this */
+    if( task->isroot )
+      root->treefd[d] = dup(dstfd[d]);
+  }
+  ref = dirref_new(root, srcfd, dstfd, path, st.st_mode & 07777,
+		   (st.st_mode & S_IRWXU) != S_IRWXU);
+  if( ref == NULL ) {
+    copy_error(root, -1, "cannot copy", path, ENOMEM);
+    goto out;
+  }
+  srcfd = -1;
+  for( d = 0; d < root->ndst; d++ )
+    dstfd[d] = -1;
+  path = NULL;
+  if( pool->flags & ACTION_PRESERVE ) {
+    ref->keep = malloc(sizeof(*ref->keep));
+    if( ref->keep != NULL )
+      *ref->keep = st;
+  }
+
+  while( (n = syscall(SYS_getdents64, ref->srcfd, dents, sizeof(dents))) > 0 ) {
+    long off;
+    for( off = 0; off < n; ) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + off);
+      unsigned char type = d->d_type;
+      off += d->d_reclen;
+      if( strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0 )
+	continue;
+      if( type == DT_UNKNOWN ) {
+	if( fstatat(ref->srcfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+	    && S_ISDIR(st.st_mode) )
+	  type = DT_DIR;
+      }
+      if( type == DT_DIR )
+	pool_push(pool, w->id, ref, d->d_name);
+      else
+	copy_file(w, ref, d->d_name, ref, false);
+    }
+  }
+  if( n < 0 )
+    copy_error(root, -1, "cannot read directory", ref->path, errno);
+  dirref_release(ref);
+
+ out:
+  if( srcfd != -1 )
+    close(srcfd);
+  for( d = 0; d < root->ndst; d++ ) {
+    if( dstfd[d] != -1 )
+      close(dstfd[d]);
+  }
+  free(path);
+  free(task->name);
+  dirref_release(parent);
+}
+
+static void *worker_run(void *arg) {
+  /* Copy until every queue is empty and nobody is busy. */
+  struct Worker *w=arg;
+  struct Pool *pool=w->pool;
+  struct Task task;
+
+  while(1) {
+    if( pool_take(pool, w->id, &task) ) {
+      if( task.isdir )
+	copy_dir(w, &task);
+      else {
+	/* only roots are queued as files */
+	copy_file(w, task.parent, task.name, task.parent, task.isroot);
+	free(task.name);
+	dirref_release(task.parent);
+      }
+      if( __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0 ) {
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+      }
+      continue;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while( __atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE) == 0
+	   && __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0 )
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    if( __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0 ) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return NULL;
+}
+
+
+static int pool_threads() {
+  /* Return how many workers to run; the walk is mostly waiting on the
+     disk, so use more threads than cpus. */
+  long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+
+  if( ncpu < 2 )
+    ncpu = 2;
+  if( ncpu * 2 > COPY_THREADS_MAX )
+    return COPY_THREADS_MAX;
+  return ncpu * 2;
+}
+
+static void raise_fd_limit() {
+  /* Every directory being filled holds one descriptor open, and one more
+     for each destination. */
+  struct rlimit rl;
+
+  if( getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max ) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+
+static void pool_run(struct Pool *pool, struct Root *roots, int n,
+		     struct DirRef **refs) {
+  /* Copy all of <roots> that have a DirRef in <refs>, and everything
+     under them, using every worker we can start. */
+  struct Worker workers[COPY_THREADS_MAX];
+  pthread_t threads[COPY_THREADS_MAX];
+  int i, started=0;
+
+  pool->deques = calloc(pool->nworkers, sizeof(*pool->deques));
+  if( pool->deques == NULL ) {
+    for( i = 0; i < n; i++ )
+      copy_error(&roots[i], -1, "cannot copy", "", ENOMEM);
+    return;
+  }
+  for( i = 0; i < pool->nworkers; i++ )
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+  for( i = 0; i < n; i++ ) {
+    struct Task task;
+    if( refs[i] == NULL )
+      continue;
+    /* the root task is the only one with different destination names */
+    task.parent = refs[i];
+    task.name = strdup(roots[i].srcname);
+    task.isroot = true;
+    task.isdir = roots[i].isdir;
+    if( task.name == NULL
+	|| !deque_push(&pool->deques[i % pool->nworkers], task) ) {
+      copy_error(&roots[i], -1, "cannot copy", "", ENOMEM);
+      free(task.name);
+      continue;
+    }
+    dirref_hold(refs[i]);
+    pool->pending++;
+    pool->queued++;
+  }
+  if( pool->pending == 0 )
+    goto out;
+
+  for( i = 0; i < pool->nworkers; i++ ) {
+    workers[i].pool = pool;
+    workers[i].id = i;
+    workers[i].buf = malloc(COPY_BUF_SIZE);
+    if( workers[i].buf == NULL
+	|| pthread_create(&threads[i], NULL, worker_run, &workers[i]) != 0 ) {
+      free(workers[i].buf);
+      break;
+    }
+    started++;
+  }
+  if( started == 0 ) {
+    /* couldn't get any help, so do it ourselves */
+    workers[0].buf = malloc(COPY_BUF_SIZE);
+    if( workers[0].buf == NULL ) {
+      for( i = 0; i < n; i++ )
+	copy_error(&roots[i], -1, "cannot copy", "", ENOMEM);
+      for( i = 0; i < pool->nworkers; i++ ) {
+	struct Task task;
+	while( deque_take(&pool->deques[i], &task, false) ) {
+	  free(task.name);
+	  dirref_release(task.parent);
+	}
+      }
+      goto out;
+    }
+    worker_run(&workers[0]);
+    free(workers[0].buf);
+  }
+  for( i = 0; i < started; i++ ) {
+    pthread_join(threads[i], NULL);
+    free(workers[i].buf);
+  }
+
+ out:
+  for( i = 0; i < pool->nworkers; i++ ) {
+    free(pool->deques[i].items);
+    pthread_mutex_destroy(&pool->deques[i].lock);
+  }
+  free(pool->deques);
+}
+
+static char *strip_slash(char *path) {
+  /* Return a copy of <path> without any trailing slashes, or NULL if
+     out of memory. */
+  char *stripped=strdup(path);
+  size_t len;
+
+  if( stripped == NULL )
+    return NULL;
+  len = strlen(stripped);
+  while( len > 1 && stripped[len-1] == '/' )
+    stripped[--len] = '\0';
+  return stripped;
+}
+
+static bool root_open(struct Root *root, char *source, char **dests,
+		      int ndst) {
+  /* Work out where <source> goes if copied to each of the <ndst> <dests>
+     the way `cp -r' would: into a destination if it is a directory,
+     otherwise as it.  Return false (having complained) if any end can't
+     be opened. */
+  struct stat st;
+  char *tmp;
+  int d;
+
+  memset(root, 0, sizeof(*root));
+  root->srcfd = -1;
+  root->ndst = ndst;
+  for( d = 0; d < ndst; d++ )
+    root->dstfd[d] = root->treefd[d] = -1;
+  /* basename and dirname may scribble on their argument */
+  root->src = strip_slash(source);
+  tmp = root->src ? strdup(root->src) : NULL;
+  if( tmp == NULL || (root->srcname = strdup(basename(tmp))) == NULL ) {
+    free(tmp);
+    goto nomem;
+  }
+  strcpy(tmp, root->src);
+  root->srcfd = open(dirname(tmp), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  free(tmp);
+  if( root->srcfd == -1 ) {
+    copy_error(root, -1, "cannot open", "", errno);
+    return false;
+  }
+
+  for( d = 0; d < ndst; d++ ) {
+    tmp = strip_slash(dests[d]);
+    if( tmp == NULL )
+      goto nomem;
+    if( stat(tmp, &st) == 0 && S_ISDIR(st.st_mode) ) {
+      root->dstname[d] = strdup(root->srcname);
+      root->dstfd[d] = open(tmp, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+      root->dst[d] = path_join(tmp, root->srcname);
+    } else {
+      root->dst[d] = strdup(tmp);
+      root->dstname[d] = strdup(basename(tmp));
+      strcpy(tmp, dests[d]);
+      root->dstfd[d] = open(dirname(tmp), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    }
+    free(tmp);
+    if( root->dst[d] == NULL || root->dstname[d] == NULL )
+      goto nomem;
+    if( root->dstfd[d] == -1 ) {
+      copy_error(root, d, "cannot open", "", errno);
+      return false;
+    }
+  }
+  return true;
+
+ nomem:
+  fprintf(stderr, "%s: cannot copy `%s': %s\n", program_name, source,
+	  strerror(ENOMEM));
+  root->errors++;
+  return false;
+}
+
+static void root_close(struct Root *root) {
+  int d;
+
+  if( root->srcfd != -1 )
+    close(root->srcfd);
+  for( d = 0; d < root->ndst; d++ ) {
+    if( root->dstfd[d] != -1 )
+      close(root->dstfd[d]);
+    if( root->treefd[d] != -1 )
+      close(root->treefd[d]);
+    free(root->dst[d]);
+    free(root->dstname[d]);
+  }
+  free(root->src);
+  free(root->srcname);
+}
+
+static bool root_inside(struct Root *root) {
+  /* Complain and return true if <root> is a directory that would be
+     copied into itself. */
+  size_t len=strlen(root->src);
+  int d;
+
+  for( d = 0; root->isdir && d < root->ndst; d++ ) {
+    if( strncmp(root->src, root->dst[d], len) == 0
+	&& (root->dst[d][len] == '/' || root->dst[d][len] == '\0') ) {
+      fprintf(stderr, "%s: cannot copy a directory, `%s', into itself, `%s'\n",
+	      program_name, root->src, root->dst[d]);
+      root->errors++;
+      return true;
+    }
+  }
+  return false;
+}
+
+int copy_trees(struct Action action, char **sources, int n, char **dests,
+	       int ndest, int *status) {
+  /* Copy each of the <n> <sources> to each of the <ndest> <dests> the way
+     `cp -r' would, all at once and reading every source file only once,
+     and set <status>[i] to 0 for each one that made it everywhere.
+     Return 0 if they all did. */
+  char *prefix="copy_trees:";
+  struct Root *roots;
+  struct DirRef **refs;
+  struct Pool pool;
+  struct HashCache hashes;
+  struct stat st;
+  struct timespec start, end;
+  int i, d, dstfd[COPY_DEST_MAX], nroots=0, failed=0;
+
+  for( i = 0; i < n; i++ )
+    status[i] = EXIT_FAILURE;
+  if( ndest < 1 || ndest > COPY_DEST_MAX ) {
+    fprintf(stderr, "%s can't copy to %d destinations\n", prefix, ndest);
+    return n;
+  }
+  roots = calloc(n, sizeof(*roots));
+  refs = calloc(n, sizeof(*refs));
+  if( roots == NULL || refs == NULL ) {
+    fprintf(stderr, "%s %s\n", prefix, strerror(ENOMEM));
+    free(roots);
+    free(refs);
+    return n;
+  }
+
+  memset(&pool, 0, sizeof(pool));
+  pool.nworkers = pool_threads();
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+  pthread_mutex_init(&pool.links.lock, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if( action.flags & ACTION_SKIP_IDENTICAL ) {
+    /* copies must keep their mtimes, or nothing will ever match */
+    action.flags |= ACTION_PRESERVE;
+    hashcache_load(&hashes, action.hashes);
+    pool.hashes = &hashes;
+  }
+  pool.flags = action.flags;
+  pool.progress = action.progress;
+  if( action.flags & ACTION_URING )
+    pool.uring = uring_start(COPY_BUF_SIZE);
+
+  for( i = 0; i < n; i++ ) {
+    char *path;
+    int srcfd;
+    refs[i] = NULL;
+    if( !root_open(&roots[i], sources[i], dests, ndest) )
+      continue;
+    srcfd = dup(roots[i].srcfd);
+    for( d = 0; d < ndest; d++ )
+      dstfd[d] = dup(roots[i].dstfd[d]);
+    path = strdup("");
+    refs[i] = path ? dirref_new(&roots[i], srcfd, dstfd, path, 0, false) : NULL;
+    if( refs[i] == NULL ) {
+      copy_error(&roots[i], -1, "cannot copy", "", ENOMEM);
+      close(srcfd);
+      for( d = 0; d < ndest; d++ )
+	close(dstfd[d]);
+      free(path);
+      continue;
+    }
+    if( fstatat(roots[i].srcfd, roots[i].srcname, &st, AT_SYMLINK_NOFOLLOW) == -1 ) {
+      copy_error(&roots[i], -1, "cannot stat", "", errno);
+    } else {
+      roots[i].isdir = S_ISDIR(st.st_mode);
+      if( !root_inside(&roots[i]) ) {
+	nroots++;
+	continue;		/* leave it for the pool */
+      }
+    }
+    dirref_release(refs[i]);
+    refs[i] = NULL;
+  }
+
+  if( nroots > 0 ) {
+    raise_fd_limit();
+    pool_run(&pool, roots, n, refs);
+  }
+  for( i = 0; i < n; i++ ) {
+    if( refs[i] != NULL )
+      dirref_release(refs[i]);
+  }
+  /* files may still be in flight */
+  if( pool.uring != NULL )
+    uring_finish(pool.uring);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if( verbose ) {
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if( secs <= 0 )
+      secs = 1e-9;
+    printf("%s %ld file%s, %ld bytes in %.3fs (%.0f files/s, %.1f MB/s, %s)\n",
+	   prefix, pool.files, pool.files == 1 ? "" : "s", pool.bytes, secs,
+	   pool.files / secs, pool.bytes / secs / 1e6,
+	   pool.uring != NULL ? "uring" : "sync");
+    if( pool.hashes != NULL )
+      printf("%s %ld identical file%s skipped\n", prefix, pool.skipped,
+	     pool.skipped == 1 ? "" : "s");
+  }
+  if( verbose )
+    printf("%s %ld of %ld file%s cloned%s\n", prefix, pool.cloned, pool.files,
+	   pool.files == 1 ? "" : "s",
+	   pool.cloned < pool.files ? ", the rest copied" : "");
+  if( pool.hashes != NULL )
+    hashcache_save(pool.hashes);
+
+  for( i = 0; i < n; i++ ) {
+    status[i] = roots[i].errors ? EXIT_FAILURE : EXIT_SUCCESS;
+    if( roots[i].errors )
+      failed++;
+    root_close(&roots[i]);
+  }
+  free(roots);
+  free(refs);
+  linkmap_free(&pool.links);
+  pthread_mutex_destroy(&pool.links.lock);
+  pthread_cond_destroy(&pool.cond);
+  pthread_mutex_destroy(&pool.lock);
+  return failed;
+}
+
+static int remove_at(int dirfd, char *name, char *path) {
+  /* Remove <name> in <dirfd>, and everything under it.
+     Return 0 on success, or an errno value (having complained). */
+  char dents[DENTS_BUF_SIZE];
+  int fd, err=0;
+  long n;
+
+  if( unlinkat(dirfd, name, 0) == 0 )
+    return 0;
+  if( errno != EISDIR && errno != EPERM ) {
+    fprintf(stderr, "%s: cannot remove `%s': %s\n", program_name, path, strerror(errno));
+    return errno;
+  }
+  fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+  if( fd == -1 ) {
+    fprintf(stderr, "%s: cannot remove `%s': %s\n", program_name, path, strerror(errno));
+    return errno;
+  }
+  while( err == 0 && (n = syscall(SYS_getdents64, fd, dents, sizeof(dents))) > 0 ) {
+    long off;
+    for( off = 0; err == 0 && off < n; ) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + off);
+      char *sub;
+      off += d->d_reclen;
+      if( strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0 )
+	continue;
+      sub = path_join(path, d->d_name);
+      err = sub == NULL ? ENOMEM : remove_at(fd, d->d_name, sub);
+      free(sub);
+    }
+  }
+  close(fd);
+  if( err == 0 && unlinkat(dirfd, name, AT_REMOVEDIR) == -1 ) {
+    err = errno;
+    fprintf(stderr, "%s: cannot remove `%s': %s\n", program_name, path, strerror(err));
+  }
+  return err;
+}
+
+int move_trees(struct Action action, char **sources, int n, char **dests,
+	       int ndest, int *status) {
+  /* Move each of the <n> <sources> to <dests>[0] the way `mv' would:
+     rename them if we can, otherwise copy them across (keeping times, and
+     verifying if asked) and only then remove the originals.
+     Set <status>[i] to 0 for each one that made it; return 0 if all did. */
+  struct Root root;
+  char **across;
+  int i, j, *idx, *across_status, nacross=0, failed=0;
+
+  for( i = 0; i < n; i++ )
+    status[i] = EXIT_FAILURE;
+  across = malloc(n * sizeof(*across));
+  idx = malloc(n * sizeof(*idx));
+  across_status = malloc(n * sizeof(*across_status));
+  if( across == NULL || idx == NULL || across_status == NULL ) {
+    fprintf(stderr, "%s: cannot move: %s\n", program_name, strerror(ENOMEM));
+    failed = n;
+    goto out;
+  }
+  /* a file can only end up in one place */
+  if( ndest != 1 ) {
+    fprintf(stderr, "%s: cannot move to %d destinations\n", program_name, ndest);
+    failed = n;
+    goto out;
+  }
+  for( i = 0; i < n; i++ ) {
+    if( !root_open(&root, sources[i], dests, 1) ) {
+      root_close(&root);
+      failed++;
+      continue;
+    }
+    if( renameat(root.srcfd, root.srcname, root.dstfd[0], root.dstname[0]) == 0 ) {
+      status[i] = EXIT_SUCCESS;
+    } else if( errno == EXDEV ) {
+      across[nacross] = sources[i];
+      idx[nacross++] = i;
+    } else {
+      fprintf(stderr, "%s: cannot move `%s' to `%s': %s\n",
+	      program_name, root.src, root.dst[0], strerror(errno));
+      failed++;
+    }
+    root_close(&root);
+  }
+
+  if( nacross > 0 ) {
+    action.flags |= ACTION_PRESERVE;
+    copy_trees(action, across, nacross, dests, 1, across_status);
+    for( j = 0; j < nacross; j++ ) {
+      i = idx[j];
+      if( across_status[j] != 0 ) {
+	failed++;
+	continue;
+      }
+      /* the copy is good, so the original can go */
+      if( root_open(&root, sources[i], dests, 1)
+	  && remove_at(root.srcfd, root.srcname, root.src) == 0 )
+	status[i] = EXIT_SUCCESS;
+      else
+	failed++;
+      root_close(&root);
+    }
+  }
+ out:
+  free(across);
+  free(idx);
+  free(across_status);
+  return failed;
+}
+
+int link_trees(struct Action action, char **sources, int n, char **dests,
+	       int ndest, int *status) {
+  /* Hard-link each of the <n> <sources> into <dests> the way `cp -rl'
+     would: directories are made anew, and everything in them linked.
+     Set <status>[i] to 0 for each one that made it; return 0 if all did. */
+
+  action.flags |= ACTION_LINK;
+  action.flags &= ~(ACTION_URING | ACTION_VERIFY | ACTION_SKIP_IDENTICAL);
+  return copy_trees(action, sources, n, dests, ndest, status);
+}
+
+int clone_trees(struct Action action, char **sources, int n, char **dests,
+		int ndest, int *status) {
+  /* Reflink each of the <n> <sources> into <dests>, sharing their blocks
+     until either side is written; any file the filesystem can't reflink
+     is copied instead.  How many were cloned goes in Action.progress.
+     Set <status>[i] to 0 for each one that made it; return 0 if all did. */
+
+  /* the ring doesn't clone */
+  action.flags |= ACTION_CLONE;
+  action.flags &= ~ACTION_URING;
+  return copy_trees(action, sources, n, dests, ndest, status);
+}
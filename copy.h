@@ -0,0 +1,22 @@
+#ifndef copy_h
+#define copy_h
+
+#include "action.h"
+#include "uring.h"
+
+#define COPY_THREADS_MAX 32
+#define COPY_BUF_SIZE (128 * 1024)
+#define COPY_DEST_MAX URING_DEST_MAX
+#define COPY_RESUME_MIN (64L << 20)	/* files this big can be resumed */
+#define COPY_CHECKPOINT (32L << 20)	/* how often their progress is saved */
+
+int copy_trees(struct Action action, char **sources, int n, char **dests,
+	       int ndest, int *status);
+int move_trees(struct Action action, char **sources, int n, char **dests,
+	       int ndest, int *status);
+int link_trees(struct Action action, char **sources, int n, char **dests,
+	       int ndest, int *status);
+int clone_trees(struct Action action, char **sources, int n, char **dests,
+		int ndest, int *status);
+
+#endif
@@ -1,146 +1,1231 @@
-/* Manage the file stack, and arbitrate access through a socket. */
+/* Manage the file stacks, and arbitrate access through a socket. */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/socket.h>
-#include "stack.h"
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "fls.h"
+#include "stacktab.h"
 #include "comm.h"
 #include "sig.h"
+#include "daemon.h"
+#include "match.h"
+#include "watch.h"
+#include "snapshot.h"
 
-static bool daemon_serve(int s, char *cmd) {
-  /* Do <cmd> for client connected on <s>. */
-  static Node *null=NULL, **stack=&null;
+#define CLIENTS_MAX 1024	/* connected at once */
+#define FIRST_CLIENT 3		/* in the poll set, after the listener, inotify and the workers */
+#define DAEMON_THREADS 8	/* serving commands */
+#define USER_BUCKETS 256
+#define FDS_SPARE 64		/* kept back from held descriptors, for logs and the like */
+
+struct User {
+  /* Everything one uid has in the daemon.  Like the daemon of old, it
+     serves one of that uid's connections at a time, so a client can pick
+     files and pop them without another getting in between.  Plain pushes
+     from the others go in <inbox> meanwhile, and onto the stacks once the
+     holder is done. */
+  uid_t uid;
+  struct StackTab tab;
+  struct Inbox inbox;
+  int clients;			/* connected */
+  int holder;			/* the connection being served, or -1 */
+  char report[FILEPATH_MAX];	/* how the holder's transfer is going */
+  int reporter;			/* the connection that sent it, or -1 */
+  struct User *next;		/* in the same bucket */
+};
+
+enum Serve {
+  SERVE_HOLDER,			/* whatever it is, holding the user */
+  SERVE_INBOX,			/* a push, while another holds the user */
+  SERVE_PROGRESS,		/* a progress query, which never waits */
+};
+
+struct Conn {
+  struct Soc soc;
+  struct User *user;
+  char cmd[MSG_MAX];		/* sent, and waiting its turn or being served */
+  bool busy;			/* a worker has it */
+  enum Serve how;
+  bool drain;			/* the user was free; empty its inbox first */
+  bool may_stop;
+  bool stop;			/* it stopped the daemon */
+  bool release;			/* it let go of the user */
+  bool lost;			/* it sent something we couldn't take */
+};
+
+struct Pool {
+  /* Workers, and the connections waiting for one. */
+  pthread_t threads[DAEMON_THREADS];
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct Conn *jobs[CLIENTS_MAX];	/* a ring; a connection is in it once at most */
+  int head, len;
+  bool quit;
+  int wake[2];			/* served connections come back through this */
+};
+
+static struct User *users[USER_BUCKETS];
+static size_t fds_max;		/* descriptors the stacks may hold between them */
+/* Workers serve different users at once, each its own stacks; but
+   stacked() reads everybody's, the watches are shared, and so is the trie
+   every stack's paths are kept in, so any change to a table, looking a
+   path up in one, and the watches, go under <stacks_lock>.  Reading one's
+   own stacks otherwise needs nothing. */
+static pthread_mutex_t stacks_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t report_lock=PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t terminated;	/* asked to go, keeping the stacks */
+
+static struct Stack *tab_create(struct StackTab *tab, char *name) {
+  /* stacktab_create(), under <stacks_lock>; and the same for the rest. */
+  struct Stack *st;
+
+  pthread_mutex_lock(&stacks_lock);
+  st = stacktab_create(tab, name);
+  pthread_mutex_unlock(&stacks_lock);
+  return st;
+}
+
+static bool tab_destroy(struct StackTab *tab, char *name) {
+  bool ret;
+
+  pthread_mutex_lock(&stacks_lock);
+  ret = stacktab_destroy(tab, name);
+  pthread_mutex_unlock(&stacks_lock);
+  return ret;
+}
+
+static char *tab_push(struct StackTab *tab, struct Stack *st, int n, char *dat,
+		      int fd) {
+  /* stacktab_insert(), but refusing <dat> if <st> is unique and has it
+     already, both under <stacks_lock>.
+     Return why it didn't go in, or NULL if it did. */
+  char *why=NULL;
+
+  pthread_mutex_lock(&stacks_lock);
+  if( st->unique && stacktab_count(st, dat) > 0 )
+    why = MSG_ERR_DUPLICATE;
+  else if( !stacktab_insert(tab, st, n, dat, fd) )
+    why = MSG_ERR_NO_ROOM;
+  pthread_mutex_unlock(&stacks_lock);
+  return why;
+}
+
+static char *tab_remove(struct StackTab *tab, struct Stack *st, int n) {
+  char *ret;
+
+  pthread_mutex_lock(&stacks_lock);
+  ret = stacktab_remove(tab, st, n);
+  pthread_mutex_unlock(&stacks_lock);
+  return ret;
+}
+
+static void tab_rotate(struct Stack *st, int n) {
+  pthread_mutex_lock(&stacks_lock);
+  deque_rotate(&st->dq, n);
+  pthread_mutex_unlock(&stacks_lock);
+}
+
+static bool tab_swap(struct Stack *st) {
+  bool ret;
+
+  pthread_mutex_lock(&stacks_lock);
+  ret = deque_swap(&st->dq);
+  pthread_mutex_unlock(&stacks_lock);
+  return ret;
+}
+
+static void send_stacks(struct Soc *soc, struct StackTab *tab) {
+  /* Tell the client on <soc> about every stack in <tab>: how many there
+     are, then a "files bytes name" line for each. */
+  char buf[MSG_MAX];
+  struct Stack *st;
+  size_t i;
+
+  soc_put(soc, MSG_SUCCESS);
+  sprintf(buf, "%zu", tab->len);
+  soc_put(soc, buf);
+  for( i = 0; i < tab->nbucket; i++ ) {
+    for( st = tab->buckets[i]; st != NULL; st = st->next ) {
+      sprintf(buf, "%d %zu %s", st->dq.len, st->bytes, st->name);
+      soc_put(soc, buf);
+    }
+  }
+}
+
+static void send_clashes(struct Soc *soc, struct Stack *st) {
+  /* Tell the client on <soc> which names more than one path in <st> has:
+     how many of them there are, then each name. */
+  char buf[MSG_MAX];
+  struct PathRef *ref;
+  size_t i;
+
+  soc_put(soc, MSG_SUCCESS);
+  sprintf(buf, "%d", st->clashes);
+  soc_put(soc, buf);
+  for( i = 0; i < st->names.nbucket && st->clashes > 0; i++ ) {
+    for( ref = st->names.buckets[i]; ref != NULL; ref = ref->next ) {
+      if( ref->count > 1 )
+	soc_put(soc, ref->key);
+    }
+  }
+}
+
+static bool stacked(const char *path) {
+  /* Is <path> in any of anybody's stacks?  Call with <stacks_lock> held. */
+  struct User *user;
+  struct Stack *st;
+  size_t i, j;
+
+  for( i = 0; i < USER_BUCKETS; i++ ) {
+    for( user = users[i]; user != NULL; user = user->next ) {
+      for( j = 0; j < user->tab.nbucket; j++ ) {
+	for( st = user->tab.buckets[j]; st != NULL; st = st->next ) {
+	  if( stacktab_count(st, path) > 0 )
+	    return true;
+	}
+      }
+    }
+  }
+  return false;
+}
+
+static void recheck(void) {
+  /* Look again at everything in anybody's stacks, the events about them
+     having been lost.  Call with <stacks_lock> held. */
+  char path[FILEPATH_MAX];
+  struct User *user;
+  struct Stack *st;
+  bool settled=true;
+  size_t i, j;
+  int n;
+
+  for( i = 0; i < USER_BUCKETS; i++ ) {
+    for( user = users[i]; user != NULL; user = user->next ) {
+      for( j = 0; j < user->tab.nbucket; j++ ) {
+	for( st = user->tab.buckets[j]; st != NULL; st = st->next ) {
+	  for( n = 0; n < st->dq.len; n++ )
+	    settled &= watch_recheck(stacktab_path(st, n, path));
+	}
+      }
+    }
+  }
+  /* with no room to note them all, each goes on being looked at */
+  if( settled )
+    watch_settled();
+  else
+    printf("daemon: lost track of what happened to stacked files\n");
+}
+
+static void send_stale(struct Soc *soc, struct Stack *st) {
+  /* Tell the client on <soc> which entries in <st> have been deleted or
+     renamed since they were pushed: how many, then "N gone" or
+     "N moved PATH" for each, counting from 0 at the top. */
+  char buf[MSG_MAX + FILEPATH_MAX], path[FILEPATH_MAX], **moved;
+  const char *now;
+  enum WatchState state;
+  int i, n=0, *hits;
+
+  soc_put(soc, MSG_SUCCESS);
+  /* usually nothing has happened to anything, and this is all */
+  pthread_mutex_lock(&stacks_lock);
+  if( !watch_any() ) {
+    pthread_mutex_unlock(&stacks_lock);
+    soc_put(soc, "0");
+    return;
+  }
+  /* found out under the lock, and sent after */
+  hits = xmalloc((st->dq.len + 1) * sizeof(*hits));
+  moved = xmalloc((st->dq.len + 1) * sizeof(*moved));
+  for( i = 0; i < st->dq.len; i++ ) {
+    state = watch_state(stacktab_path(st, i, path), &now);
+    if( state == WATCH_OKAY )
+      continue;
+    hits[n] = i;
+    moved[n++] = state == WATCH_MOVED ? xstrdup((char *)now) : NULL;
+  }
+  pthread_mutex_unlock(&stacks_lock);
+
+  sprintf(buf, "%d", n);
+  soc_put(soc, buf);
+  for( i = 0; i < n; i++ ) {
+    if( moved[i] == NULL )
+      sprintf(buf, "%d gone", hits[i]);
+    else
+      snprintf(buf, sizeof(buf), "%d moved %s", hits[i], moved[i]);
+    soc_put(soc, buf);
+    free(moved[i]);
+  }
+  free(hits);
+  free(moved);
+}
+
+static bool is_cmd(char *cmd, char *word) {
+  /* Is <cmd> <word>, for whichever stack? */
+  size_t len=strlen(word);
+
+  return strncmp(cmd, word, len) == 0 && (cmd[len] == '\0' || cmd[len] == ' ');
+}
+
+static char *stack_of(char *cmd) {
+  /* Cut the name of the stack off <cmd>, and return it; "" if none. */
+  char *name=strchr(cmd, ' ');
+
+  if( name == NULL )
+    return "";
+  *name++ = '\0';
+  return name;
+}
+
+static int args_of(char *cmd) {
+  /* How many strings come after <cmd> from the client.  They are sent
+     without waiting to be asked, so they're read whatever becomes of
+     <cmd>, or they'd be taken for commands. */
+
+  if( is_cmd(cmd, CMD_INSERT) || is_cmd(cmd, CMD_PUSHFD) )
+    return 2;
+  if( is_cmd(cmd, CMD_PUSH) || is_cmd(cmd, CMD_UNSHIFT) || is_cmd(cmd, CMD_PICK)
+      || is_cmd(cmd, CMD_FIND) || is_cmd(cmd, CMD_REMOVE) || is_cmd(cmd, CMD_TAKE)
+      || is_cmd(cmd, CMD_UNIQUE) || is_cmd(cmd, CMD_ROTATE) || is_cmd(cmd, CMD_REPORT) )
+    return 1;
+  return 0;
+}
+
+static void args_skip(struct Soc *soc, char *cmd) {
+  /* Read and throw away what comes after <cmd>, once it's been
+     acknowledged as usual; the client wants that before sending any. */
   char buf[FILEPATH_MAX];
+  int i, n=args_of(cmd), fd=-1;
+
+  if( n > 0 )
+    soc_put(soc, MSG_SUCCESS);
+  for( i = 0; i < n; i++ ) {
+    if( i == 1 && is_cmd(cmd, CMD_PUSHFD) )
+      soc_get_fd(soc, buf, FILEPATH_MAX, &fd);
+    else
+      soc_get(soc, buf, FILEPATH_MAX);
+  }
+  if( fd != -1 )
+    close(fd);
+}
+
+static void progress_serve(struct Soc *soc, struct User *user) {
+  /* Tell the client on <soc> how <user>'s transfer is going.  Only the
+     report is touched, so the holder can be busy with the rest. */
+  char buf[FILEPATH_MAX];
+
+  pthread_mutex_lock(&report_lock);
+  strcpy(buf, user->report);
+  pthread_mutex_unlock(&report_lock);
+  soc_put(soc, MSG_SUCCESS);
+  soc_put(soc, buf);
+}
+
+static void inbox_serve(struct Soc *soc, char *cmd, struct User *user) {
+  /* Take the push <cmd> from the client on <soc> into <user>'s inbox, for
+     when the connection holding the user is done.  Whether the stack has
+     room, or has the path in already, is found out then. */
+  char buf[FILEPATH_MAX], *name, *status;
+
+  name = stack_of(cmd);
+  if( !stack_name_okay(name) ) {
+    args_skip(soc, cmd);
+    soc_put(soc, MSG_ERROR);
+    soc_put(soc, MSG_ERR_STACK_NAME);
+    return;
+  }
+  soc_put(soc, MSG_SUCCESS);
+  if( soc_get(soc, buf, FILEPATH_MAX) <= 0 ) {
+    printf("daemon: push request failed (read error)\n");
+    status = MSG_ERROR;
+    strcpy(buf, MSG_ERR_LENGTH);
+  } else if( !inbox_push(&user->inbox, name, buf, STACK_MAX) ) {
+    printf("daemon: push request failed (inbox full)\n");
+    status = MSG_ERROR;
+    strcpy(buf, MSG_ERR_STACK_FULL);
+  } else {
+    status = MSG_SUCCESS;
+    printf("daemon: queued push `%s' [%s]\n", buf, name);
+  }
+  soc_put(soc, status);
+  soc_put(soc, buf);
+}
+
+static void user_drain(struct User *user) {
+  /* Put what's in <user>'s inbox on its stacks, in the order it came.
+     Nobody may be serving the user's stacks meanwhile. */
+  struct StackTab *tab=&user->tab;
+  struct InboxEntry *e, *next;
+  struct Stack *st;
+  char *why;
+
+  e = inbox_take(&user->inbox);
+  if( e == NULL )
+    return;
+  pthread_mutex_lock(&stacks_lock);
+  for( ; e != NULL; e = next ) {
+    next = e->next;
+    st = stacktab_get(tab, e->name);
+    if( st == NULL )
+      st = stacktab_create(tab, e->name);
+    why = NULL;
+    if( st == NULL )
+      why = MSG_ERR_NO_ROOM;
+    else if( st->dq.len >= STACK_MAX )
+      why = MSG_ERR_STACK_FULL;
+    else if( st->unique && stacktab_count(st, e->dat) > 0 )
+      why = MSG_ERR_DUPLICATE;
+    else if( !stacktab_insert(tab, st, 0, e->dat, -1) )
+      why = MSG_ERR_NO_ROOM;
+    if( why != NULL )
+      printf("daemon: dropped queued push `%s' (%s) [%s]\n", e->dat, why, e->name);
+    else
+      printf("daemon: %s 0 `%s' [%s]\n", CMD_PUSH, e->dat, e->name);
+    inbox_entry_free(e);
+  }
+  pthread_mutex_unlock(&stacks_lock);
+}
+
+static bool daemon_serve(struct Soc *soc, char *cmd, struct User *user, bool may_stop) {
+  /* Do <cmd> for client connected on <soc>, to whichever of <user>'s
+     stacks it names.  Only stop if it <may_stop>. */
+  static struct Stack none={""};
+  struct StackTab *tab=&user->tab;
+  struct Stack *stack;
+  char buf[FILEPATH_MAX], *name;
   bool keep_running=true;
 
-  if( strcmp(cmd, CMD_PUSH) == 0 ) {
-    char *status;
-    if( stack_len(stack) >= STACK_MAX ) {
+  name = stack_of(cmd);
+  if( !stack_name_okay(name) ) {
+    printf("daemon: bad stack name for `%s'\n", cmd);
+    args_skip(soc, cmd);
+    soc_put(soc, MSG_ERROR);
+    soc_put(soc, MSG_ERR_STACK_NAME);
+    return keep_running;
+  }
+  /* a stack nobody has made yet reads as empty */
+  stack = stacktab_get(tab, name);
+  if( stack == NULL )
+    stack = &none;
+
+  if( strcmp(cmd, CMD_PUSH) == 0 || strcmp(cmd, CMD_UNSHIFT) == 0
+      || strcmp(cmd, CMD_INSERT) == 0 || strcmp(cmd, CMD_PUSHFD) == 0 ) {
+    /* where it goes: the top, the bottom, or where the client says */
+    int at=strcmp(cmd, CMD_UNSHIFT) == 0 ? -1 : 0, fd=-1, n;
+    bool by_fd=strcmp(cmd, CMD_PUSHFD) == 0;
+    char *status, *why;
+    soc_put(soc, MSG_SUCCESS);
+    if( (strcmp(cmd, CMD_INSERT) == 0 || by_fd) && soc_get(soc, buf, MSG_MAX) > 0 )
+      at = atoi(buf);
+    if( by_fd )
+      n = soc_get_fd(soc, buf, FILEPATH_MAX, &fd);
+    else
+      n = soc_get(soc, buf, FILEPATH_MAX);
+    if( n > 0 && stack == &none )
+      stack = tab_create(tab, name);
+    if( n <= 0 ) {
+      printf("daemon: push request failed (read error)\n");
+      status = MSG_ERROR;
+      strcpy(buf, MSG_ERR_LENGTH);
+    } else if( stack == NULL ) {
+      printf("daemon: push request failed (no room for stack `%s')\n", name);
+      status = MSG_ERROR;
+      strcpy(buf, MSG_ERR_NO_ROOM);
+    } else if( stack->dq.len >= STACK_MAX ) {
       printf("daemon: push request failed (stack full)\n");
       status = MSG_ERROR;
       strcpy(buf, MSG_ERR_STACK_FULL);
+    } else if( at > stack->dq.len || at < -1 - stack->dq.len ) {
+      status = MSG_ERROR;
+      strcpy(buf, MSG_ERR_DEPTH);
+    } else if( by_fd && (fd == -1 || tab->fds >= tab->max_fds) ) {
+      /* no descriptor means we had no room for it */
+      printf("daemon: push request failed (%zu descriptors held)\n", tab->fds);
+      status = MSG_ERROR;
+      strcpy(buf, MSG_ERR_FDS);
+    } else if( (why = tab_push(tab, stack, at, buf, fd)) != NULL ) {
+      if( strcmp(why, MSG_ERR_DUPLICATE) == 0 )
+	printf("daemon: push request refused (`%s' in already)\n", buf);
+      else
+	printf("daemon: push request failed (out of room)\n");
+      status = MSG_ERROR;
+      strcpy(buf, why);
     } else {
-      soc_w(s, MSG_SUCCESS);
-      if( soc_r(s, buf, FILEPATH_MAX) <= 0 ) {
-	printf("daemon: push request failed (read error)\n");
-	status = MSG_ERROR;
-	strcpy(buf, MSG_ERR_LENGTH);
-      } else {
-	status = MSG_SUCCESS;
-	stack_push(buf, stack);
-	printf("daemon: PUSH `%s'\n", buf);
-      }
+      status = MSG_SUCCESS;
+      printf("daemon: %s %d `%s' [%s]\n", cmd, at, buf, name);
+      fd = -1;
     }
-    soc_w(s, status);
-    soc_w(s, buf);
+    /* the stack has it now, if it went in */
+    if( fd != -1 )
+      close(fd);
+    soc_put(soc, status);
+    soc_put(soc, buf);
 
-  } else if( strcmp(cmd, CMD_POP) == 0 ) {
-    char *status;
-    if( stack_len(stack) > 0 ) {
+  } else if( strcmp(cmd, CMD_POP) == 0 || strcmp(cmd, CMD_SHIFT) == 0 ) {
+    char *status, *popped;
+    popped = tab_remove(tab, stack, strcmp(cmd, CMD_SHIFT) == 0 ? -1 : 0);
+    if( popped != NULL ) {
       status = MSG_SUCCESS;
-      sprintf(buf, "%s", stack_peek(stack));
-      stack_drop(stack);
-      printf("daemon: POP `%s'\n", buf);
+      sprintf(buf, "%s", popped);
+      free(popped);
+      printf("daemon: %s `%s' [%s]\n", cmd, buf, name);
     } else {
       printf("daemon: tried to pop from empty stack\n");
       status = MSG_ERROR;
       sprintf(buf, MSG_ERR_STACK_EMPTY);
     }
-    soc_w(s, status);
-    soc_w(s, buf);
+    soc_put(soc, status);
+    soc_put(soc, buf);
 
   } else if( strcmp(cmd, CMD_PEEK) == 0 ) {
     char *status;
-    if( stack_len(stack) > 0 ) {
+    if( stacktab_path(stack, 0, buf) != NULL ) {
       status = MSG_SUCCESS;
-      sprintf(buf, "%s", stack_peek(stack));
     } else {
       status = MSG_ERROR;
       sprintf(buf, MSG_ERR_STACK_EMPTY);
     }
-    soc_w(s, status);
-    soc_w(s, buf);
+    soc_put(soc, status);
+    soc_put(soc, buf);
 
   } else if( strcmp(cmd, CMD_PICK) == 0 ) {
-    char *picked;
-    soc_w(s, MSG_SUCCESS);
-    soc_r(s, buf, MSG_MAX);
-    picked = stack_nth(atoi(buf), stack);
+    char *picked, path[FILEPATH_MAX];
+    int fd;
+    soc_put(soc, MSG_SUCCESS);
+    soc_get(soc, buf, MSG_MAX);
+    /* counting from the bottom if it's negative */
+    picked = stacktab_path(stack, atoi(buf), path);
+    fd = picked != NULL ? stacktab_fd(stack, atoi(buf)) : -1;
     if( picked == NULL ) {
-      soc_w(s, MSG_ERROR);
-      soc_w(s, "stack is not quite that deep");
+      soc_put(soc, MSG_ERROR);
+      soc_put(soc, MSG_ERR_DEPTH);
+    } else if( fd != -1 ) {
+      soc_put(soc, MSG_SUCCESS_FD);
+      soc_put_fd(soc, picked, fd);
+    } else {
+      soc_put(soc, MSG_SUCCESS);
+      soc_put(soc, picked);
+    }
+
+  } else if( strcmp(cmd, CMD_FIND) == 0 ) {
+    struct Match m;
+    char *pat, hit[MSG_MAX + FILEPATH_MAX], path[FILEPATH_MAX];
+    int kind=-1, i, nhits=0, *hits;
+    soc_put(soc, MSG_SUCCESS);
+    soc_get(soc, buf, FILEPATH_MAX);
+    pat = strchr(buf, ' ');
+    if( pat != NULL ) {
+      *pat++ = '\0';
+      kind = match_kind(buf);
+    }
+    if( kind == -1 ) {
+      soc_put(soc, MSG_ERROR);
+      soc_put(soc, MSG_ERR_MATCH);
+    } else {
+      match_init(&m, kind, pat);
+      hits = xmalloc((stack->dq.len + 1) * sizeof(*hits));
+      for( i = 0; i < stack->dq.len; i++ ) {
+	if( match_path(&m, stacktab_path(stack, i, path)) )
+	  hits[nhits++] = i;
+      }
+      printf("daemon: FIND %s `%s': %d [%s]\n", buf, pat, nhits, name);
+      soc_put(soc, MSG_SUCCESS);
+      sprintf(hit, "%d", nhits);
+      soc_put(soc, hit);
+      for( i = 0; i < nhits; i++ ) {
+	sprintf(hit, "%d %s", hits[i], stacktab_path(stack, hits[i], path));
+	soc_put(soc, hit);
+      }
+      free(hits);
+    }
+
+  } else if( strcmp(cmd, CMD_REMOVE) == 0 ) {
+    char *removed;
+    soc_put(soc, MSG_SUCCESS);
+    soc_get(soc, buf, MSG_MAX);
+    removed = tab_remove(tab, stack, atoi(buf));
+    if( removed == NULL ) {
+      soc_put(soc, MSG_ERROR);
+      soc_put(soc, MSG_ERR_DEPTH);
+    } else {
+      printf("daemon: REMOVE %d `%s' [%s]\n", atoi(buf), removed, name);
+      soc_put(soc, MSG_SUCCESS);
+      soc_put(soc, removed);
+      free(removed);
+    }
+
+  } else if( strcmp(cmd, CMD_TAKE) == 0 ) {
+    int from=0, to=-1, n;
+    soc_put(soc, MSG_SUCCESS);
+    soc_get(soc, buf, MSG_MAX);
+    sscanf(buf, "%d %d", &from, &to);
+    if( from < 0 )
+      from += stack->dq.len;
+    if( to < 0 )
+      to += stack->dq.len;
+    if( from < 0 || to >= stack->dq.len || from > to ) {
+      soc_put(soc, MSG_ERROR);
+      soc_put(soc, MSG_ERR_DEPTH);
+    } else {
+      /* each comes off the same place, as the ones under it move up */
+      printf("daemon: TAKE %d..%d [%s]\n", from, to, name);
+      soc_put(soc, MSG_SUCCESS);
+      sprintf(buf, "%d", to - from + 1);
+      soc_put(soc, buf);
+      for( n = to - from + 1; n > 0; n-- ) {
+	char *taken = tab_remove(tab, stack, from);
+	soc_put(soc, taken);
+	free(taken);
+      }
+    }
+
+  } else if( strcmp(cmd, CMD_STALE) == 0 ) {
+    send_stale(soc, stack);
+
+  } else if( strcmp(cmd, CMD_CLASHES) == 0 ) {
+    send_clashes(soc, stack);
+
+  } else if( strcmp(cmd, CMD_UNIQUE) == 0 ) {
+    soc_put(soc, MSG_SUCCESS);
+    soc_get(soc, buf, MSG_MAX);
+    if( stack == &none )
+      stack = tab_create(tab, name);
+    if( stack == NULL ) {
+      soc_put(soc, MSG_ERROR);
+      soc_put(soc, MSG_ERR_NO_ROOM);
     } else {
-      soc_w(s, MSG_SUCCESS);
-      soc_w(s, picked);
+      stack->unique = atoi(buf) != 0;
+      printf("daemon: UNIQUE %d [%s]\n", stack->unique, name);
+      soc_put(soc, MSG_SUCCESS);
     }
 
   } else if( strcmp(cmd, CMD_SIZE) == 0 ) {
-    sprintf(buf, "%d", stack_len(stack));
-    soc_w(s, buf);
+    sprintf(buf, "%d", stack->dq.len);
+    soc_put(soc, buf);
+
+  } else if( strcmp(cmd, CMD_ROTATE) == 0 ) {
+    soc_put(soc, MSG_SUCCESS);
+    soc_get(soc, buf, MSG_MAX);
+    tab_rotate(stack, atoi(buf));
+    printf("daemon: ROTATE %d [%s]\n", atoi(buf), name);
+    soc_put(soc, MSG_SUCCESS);
+
+  } else if( strcmp(cmd, CMD_SWAP) == 0 ) {
+    if( tab_swap(stack) ) {
+      printf("daemon: SWAP [%s]\n", name);
+      soc_put(soc, MSG_SUCCESS);
+    } else {
+      soc_put(soc, MSG_ERROR);
+      soc_put(soc, MSG_ERR_TOO_FEW);
+    }
+
+  } else if( strcmp(cmd, CMD_CREATE) == 0 ) {
+    if( stack != &none ) {
+      soc_put(soc, MSG_ERROR);
+      soc_put(soc, MSG_ERR_STACK_EXISTS);
+    } else if( tab_create(tab, name) == NULL ) {
+      soc_put(soc, MSG_ERROR);
+      soc_put(soc, MSG_ERR_NO_ROOM);
+    } else {
+      printf("daemon: CREATE [%s]\n", name);
+      soc_put(soc, MSG_SUCCESS);
+    }
+
+  } else if( strcmp(cmd, CMD_DESTROY) == 0 ) {
+    if( tab_destroy(tab, name) ) {
+      printf("daemon: DESTROY [%s]\n", name);
+      soc_put(soc, MSG_SUCCESS);
+    } else {
+      soc_put(soc, MSG_ERROR);
+      soc_put(soc, MSG_ERR_NO_STACK);
+    }
+
+  } else if( strcmp(cmd, CMD_STACKS) == 0 ) {
+    send_stacks(soc, tab);
+
+  } else if( strcmp(cmd, CMD_REPORT) == 0 ) {
+    soc_put(soc, MSG_SUCCESS);
+    if( soc_get(soc, buf, FILEPATH_MAX) <= 0 ) {
+      soc_put(soc, MSG_ERROR);
+      soc_put(soc, MSG_ERR_LENGTH);
+    } else {
+      pthread_mutex_lock(&report_lock);
+      strcpy(user->report, buf);
+      user->reporter = buf[0] != '\0' ? soc->s : -1;
+      pthread_mutex_unlock(&report_lock);
+      soc_put(soc, MSG_SUCCESS);
+    }
+
+  } else if( strcmp(cmd, CMD_PROGRESS) == 0 ) {
+    progress_serve(soc, user);
+
+  } else if( strcmp(cmd, CMD_FRAME) == 0 ) {
+    if( soc_frame(soc) )
+      soc_put(soc, MSG_SUCCESS);
+    else {
+      soc_put(soc, MSG_ERROR);
+      soc_put(soc, MSG_ERR_NO_ROOM);
+    }
+
+  } else if( strcmp(cmd, CMD_STOP) == 0 && !may_stop ) {
+    printf("daemon: refused to stop\n");
+    soc_put(soc, MSG_ERROR);
 
   } else if( strcmp(cmd, CMD_STOP) == 0 ) {
     printf("daemon: Shutting down...\n");
-    soc_w(s, MSG_SUCCESS);
+    soc_put(soc, MSG_SUCCESS);
     keep_running = false;
 
   } else {
     char msg[MSG_MAX + FILEPATH_MAX];
     sprintf(msg, "unknown command `%s'", cmd);
-    soc_w(s, msg);
+    soc_put(soc, msg);
   }
 
   return keep_running;
 }
 
-void daemon_run(int soc_listen) {
-  /* Main daemon loop. */
-  int soc_connect;
-  bool done, connected;
-  char cmd[MSG_MAX];
+static struct User *user_get(uid_t uid, bool system) {
+  /* Return what <uid> has in the daemon, setting it up if need be, with
+     the quota of a <system> daemon's user or the whole of a personal one.
+     Return NULL if we can't. */
+  struct User **link=&users[uid % USER_BUCKETS], *user;
+
+  for( user = *link; user != NULL; user = user->next ) {
+    if( user->uid == uid )
+      return user;
+  }
+  user = malloc(sizeof(*user));
+  if( user == NULL )
+    return NULL;
+  user->uid = uid;
+  if( system )
+    stacktab_init(&user->tab, USER_STACKS_MAX, USER_BYTES_MAX,
+		  fds_max < USER_FDS_MAX ? fds_max : USER_FDS_MAX);
+  else
+    stacktab_init(&user->tab, STACKTAB_MAX, STACKTAB_BYTES_MAX, fds_max);
+  inbox_init(&user->inbox);
+  user->clients = 0;
+  user->holder = -1;
+  user->report[0] = '\0';
+  user->reporter = -1;
+  user->next = *link;
+  *link = user;
+  return user;
+}
+
+static void user_put(struct User *user, bool force) {
+  /* Forget <user> if it has nothing left in the daemon, or if <force>d. */
+  struct User **link=&users[user->uid % USER_BUCKETS];
+
+  if( !force && (user->clients > 0 || user->tab.len > 0 || user->inbox.len > 0) )
+    return;
+  while( *link != user )
+    link = &(*link)->next;
+  *link = user->next;
+  stacktab_free(&user->tab);
+  inbox_free(&user->inbox);
+  free(user);
+}
+
+static struct StackTab *tab_of(uid_t uid, void *arg) {
+  /* For snapshot_load(): the table of <uid>'s stacks, in a daemon that's
+     the system one if <arg> points at true. */
+  struct User *user;
+
+  user = user_get(uid, *(bool *)arg);
+  return user == NULL ? NULL : &user->tab;
+}
+
+static long daemon_save(const char *path) {
+  /* Keep every user's stacks in a snapshot at <path>, for the next daemon
+     to start with; or, if nobody has any, see there's no snapshot.
+     Return how many entries went in, or -1 if they couldn't be kept.
+     Nobody may be serving any stacks meanwhile. */
+  struct User *user;
+  struct Stack *st;
+  FILE *f=NULL;
+  long n=0;
+  size_t b;
+  int i;
+
+  for( i = 0; i < USER_BUCKETS; i++ ) {
+    for( user = users[i]; user != NULL; user = user->next ) {
+      user_drain(user);
+      if( user->tab.len == 0 )
+	continue;
+      if( f == NULL && (f = snapshot_create(path)) == NULL )
+	return -1;
+      snapshot_add(f, user->uid, &user->tab);
+      for( b = 0; b < user->tab.nbucket; b++ ) {
+	for( st = user->tab.buckets[b]; st != NULL; st = st->next )
+	  n += st->dq.len;
+      }
+    }
+  }
+  if( f == NULL ) {
+    if( unlink(path) == -1 && errno != ENOENT ) {
+      fprintf(stderr, "daemon: cannot remove `%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+    return 0;
+  }
+  if( !snapshot_commit(f, path) )
+    return -1;
+  printf("daemon: saved %ld entries to `%s'\n", n, path);
+  return n;
+}
+
+static void on_term(int signum) {
+  terminated = 1;
+}
+
+static bool client_accept(int soc_listen, bool system, struct pollfd *fd,
+			  struct Conn **conn) {
+  /* Take the next connection on <soc_listen> into <fd> and a new <conn>,
+     for the user on the other end.  A <system> daemon takes anyone; a
+     personal one, only its own user and root.
+     Return false if there was nobody to take. */
+  struct ucred cred;
+  socklen_t len=sizeof(cred);
+  struct timeval tv={1, 0};
+  struct User *whose;
+  int s;
+
+  s = accept4(soc_listen, NULL, NULL, SOCK_CLOEXEC);
+  if( s == -1 ) {
+    if( errno != EINTR && errno != EAGAIN && errno != ECONNABORTED )
+      perror("daemon: accept");
+    return false;
+  }
+  if( getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ) {
+    perror("daemon: SO_PEERCRED");
+    close(s);
+    return false;
+  }
+  if( !system && cred.uid != getuid() && cred.uid != 0 ) {
+    printf("daemon: turned away uid %d\n", (int)cred.uid);
+    close(s);
+    return false;
+  }
+  pthread_mutex_lock(&stacks_lock);
+  whose = user_get(cred.uid, system);
+  pthread_mutex_unlock(&stacks_lock);
+  *conn = calloc(1, sizeof(**conn));
+  if( whose == NULL || *conn == NULL ) {
+    printf("daemon: no room for uid %d\n", (int)cred.uid);
+    free(*conn);
+    close(s);
+    return false;
+  }
+  /* someone else's half-sent command mustn't hold everybody up */
+  if( system )
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  whose->clients++;
+  soc_init(&(*conn)->soc, s);
+  (*conn)->user = whose;
+  fd->fd = s;
+  fd->events = POLLIN;
+  fd->revents = 0;
+  printf("daemon: Connected uid %d.\n", (int)cred.uid);
+  return true;
+}
+
+static void client_drop(struct Conn *conn) {
+  /* Hang up on <conn>, which no worker has, and let its user's next
+     connection in; what was pushed meanwhile goes on the stacks now. */
+  struct User *user=conn->user;
+
+  if( user->holder == conn->soc.s ) {
+    user->holder = -1;
+    user_drain(user);
+  }
+  pthread_mutex_lock(&report_lock);
+  if( user->reporter == conn->soc.s ) {
+    user->report[0] = '\0';
+    user->reporter = -1;
+  }
+  pthread_mutex_unlock(&report_lock);
+  soc_free(&conn->soc);
+  close(conn->soc.s);
+  user->clients--;
+  pthread_mutex_lock(&stacks_lock);
+  user_put(user, false);
+  pthread_mutex_unlock(&stacks_lock);
+  free(conn);
+}
+
+static void conn_serve(struct Conn *conn) {
+  /* Do what <conn> sent, the way the poll loop said to; and, holding
+     the user, whatever else it has sent in the meantime.  The replies go
+     together at the end. */
+
+  switch (conn->how) {
+  case SERVE_PROGRESS:
+    progress_serve(&conn->soc, conn->user);
+    break;
+  case SERVE_INBOX:
+    inbox_serve(&conn->soc, conn->cmd, conn->user);
+    break;
+  case SERVE_HOLDER:
+    if( conn->drain )
+      user_drain(conn->user);
+    do {
+      if( !is_cmd(conn->cmd, CMD_REPORT) )
+	printf("daemon: received command `%s' from uid %d\n", conn->cmd,
+	       (int)conn->user->uid);
+      /* anything after it waits its turn again */
+      if( is_cmd(conn->cmd, CMD_RELEASE) ) {
+	soc_put(&conn->soc, MSG_SUCCESS);
+	conn->release = true;
+	break;
+      }
+      conn->stop = !daemon_serve(&conn->soc, conn->cmd, conn->user, conn->may_stop);
+      if( conn->stop || !soc_ready(&conn->soc) )
+	break;
+      conn->lost = soc_get(&conn->soc, conn->cmd, MSG_MAX) <= 0;
+    } while( !conn->lost );
+    break;
+  }
+  soc_flush(&conn->soc);
+}
+
+static struct Conn *pool_take(struct Pool *pool) {
+  /* Wait for a connection to serve, and return it; or NULL once the pool
+     is to quit and nothing is left. */
+  struct Conn *conn=NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  while( pool->len == 0 && !pool->quit )
+    pthread_cond_wait(&pool->cond, &pool->lock);
+  if( pool->len > 0 ) {
+    conn = pool->jobs[pool->head];
+    pool->head = (pool->head + 1) % CLIENTS_MAX;
+    pool->len--;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return conn;
+}
+
+static void pool_done(struct Pool *pool, struct Conn *conn) {
+  /* Hand <conn> back to the poll loop. */
+
+  /* a pointer is well under PIPE_BUF, so it goes in whole */
+  if( write(pool->wake[1], &conn, sizeof(conn)) != sizeof(conn) )
+    perror("daemon: wake");
+}
+
+static void *worker_run(void *arg) {
+  /* Serve connections until the pool quits. */
+  struct Pool *pool=arg;
+  struct Conn *conn;
+
+  while( (conn = pool_take(pool)) != NULL ) {
+    conn_serve(conn);
+    pool_done(pool, conn);
+  }
+  return NULL;
+}
+
+static void pool_give(struct Pool *pool, struct Conn *conn) {
+  /* Have a worker serve <conn>, which is busy till it comes back; or, with
+     no workers, do it now. */
+
+  conn->busy = true;
+  if( pool->nthreads == 0 ) {
+    conn_serve(conn);
+    pool_done(pool, conn);
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->jobs[(pool->head + pool->len) % CLIENTS_MAX] = conn;
+  pool->len++;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_start(struct Pool *pool) {
+  /* Start as many of DAEMON_THREADS workers as we can. */
+  int i;
+
+  if( pipe2(pool->wake, O_CLOEXEC) == -1 ) {
+    perror("daemon: pipe");
+    exit(EXIT_FAILURE);
+  }
+  fcntl(pool->wake[0], F_SETFL, O_NONBLOCK);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pool->head = pool->len = 0;
+  pool->quit = false;
+  for( i = 0; i < DAEMON_THREADS; i++ ) {
+    if( pthread_create(&pool->threads[i], NULL, worker_run, pool) != 0 )
+      break;
+  }
+  pool->nthreads = i;
+  printf("daemon: %d workers\n", pool->nthreads);
+}
+
+static void pool_stop(struct Pool *pool) {
+  /* Let the workers finish what they have, and wait for them. */
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  for( i = 0; i < pool->nthreads; i++ )
+    pthread_join(pool->threads[i], NULL);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->cond);
+  close(pool->wake[0]);
+  close(pool->wake[1]);
+}
+
+void daemon_run(int soc_listen, bool system, int idle, bool tell_parent) {
+  /* Main daemon loop: hand every connected client's commands to the
+     workers as they arrive, one connection per user at a time.  A command
+     from another of the user's connections waits in its Conn until the
+     one being served is done, except a progress query, which is answered
+     straight away, and a plain push, which goes in the user's inbox.
+     A <system> daemon serves every user on the host, each with their
+     own stacks and quota; otherwise there's only the one user.
+     Start with the stacks the last daemon here kept, if it did; keep them
+     likewise and return after <idle> seconds without a client, unless
+     that's 0, or when terminated.  Signal the parent once we're listening
+     if we're to <tell_parent>. */
+  struct pollfd fds[CLIENTS_MAX + FIRST_CLIENT];
+  struct Conn *conns[CLIENTS_MAX + FIRST_CLIENT], *conn;
+  static struct Pool pool;
+  struct rlimit lim;
+  struct sigaction sa;
+  sigset_t term, waiting;
+  struct timespec quiet, now, wait, *waitp;
+  char snapshot[FILEPATH_MAX];
+  long kept;
+  int i, n, nfds, holder, polled;
+  bool done, ready;
 
   /* we don't want to terminate just because a client broke the socket */
   sig_ignore(SIGPIPE);
 
-  if( listen(soc_listen, 1) == -1 ) {
+  /* held descriptors take what the clients don't need */
+  if( getrlimit(RLIMIT_NOFILE, &lim) == 0 ) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+    getrlimit(RLIMIT_NOFILE, &lim);
+    if( lim.rlim_cur > CLIENTS_MAX + FDS_SPARE )
+      fds_max = lim.rlim_cur - CLIENTS_MAX - FDS_SPARE;
+  }
+  printf("daemon: holding up to %zu descriptors\n", fds_max);
+
+  /* pushers from many shells at once queue up rather than be turned away */
+  if( listen(soc_listen, SOMAXCONN) == -1 ) {
     perror("daemon: listen");
     exit(EXIT_FAILURE);
   }
+  /* only the main loop hears of it, and only while it waits */
+  sa.sa_handler = on_term;
+  sa.sa_flags = 0;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigemptyset(&term);
+  sigaddset(&term, SIGTERM);
+  sigaddset(&term, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &term, &waiting);
+  pool_start(&pool);
+
+  /* let parent know that we're ready; a supervisor needn't be told */
+  if( tell_parent ) {
+    printf("daemon: signalling %d\n", getppid());
+    kill(getppid(), SIGUSR1);
+  }
 
-  /* let parent know that we're ready */
-  printf("daemon: signalling %d\n", getppid());
-  kill(getppid(), SIGUSR1);
+  fds[0].fd = soc_listen;
+  fds[0].events = POLLIN;
+  /* poll() passes over it if we can't watch.  A system daemon doesn't:
+     it would look, with its own rights, at whatever anybody pushed, and
+     tell them what it saw happen there */
+  fds[1].fd = system ? -1 : watch_init(stacked);
+  fds[1].events = POLLIN;
+  fds[2].fd = pool.wake[0];
+  fds[2].events = POLLIN;
 
+  /* anyone who connected meanwhile waits for this */
+  snprintf(snapshot, sizeof(snapshot), "%s%s", soc_path, SNAPSHOT_SUFFIX);
+  clock_gettime(CLOCK_MONOTONIC, &quiet);
+  pthread_mutex_lock(&stacks_lock);
+  kept = snapshot_load(snapshot, tab_of, &system);
+  pthread_mutex_unlock(&stacks_lock);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if( kept > 0 )
+    printf("daemon: restored %ld entries from `%s' in %.2f ms\n", kept, snapshot,
+	   (now.tv_sec - quiet.tv_sec) * 1e3 + (now.tv_nsec - quiet.tv_nsec) / 1e6);
+  quiet = now;
+
+  nfds = FIRST_CLIENT;
   done = false;
-  while(!done) {
-    printf("daemon: Waiting for a connection...\n");
-    soc_connect = accept(soc_listen, NULL, NULL);
-    if( soc_connect == -1 ) {
-      perror("daemon: accept");
+  while( !done ) {
+    /* a user's other connections wait, once they've sent something, until
+       the one being served is done; one a worker has is passed over */
+    ready = false;
+    for( i = FIRST_CLIENT; i < nfds; i++ ) {
+      conn = conns[i];
+      holder = conn->user->holder;
+      fds[i].fd = conn->busy ? -1 : conn->soc.s;
+      fds[i].events = conn->cmd[0] == '\0' ? POLLIN : 0;
+      if( conn->busy )
+	continue;
+      /* so is one with another command read in already */
+      if( conn->cmd[0] != '\0' ? holder == -1 || holder == conn->soc.s
+	  : conn->lost || soc_ready(&conn->soc) )
+	ready = true;
+    }
+    /* the idle time runs from when the last client went */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    waitp = NULL;
+    if( nfds > FIRST_CLIENT )
+      quiet = now;
+    else if( idle > 0 ) {
+      wait.tv_sec = quiet.tv_sec + idle - now.tv_sec;
+      wait.tv_nsec = quiet.tv_nsec - now.tv_nsec;
+      if( wait.tv_nsec < 0 ) {
+	wait.tv_sec--;
+	wait.tv_nsec += 1000000000;
+      }
+      if( wait.tv_sec < 0 )
+	wait.tv_sec = wait.tv_nsec = 0;
+      waitp = &wait;
+    }
+    if( ready ) {
+      wait.tv_sec = wait.tv_nsec = 0;
+      waitp = &wait;
+    }
+    polled = ppoll(fds, nfds, waitp, &waiting);
+    if( terminated ) {
+      printf("daemon: terminated\n");
+      break;
+    }
+    if( polled == -1 ) {
+      if( errno == EINTR )
+	continue;
+      perror("daemon: poll");
       exit(EXIT_FAILURE);
     }
-    connected = true;
-    printf("daemon: Connected.\n");
-    while( connected && !done ) {
-      int n;
-      n = soc_r(soc_connect, cmd, MSG_MAX);
-      if( n < 0 ) {
-	connected = false;
-	printf("daemon: disconnected for read error\n");
+    if( polled == 0 && !ready && nfds == FIRST_CLIENT && idle > 0 ) {
+      printf("daemon: idle for %d seconds\n", idle);
+      if( daemon_save(snapshot) == -1 ) {
+	quiet = now;
+	continue;
       }
-      if( n == 0 ) {
-	connected = false;
-	printf("daemon: disconnected for closed socket\n");
+      /* somebody turned up after all; they're still served from here */
+      if( poll(fds, 1, 0) > 0 ) {
+	unlink(snapshot);
+	continue;
       }
-      if( connected ) {
-	printf("daemon: received command `%s'\n", cmd);
-	if( !daemon_serve(soc_connect, cmd) )
+      break;
+    }
+    if( fds[2].revents & POLLIN ) {
+      while( read(pool.wake[0], &conn, sizeof(conn)) == sizeof(conn) ) {
+	conn->busy = false;
+	conn->cmd[0] = '\0';
+	if( conn->stop )
 	  done = true;
+	if( conn->release && conn->user->holder == conn->soc.s ) {
+	  conn->user->holder = -1;
+	  user_drain(conn->user);
+	}
+	conn->release = false;
       }
     }
-    close(soc_connect);
+    if( fds[1].revents & POLLIN ) {
+      pthread_mutex_lock(&stacks_lock);
+      if( watch_read() )
+	recheck();
+      pthread_mutex_unlock(&stacks_lock);
+    }
+    if( (fds[0].revents & POLLIN) && nfds < CLIENTS_MAX + FIRST_CLIENT
+	&& client_accept(soc_listen, system, &fds[nfds], &conns[nfds]) )
+      nfds++;
+
+    for( i = FIRST_CLIENT; i < nfds && !done; i++ ) {
+      conn = conns[i];
+      if( conn->busy )
+	continue;
+      holder = conn->user->holder;
+      n = 1;
+      if( conn->lost )
+	n = -1;
+      else if( conn->cmd[0] != '\0' ) {
+	if( holder != -1 && holder != conn->soc.s )
+	  continue;
+      } else {
+	if( fds[i].revents & POLLIN ) {
+	  n = soc_fill(&conn->soc, false);
+	  if( n == -1 && (errno == EAGAIN || errno == EINTR) )
+	    n = 1;
+	} else if( fds[i].revents != 0 )
+	  n = -1;
+	/* the rest of a command may be on its way */
+	if( n > 0 && !soc_ready(&conn->soc) )
+	  continue;
+	if( n > 0 )
+	  n = soc_get(&conn->soc, conn->cmd, MSG_MAX);
+      }
+      if( n <= 0 ) {
+	printf("daemon: disconnected uid %d for %s\n", (int)conn->user->uid,
+	       n == 0 ? "closed socket" : "read error");
+	client_drop(conn);
+	/* fill the gap from the end, and look at what's in it now */
+	fds[i] = fds[--nfds];
+	conns[i] = conns[nfds];
+	i--;
+	continue;
+      }
+      if( is_cmd(conn->cmd, CMD_PROGRESS) ) {
+	conn->how = SERVE_PROGRESS;
+	pool_give(&pool, conn);
+	continue;
+      }
+      if( holder != -1 && holder != conn->soc.s ) {
+	/* anything else waits in <cmd> */
+	if( is_cmd(conn->cmd, CMD_PUSH) ) {
+	  conn->how = SERVE_INBOX;
+	  pool_give(&pool, conn);
+	}
+	continue;
+      }
+      conn->how = SERVE_HOLDER;
+      conn->drain = holder == -1;
+      conn->user->holder = conn->soc.s;
+      conn->may_stop = conn->user->uid == getuid() || conn->user->uid == 0;
+      pool_give(&pool, conn);
+    }
+  }
+
+  pool_stop(&pool);
+  if( terminated )
+    daemon_save(snapshot);
+  for( i = FIRST_CLIENT; i < nfds; i++ ) {
+    soc_free(&conns[i]->soc);
+    close(conns[i]->soc.s);
+    free(conns[i]);
+  }
+  for( i = 0; i < USER_BUCKETS; i++ ) {
+    while( users[i] != NULL )
+      user_put(users[i], true);
   }
+  watch_free();
 }
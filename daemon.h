@@ -1 +1 @@
-void daemon_run(int soc_listen);
+void daemon_run(int soc_listen, bool system, int idle, bool tell_parent);
@@ -8,18 +8,26 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "fls.h"
 #include "client.h"
 #include "daemon.h"
 #include "comm.h"
 #include "sig.h"
+#include "copy.h"
 
-int verbose=0;
-bool am_daemon=false;
-
+static bool system_mode;	/* use the system daemon, rather than our own */
+static bool serve_system;	/* start it */
+static bool serve;		/* be the daemon, in the foreground */
+static int idle_secs;		/* a daemon we start goes this long after its last client, or never */
+static bool helper;		/* take commands from stdin, over the one connection */
 
 void usage(int status) {
   /* Tell the user how to do better, and exit with <status>. */
@@ -27,7 +35,7 @@ void usage(int status) {
     fprintf(stderr, "Try `%s -h' for more information.\n", program_name);
   } else {
     printf("\
-Usage: %s <ACTION> [OPTION...] [DEST]\n\
+Usage: %s <ACTION> [OPTION...] [DEST...]\n\
   or:  %s [FILE]...\n\
 ", program_name, program_name);
     printf("\
@@ -37,11 +45,21 @@ Push FILEs onto the stack, or perform action ACTION.\n\
 \n\
 Actions:\n\
   -c    COPY\n\
-          pop a file from the stack, copy it to DEST or current dir\n\
+          pop a file from the stack, copy it to DEST or current dir;\n\
+          given several DESTs, copy it to all of them, reading it once\n\
   -m    MOVE\n\
           pop a file from the stack, move it to DEST or current dir\n\
   -s    SYMLINK\n\
           pop a file from the stack, symlink it to DEST or current dir\n\
+  -l    LINK\n\
+          pop a file from the stack, hard-link it to DEST or current dir,\n\
+          making directories anew and linking what's in them\n\
+  -r    CLONE\n\
+          pop a file from the stack, reflink it to DEST or current dir,\n\
+          copying it where the filesystem can't\n\
+  -a    ARCHIVE\n\
+          pop a file from the stack, write it into a tar archive at DEST;\n\
+          gzipped if DEST ends in .gz or .tgz\n\
   -d    DROP\n\
           pop a file from the stack, print its name\n\
 ");
@@ -49,17 +67,82 @@ Actions:\n\
   -p    PRINT\n\
           print the contents of the stack\n\
   -q    QUIT\n\
-          terminate the stack daemon, losing the contents of the stack\n\
+          terminate the stack daemon, losing the contents of every stack\n\
   -h    HELP\n\
           display usage information, and then exit\n\
+");
+    printf("\
+  --rotate N\n\
+          move the top N files to the bottom of the stack, or, if N is\n\
+          negative, the bottom -N to the top\n\
+  --stacks\n\
+          list the stacks the daemon has, and how much each holds\n\
+  --create\n\
+          make an empty stack named by -S\n\
+  --destroy\n\
+          get rid of the stack named by -S, and everything in it\n\
+  --unique\n\
+          have the stack refuse FILEs that are in it already, skipping\n\
+          them when they are pushed; --no-unique takes them again\n\
 ");
     printf("\
 \n\
 Options:\n\
-  -n N  (available for COPY, MOVE, SYMLINK, and DROP)\n\
+  -n N  (available for every action that pops)\n\
           perform action to the top N files on the stack\n\
+  -i INDEX  (available for actions that pop, and pushing)\n\
+          perform action to the files at INDEX, numbered as PRINT numbers\n\
+          them, or from -1 at the bottom; INDEX can list several, and\n\
+          ranges of them, as in `3,7..9'; FILEs pushed go in at INDEX\n\
+  --fifo  (available for every action that pops)\n\
+          take files from the bottom of the stack, the first pushed\n\
+          first, rather than the top\n\
+  --plan[=FORMAT]  (available for every action that pops)\n\
+          say what the action would do to each file, how much data it\n\
+          would move and about how long it would take, and don't do it;\n\
+          FORMAT is `text', the default, or `json'\n\
+  --progress  (available for every action that pops)\n\
+          keep a line on the terminal saying how far it has got; with no\n\
+          action, say how far the pop running from another shell has got\n\
+");
+    printf("\
+  --match GLOB  (available for actions that pop, and PRINT)\n\
+          perform action to every file whose name matches GLOB, or, if\n\
+          GLOB has a slash in it, whose whole path does\n\
+  --contains STRING\n\
+          the same, for every file with STRING anywhere in its path\n\
+  --prefix PATH\n\
+          the same, for every file whose path starts with PATH\n\
 ");
     printf("\
+  --pushfd\n\
+          push FILEs as open descriptors the daemon holds, as well as\n\
+          their paths, so that actions find them even if they are renamed\n\
+  -S NAME\n\
+          work on the stack called NAME rather than the default one;\n\
+          pushing to a stack that doesn't exist yet creates it\n\
+  --system\n\
+          use the system daemon at %s, shared by every user\n\
+          but with stacks of your own, rather than a daemon of your own;\n\
+          only one run by root, or by you, is talked to\n\
+  --serve-system\n\
+          start the system daemon\n\
+  --serve\n\
+          be the daemon, with --system the system one, in the foreground\n\
+          and logging to stdout, for a supervisor to look after; it\n\
+          listens on the socket passed as LISTEN_FDS, if there is one\n\
+  --helper\n\
+          keep one connection to the daemon, and run commands read from\n\
+          stdin over it, for a shell to keep as a coprocess; each is the\n\
+          number of args, the directory to run in and the args, each\n\
+          ended by a NUL, and its output is followed by a NUL and its\n\
+          exit status on a line\n\
+  --idle SECS\n\
+          have a daemon started from here keep its stacks in a snapshot\n\
+          and exit once it has had no clients for SECS seconds; the\n\
+          next one starts from the snapshot\n\
+", FLS_SYSTEM_PATH);
+    printf("\
 \n\
 If no args are provided, the default action is PRINT.\n\
 \n\
@@ -113,6 +196,17 @@ void *xmalloc(size_t size) {
   return ptr;
 }
 
+void *xrealloc(void *ptr, size_t size) {
+  /* Loudly fail on memory allocation error. */
+
+  ptr = realloc(ptr, size);
+  if( ptr == NULL ) {
+    fprintf(stderr, "realloc failed\n");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
 char *xstrdup(char *str) {
   /* Loudly fail on memory allocation error. */
   char *ptr;
@@ -127,14 +221,13 @@ char *xstrdup(char *str) {
 
 void genset_soc_path() {
   /* Generate soc_path from user name, and set it. */
-  char *generated, *username, *tmpdir="/tmp/";
-  int size;
-
-  username = getenv("USER");
+  static char generated[FILEPATH_MAX];
 
-  size = strlen(tmpdir) + strlen(username) + strlen(PROGRAM_NAME) +1;
-  generated = xmalloc(size);
-  sprintf(generated, "%s%s%s", tmpdir, username, PROGRAM_NAME);
+  if( fls_default_path(generated, sizeof(generated)) == -1 ) {
+    fprintf(stderr, "%s: cannot work out where the daemon lives (is USER set?)\n",
+	    program_name);
+    exit(EXIT_FAILURE);
+  }
   soc_path = generated;
 }
 
@@ -150,12 +243,39 @@ void action_set(struct Action *action, enum ActionType type) {
   }
 }
 
-struct Action handle_options(int argc, char **argv) {
-  /* Return the proper action to take. */
-  struct Action action = {NOTHING, 1, NULL};
+struct Action handle_options(int argc, char **argv, char **stack) {
+  /* Return the proper action to take, and set <stack> to the name of the
+     stack to take it on. */
+  struct option longopts[] = {
+    {"backend", required_argument, NULL, 'B'},
+    {"verify",  no_argument,       NULL, 'V'},
+    {"skip-identical", no_argument, NULL, 'I'},
+    {"stacks",  no_argument,       NULL, 'L'},
+    {"create",  no_argument,       NULL, 'C'},
+    {"destroy", no_argument,       NULL, 'D'},
+    {"unique",  no_argument,       NULL, 'U'},
+    {"no-unique", no_argument,     NULL, 'N'},
+    {"fifo",    no_argument,       NULL, 'F'},
+    {"progress", no_argument,      NULL, 'O'},
+    {"plan",    optional_argument, NULL, 'X'},
+    {"pushfd",  no_argument,       NULL, 'H'},
+    {"rotate",  required_argument, NULL, 'R'},
+    {"system",  no_argument,       NULL, 'Y'},
+    {"serve-system", no_argument,  NULL, 'Z'},
+    {"serve",   no_argument,       NULL, 'J'},
+    {"idle",    required_argument, NULL, 'E'},
+    {"helper",  no_argument,       NULL, 'W'},
+    {"match",   required_argument, NULL, 'G'},
+    {"contains", required_argument, NULL, 'K'},
+    {"prefix",  required_argument, NULL, 'P'},
+    {"interactive", no_argument,   NULL, 'T'},
+    {"help",    no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+  struct Action action = {NOTHING, 1, NULL, 0, 0, NULL, NULL, NULL, MATCH_GLOB};
   int c;
 
-  while( (c = getopt(argc, argv, "cmsdpiqvn:h")) != -1 ) {
+  while( (c = getopt_long(argc, argv, "cmslradpqvn:i:S:h", longopts, NULL)) != -1 ) {
     switch (c) {
     case 'c':
       action_set(&action, COPY);
@@ -166,18 +286,94 @@ struct Action handle_options(int argc, char **argv) {
     case 's':
       action_set(&action, SYMLINK);
       break;
+    case 'l':
+      action_set(&action, LINK);
+      break;
+    case 'r':
+      action_set(&action, CLONE);
+      break;
+    case 'a':
+      action_set(&action, ARCHIVE);
+      break;
     case 'd':
       action_set(&action, DROP);
       break;
     case 'p':
       action_set(&action, PRINT);
       break;
-    case 'i':
+    case 'T':
       action_set(&action, INTERACTIVE);
       break;
     case 'q':
       action_set(&action, STOP);
       break;
+    case 'F':
+      action.flags |= ACTION_FIFO;
+      break;
+    case 'O':
+      action.flags |= ACTION_PROGRESS;
+      break;
+    case 'H':
+      action.flags |= ACTION_PUSHFD;
+      break;
+    case 'X':
+      action.flags |= ACTION_PLAN;
+      if( optarg != NULL && strcmp(optarg, "json") == 0 )
+	action.flags |= ACTION_PLAN_JSON;
+      else if( optarg != NULL && strcmp(optarg, "text") != 0 ) {
+	fprintf(stderr, "invalid argument `%s' for option `plan'\n", optarg);
+	usage(EXIT_FAILURE);
+      }
+      break;
+    case 'R':
+      action_set(&action, ROTATE);
+      action.num = atoi(optarg);
+      if( action.num == 0 ) {
+	fprintf(stderr, "invalid argument `%s' for option `rotate'\n", optarg);
+	usage(EXIT_FAILURE);
+      }
+      break;
+    case 'L':
+      action_set(&action, STACKS);
+      break;
+    case 'C':
+      action_set(&action, CREATE);
+      break;
+    case 'D':
+      action_set(&action, DESTROY);
+      break;
+    case 'U':
+    case 'N':
+      action_set(&action, UNIQUE);
+      action.num = c == 'U';
+      break;
+    case 'S':
+      if( !stack_name_okay(optarg) ) {
+	fprintf(stderr, "invalid stack name `%s' (up to %d characters, no spaces)\n",
+		optarg, STACK_NAME_MAX - 1);
+	usage(EXIT_FAILURE);
+      }
+      *stack = optarg;
+      break;
+    case 'Y':
+      system_mode = true;
+      break;
+    case 'Z':
+      serve_system = true;
+      break;
+    case 'J':
+      serve = true;
+      break;
+    case 'W':
+      helper = true;
+      break;
+    case 'E':
+      idle_secs = atoi(optarg);
+      if( idle_secs < 0 ) {
+	fprintf(stderr, "invalid idle time `%s'\n", optarg);
+	usage(EXIT_FAILURE);
+      }
+      break;
     case 'v':
       verbose++;
       break;
@@ -188,12 +384,45 @@ struct Action handle_options(int argc, char **argv) {
 	usage(EXIT_FAILURE);
       }
       break;
+    case 'i':
+      action.index = optarg;
+      break;
+    case 'G':
+    case 'K':
+    case 'P':
+      action.match = optarg;
+      action.match_kind = c == 'G' ? MATCH_GLOB : c == 'K' ? MATCH_SUBSTR : MATCH_PREFIX;
+      break;
+    case 'B':
+      if( strcmp(optarg, "uring") == 0 )
+	action.flags |= ACTION_URING;
+      else if( strcmp(optarg, "sync") == 0 )
+	action.flags &= ~ACTION_URING;
+      else {
+	fprintf(stderr, "invalid argument `%s' for option `backend'\n", optarg);
+	usage(EXIT_FAILURE);
+      }
+      break;
+    case 'V':
+      action.flags |= ACTION_VERIFY;
+      break;
+    case 'I':
+      action.flags |= ACTION_SKIP_IDENTICAL;
+      break;
     case 'h':
       usage(EXIT_SUCCESS);
     case '?':
       usage(EXIT_FAILURE);
     }
   }
+  if( action.index != NULL && action.match != NULL ) {
+    fprintf(stderr, "%s: -i and matching don't go together\n", program_name);
+    usage(EXIT_FAILURE);
+  }
+  /* on its own, it asks after somebody else's pop */
+  if( action.type == NOTHING && (action.flags & ACTION_PROGRESS)
+      && optind == argc )
+    action_set(&action, PROGRESS);
   if( optind < argc ) {
     if( verbose )
       printf("arg provided\n");
@@ -206,12 +435,16 @@ struct Action handle_options(int argc, char **argv) {
     case COPY:
     case MOVE:
     case SYMLINK:
-      if( (optind +1) < argc ) {
+    case LINK:
+    case CLONE:
+    case ARCHIVE:
+      if( argc - optind > (action.type == COPY ? COPY_DEST_MAX : 1) ) {
 	fprintf(stderr, "Too many supplied arguments for requested action: `%s'\n",
 		action_verb(action.type));
 	usage(EXIT_FAILURE);
       }
-      action.ptr = argv[optind];
+      action.ndest = argc - optind;
+      action.ptr = &argv[optind];
       break;
     default:
       fprintf(stderr, "Requested action `%s' does not take arguments\n",
@@ -219,75 +452,322 @@ struct Action handle_options(int argc, char **argv) {
       usage(EXIT_FAILURE);
     }
   }
+  if( (action.flags & ACTION_PUSHFD) && action.type != PUSH ) {
+    fprintf(stderr, "%s: --pushfd goes with FILEs to push\n", program_name);
+    usage(EXIT_FAILURE);
+  }
+  if( (action.flags & ACTION_PLAN) && action.type != COPY && action.type != MOVE
+      && action.type != SYMLINK && action.type != LINK && action.type != CLONE
+      && action.type != ARCHIVE ) {
+    fprintf(stderr, "%s: --plan goes with an action that pops\n", program_name);
+    usage(EXIT_FAILURE);
+  }
+  if( action.type == ARCHIVE && action.ndest != 1 ) {
+    fprintf(stderr, "%s: archive to which FILE?\n", program_name);
+    usage(EXIT_FAILURE);
+  }
   return action;
 }
 
 
-int main(int argc, char **argv) {
+static int soc_bind(bool system) {
+  /* Return a new socket bound at soc_path, for a <system> daemon that
+     every user connects to, or else our own; or -1 if there's a daemon
+     there already. */
   int soc_listen;
   struct sockaddr_un local;
-  struct Action action;
-
-  verbose = 0;
-  am_daemon = false;
-  set_program_name(argv[0]);
-  genset_soc_path();
-
-  action = handle_options(argc, argv);
-  sig_block(SIGUSR1);
 
   if( (soc_listen = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ) {
     perror("socket");
     exit(EXIT_FAILURE);
   }
 
-  /* try to bind a new socket; if we can, use it to start the server */
   local.sun_family = AF_UNIX;
   strcpy(local.sun_path, soc_path);
   if( bind(soc_listen, (struct sockaddr *)&local, sizeof(local)) == -1 ) {
-    if( errno == EADDRINUSE ){
-      if( verbose )
-	printf("Socket file exists. (%s)\n", soc_path);
-    } else {
+    if( errno != EADDRINUSE ) {
       perror("bind");
       exit(EXIT_FAILURE);
     }
-  } else {
     if( verbose )
-      printf("pid=`%d'\n", getpid());
-    /* start the daemon */
-    printf("Starting daemon...\n");
-
-    if( !fork() ) {
-      /* don't fill the log with junk just because client was started with -v */
-      verbose = 0;
-      am_daemon = true;
-      log_output();
-      printf("daemon: Daemon started with pid %d\n", getpid());
-      daemon_run(soc_listen);
-      unlink(soc_path);
-      printf("daemon: All done.     -><-\n");
-      exit(EXIT_SUCCESS);
+      printf("Socket file exists. (%s)\n", soc_path);
+    close(soc_listen);
+    return -1;
+  }
+  /* the daemon tells its users apart itself */
+  if( system && chmod(soc_path, 0666) == -1 ) {
+    perror("chmod");
+    unlink(soc_path);
+    exit(EXIT_FAILURE);
+  }
+  return soc_listen;
+}
 
-    } else { /* if(!fork) */
-      if( verbose )
-	printf("Waiting for signal...\n");
-      /* wait a whole second for the daemon to start running */
-      /* expect to receive SIGUSR1 */
-      if( !sig_catch(1.0) ) {
-	fprintf(stderr, "Daemon failed to start\n");
-	fprintf(stderr, "Continue anyway\n");
-      }
+static int soc_inherited(void) {
+  /* Return the socket a supervisor bound for us and passed the way
+     systemd does, as descriptor 3 with LISTEN_PID our pid and LISTEN_FDS
+     1; or -1 if it didn't.  Whatever we start doesn't inherit it. */
+  char *pid=getenv("LISTEN_PID"), *fds=getenv("LISTEN_FDS");
+
+  if( pid == NULL || fds == NULL || atol(pid) != getpid() )
+    return -1;
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  if( atoi(fds) != 1 ) {
+    fprintf(stderr, "%s: passed %s sockets, rather than the one\n", program_name, fds);
+    exit(EXIT_FAILURE);
+  }
+  fcntl(3, F_SETFD, FD_CLOEXEC);
+  return 3;
+}
+
+static void daemon_start(bool system) {
+  /* Start a daemon at soc_path, unless one is already there; a <system>
+     daemon for every user to connect to, else our own. */
+  int soc_listen;
+
+  /* try to bind a new socket; if we can, use it to start the server */
+  soc_listen = soc_bind(system);
+  if( soc_listen == -1 ) {
+    if( system ) {
+      fprintf(stderr, "%s: a daemon is already listening at `%s'\n", program_name, soc_path);
+      exit(EXIT_FAILURE);
     }
+    return;
+  }
+  if( verbose )
+    printf("pid=`%d'\n", getpid());
+  /* start the daemon */
+  printf("Starting %sdaemon...\n", system ? "system " : "");
+  fflush(stdout);
+
+  if( !fork() ) {
+    /* don't fill the log with junk just because client was started with -v */
+    verbose = 0;
+    am_daemon = true;
+    log_output();
+    printf("daemon: Daemon started with pid %d\n", getpid());
+    daemon_run(soc_listen, system, idle_secs, true);
+    unlink(soc_path);
+    printf("daemon: All done.     -><-\n");
+    exit(EXIT_SUCCESS);
+
+  } else { /* if(!fork) */
+    if( verbose )
+      printf("Waiting for signal...\n");
+    /* wait a whole second for the daemon to start running */
+    /* expect to receive SIGUSR1 */
+    if( !sig_catch(1.0) ) {
+      fprintf(stderr, "Daemon failed to start\n");
+      fprintf(stderr, "Continue anyway\n");
+    } else if( system )
+      printf("System daemon listening at `%s'\n", soc_path);
   }
   if( close(soc_listen) == -1 ) {
     perror("close");
   }
+}
+
+static void daemon_serve_here(bool system) {
+  /* Be the daemon at soc_path, a <system> one or our own, until it's
+     stopped or goes idle; on the socket a supervisor passed us, if it
+     did, which stays its to remove. */
+  int soc_listen;
+  bool own=false;
+
+  soc_listen = soc_inherited();
+  if( soc_listen == -1 ) {
+    soc_listen = soc_bind(system);
+    if( soc_listen == -1 ) {
+      fprintf(stderr, "%s: a daemon is already listening at `%s'\n", program_name, soc_path);
+      exit(EXIT_FAILURE);
+    }
+    own = true;
+  }
+  verbose = 0;
+  am_daemon = true;
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  printf("daemon: Daemon started with pid %d\n", getpid());
+  daemon_run(soc_listen, system, idle_secs, false);
+  if( own )
+    unlink(soc_path);
+  printf("daemon: All done.     -><-\n");
+}
+
+static void helper_connect(struct Fls *fls) {
+  /* (Re)connect <fls> to the daemon, starting our own if it's gone. */
+
+  fls_close(fls);
+  if( !system_mode )
+    daemon_start(false);
+  if( fls_open(fls, soc_path) == -1 )
+    fprintf(stderr, "%s.\n", fls_error(fls));
+}
+
+static char **helper_read(FILE *in, int *argc, char **dir) {
+  /* Read the next command for helper_run() from <in>: the number of args,
+     the directory, then the args, each ended by a NUL.  Return them as
+     an argv of <argc>, program name first, with <dir> set; or NULL at
+     the end of <in>. */
+  static char *field;
+  static size_t size;
+  char **argv;
+  int i, n;
+
+  if( getdelim(&field, &size, '\0', in) == -1 )
+    return NULL;
+  n = atoi(field);
+  if( n < 0 || n > 1 << 16 || getdelim(&field, &size, '\0', in) == -1 )
+    return NULL;
+  *dir = xstrdup(field);
+  argv = xmalloc((n + 2) * sizeof(*argv));
+  argv[0] = xstrdup((char *)program_name);
+  for( i = 1; i <= n; i++ ) {
+    if( getdelim(&field, &size, '\0', in) == -1 ) {
+      n = i - 1;
+      break;
+    }
+    argv[i] = xstrdup(field);
+  }
+  argv[n + 1] = NULL;
+  *argc = n + 1;
+  return argv;
+}
+
+static void helper_run(struct Fls *fls) {
+  /* Run the commands on stdin over <fls>'s connection, each in a child of
+     its own, for it to exit however it likes; the connection stays for
+     the next, let go of between commands for other clients to get in.
+     It's made again if the daemon went away, or a command failed partway
+     and may have left it in the middle of something.
+     In bash:
+       coproc FLS { fls --helper; }
+       f() {
+         printf '%s\0' $# "$PWD" "$@" >&${FLS[1]}
+         IFS= read -r -d '' out <&${FLS[0]}; printf '%s' "$out"
+         read -r status <&${FLS[0]}; return $status
+       } */
+  struct Action action;
+  struct pollfd pfd;
+  char **argv, *dir, *stack;
+  int argc, i, status, fd;
+  FILE *in;
+  pid_t pid;
+
+  /* not stdin itself, so a child asking a question can't read ahead of it */
+  in = fdopen(dup(STDIN_FILENO), "r");
+  if( in == NULL ) {
+    perror("fdopen");
+    exit(EXIT_FAILURE);
+  }
+  while( (argv = helper_read(in, &argc, &dir)) != NULL ) {
+    /* the daemon only says something when asked, so that's it hanging up */
+    pfd.fd = fls->s;
+    pfd.events = POLLIN;
+    if( fls->s == -1 || poll(&pfd, 1, 0) != 0 )
+      helper_connect(fls);
+    fflush(stdout);
+    pid = fork();
+    if( pid == 0 ) {
+      /* questions are for whoever is at the terminal, not the pipe */
+      fd = open("/dev/tty", O_RDWR);
+      if( fd == -1 )
+	fd = open("/dev/null", O_RDONLY);
+      if( fd != -1 )
+	dup2(fd, STDIN_FILENO);
+      if( chdir(dir) == -1 ) {
+	fprintf(stderr, "%s: cannot go to `%s': %s\n", program_name, dir, strerror(errno));
+	exit(EXIT_FAILURE);
+      }
+      stack = "";
+      helper = false;
+      optind = 0;
+      action = handle_options(argc, argv, &stack);
+      if( serve || serve_system || helper || action.type == INTERACTIVE ) {
+	fprintf(stderr, "%s: that isn't for the helper\n", program_name);
+	exit(EXIT_FAILURE);
+      }
+      if( fls->s == -1 || fls_select(fls, stack) == -1 ) {
+	fprintf(stderr, "%s.\n", fls_error(fls));
+	exit(EXIT_FAILURE);
+      }
+      action_do(action, fls);
+      exit(EXIT_SUCCESS);
+    }
+    status = EXIT_FAILURE;
+    if( pid == -1 )
+      perror("fork");
+    else if( waitpid(pid, &status, 0) == pid )
+      status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    printf("%c%d\n", '\0', status);
+    fflush(stdout);
+    /* it's the others' turn at the stacks till the next command; the
+       shell needn't wait for that */
+    if( status != EXIT_SUCCESS || fls_release(fls) == -1 )
+      helper_connect(fls);
+    for( i = 0; i < argc; i++ )
+      free(argv[i]);
+    free(argv);
+    free(dir);
+  }
+  fclose(in);
+}
+
 
-  int s = client_connect();
+int main(int argc, char **argv) {
+  struct Action action;
+  struct Fls fls;
+  char *stack="";
+  bool ok;
 
-  action_do(action, s);
-  close(s);
+  verbose = 0;
+  am_daemon = false;
+  set_program_name(argv[0]);
+
+  action = handle_options(argc, argv, &stack);
+  if( (serve_system || serve || helper) && action.type != NOTHING ) {
+    fprintf(stderr, "%s: --%s does not go with `%s'\n", program_name,
+	    helper ? "helper" : serve ? "serve" : "serve-system",
+	    action_verb(action.type));
+    usage(EXIT_FAILURE);
+  }
+  if( system_mode || serve_system )
+    soc_path = FLS_SYSTEM_PATH;
+  else
+    genset_soc_path();
+  sig_block(SIGUSR1);
+
+  if( serve ) {
+    daemon_serve_here(system_mode);
+    return EXIT_SUCCESS;
+  }
+  /* a system daemon is started on purpose, never on demand */
+  if( serve_system ) {
+    daemon_start(true);
+    return EXIT_SUCCESS;
+  }
+  if( !system_mode )
+    daemon_start(false);
+
+  ok = fls_open(&fls, soc_path) == 0;
+  if( !ok && !system_mode ) {
+    /* ours may have gone idle since we looked */
+    fls_close(&fls);
+    daemon_start(false);
+    ok = fls_open(&fls, soc_path) == 0;
+  }
+  if( ok && helper ) {
+    helper_run(&fls);
+    fls_close(&fls);
+    return EXIT_SUCCESS;
+  }
+  if( !ok || fls_select(&fls, stack) == -1 ) {
+    fprintf(stderr, "%s.\n", fls_error(&fls));
+    exit(EXIT_FAILURE);
+  }
+  action_do(action, &fls);
+  fls_close(&fls);
   if( verbose )
     printf("Client exit\n");
   return EXIT_SUCCESS;
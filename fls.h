@@ -5,12 +5,13 @@
 #define COLR_PATH "\033[1;34m" /* light blue */
 #define COLR_WARN "\033[31m"   /* red */
 
-const char *program_name;
-int verbose;
-bool am_daemon;
+extern const char *program_name;
+extern int verbose;
+extern bool am_daemon;
 
 
 void usage(int status);
 char* color_string(char *color,char *string);
 void *xmalloc(size_t size);
+void *xrealloc(void *ptr, size_t size);
 char *xstrdup(char *str);
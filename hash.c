@@ -0,0 +1,139 @@
+/* Hash file contents as they go by, with XXH64: four independent lanes
+   per 32 byte stripe, so it keeps up with the disk. */
+
+#include <string.h>
+#include "hash.h"
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+
+static uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p) {
+  /* Read a little-endian 64 bit word. */
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+  acc += input * P2;
+  acc = rotl(acc, 31);
+  return acc * P1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t val) {
+  acc ^= round64(0, val);
+  return acc * P1 + P4;
+}
+
+static const unsigned char *stripes(struct Hash *h, const unsigned char *p,
+				    const unsigned char *end) {
+  /* Consume whole 32 byte stripes from <p>, returning what's left. */
+  uint64_t v0=h->v[0], v1=h->v[1], v2=h->v[2], v3=h->v[3];
+
+  while( p + 32 <= end ) {
+    v0 = round64(v0, read64(p));
+    v1 = round64(v1, read64(p + 8));
+    v2 = round64(v2, read64(p + 16));
+    v3 = round64(v3, read64(p + 24));
+    p += 32;
+  }
+  h->v[0] = v0;
+  h->v[1] = v1;
+  h->v[2] = v2;
+  h->v[3] = v3;
+  return p;
+}
+
+
+void hash_init(struct Hash *h) {
+  /* Start a new hash, with seed 0. */
+
+  memset(h, 0, sizeof(*h));
+  h->v[0] = P1 + P2;
+  h->v[1] = P2;
+  h->v[2] = 0;
+  h->v[3] = -P1;
+}
+
+void hash_update(struct Hash *h, const void *data, size_t len) {
+  /* Feed <len> bytes at <data> into <h>. */
+  const unsigned char *p=data, *end=p + len;
+
+  h->total += len;
+  if( h->memsize + len < 32 ) {
+    memcpy(h->mem + h->memsize, p, len);
+    h->memsize += len;
+    return;
+  }
+  if( h->memsize > 0 ) {
+    size_t fill = 32 - h->memsize;
+    memcpy(h->mem + h->memsize, p, fill);
+    stripes(h, h->mem, h->mem + 32);
+    p += fill;
+    h->memsize = 0;
+  }
+  p = stripes(h, p, end);
+  if( p < end ) {
+    memcpy(h->mem, p, end - p);
+    h->memsize = end - p;
+  }
+}
+
+uint64_t hash_final(struct Hash *h) {
+  /* Return the digest of everything fed to <h> so far. */
+  const unsigned char *p=h->mem, *end=h->mem + h->memsize;
+  uint64_t acc;
+
+  if( h->total >= 32 ) {
+    acc = rotl(h->v[0], 1) + rotl(h->v[1], 7) + rotl(h->v[2], 12) + rotl(h->v[3], 18);
+    acc = merge64(acc, h->v[0]);
+    acc = merge64(acc, h->v[1]);
+    acc = merge64(acc, h->v[2]);
+    acc = merge64(acc, h->v[3]);
+  } else
+    acc = P5;
+  acc += h->total;
+
+  for( ; p + 8 <= end; p += 8 ) {
+    acc ^= round64(0, read64(p));
+    acc = rotl(acc, 27) * P1 + P4;
+  }
+  if( p + 4 <= end ) {
+    acc ^= (uint64_t)read32(p) * P1;
+    acc = rotl(acc, 23) * P2 + P3;
+    p += 4;
+  }
+  for( ; p < end; p++ ) {
+    acc ^= *p * P5;
+    acc = rotl(acc, 11) * P1;
+  }
+
+  acc ^= acc >> 33;
+  acc *= P2;
+  acc ^= acc >> 29;
+  acc *= P3;
+  acc ^= acc >> 32;
+  return acc;
+}
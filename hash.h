@@ -0,0 +1,19 @@
+#ifndef hash_h
+#define hash_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct Hash {
+  /* Streaming XXH64 state. */
+  uint64_t v[4];
+  uint64_t total;
+  unsigned char mem[32];
+  size_t memsize;
+};
+
+void hash_init(struct Hash *h);
+void hash_update(struct Hash *h, const void *data, size_t len);
+uint64_t hash_final(struct Hash *h);
+
+#endif
@@ -0,0 +1,164 @@
+/* Remember content hashes between runs, so files that haven't changed
+   since they were last looked at never have to be read again. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "hashcache.h"
+
+#define HASHCACHE_MIN 1024
+
+
+static bool rec_matches(struct HashRec *rec, struct stat *st) {
+  return rec->ino == st->st_ino && rec->dev == st->st_dev
+    && rec->size == (uint64_t)st->st_size
+    && rec->mtime_sec == st->st_mtim.tv_sec
+    && rec->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+static size_t rec_slot(struct HashRec *recs, size_t cap, uint64_t dev, uint64_t ino) {
+  /* Return where (<dev>, <ino>) lives in <recs>, or should. */
+  size_t i=(ino * 0x9E3779B97F4A7C15ULL ^ dev) & (cap - 1);
+
+  while( recs[i].ino != 0 && (recs[i].ino != ino || recs[i].dev != dev) )
+    i = (i + 1) & (cap - 1);
+  return i;
+}
+
+static bool cache_grow(struct HashCache *cache) {
+  /* Make room for one more record.  Return false if we can't. */
+  struct HashRec *recs;
+  size_t cap, i;
+
+  if( (cache->len + 1) * 2 <= cache->cap )
+    return true;
+  cap = cache->cap ? cache->cap * 2 : HASHCACHE_MIN;
+  recs = calloc(cap, sizeof(*recs));
+  if( recs == NULL )
+    return false;
+  for( i = 0; i < cache->cap; i++ ) {
+    struct HashRec *rec = &cache->recs[i];
+    if( rec->ino != 0 )
+      recs[rec_slot(recs, cap, rec->dev, rec->ino)] = *rec;
+  }
+  free(cache->recs);
+  cache->recs = recs;
+  cache->cap = cap;
+  return true;
+}
+
+static void cache_insert(struct HashCache *cache, struct HashRec *rec) {
+  /* Put <rec> in, replacing whatever we knew about its inode. */
+  size_t i;
+
+  if( rec->ino == 0 || !cache_grow(cache) )
+    return;
+  i = rec_slot(cache->recs, cache->cap, rec->dev, rec->ino);
+  if( cache->recs[i].ino == 0 )
+    cache->len++;
+  cache->recs[i] = *rec;
+}
+
+
+void hashcache_load(struct HashCache *cache, char *path) {
+  /* Set up <cache>, filled from the file at <path> if there is one.
+     A NULL <path> keeps it in memory only.  Only a file of our own is
+     read: one planted by anybody else could claim a copy matches what it
+     was copied from when it doesn't. */
+  struct HashRec rec;
+  struct stat sb;
+  FILE *f;
+  int fd;
+
+  memset(cache, 0, sizeof(*cache));
+  pthread_mutex_init(&cache->lock, NULL);
+  if( path == NULL )
+    return;
+  cache->path = strdup(path);
+  fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if( fd == -1 )
+    return;
+  if( fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_uid != geteuid()
+      || (f = fdopen(fd, "r")) == NULL ) {
+    close(fd);
+    return;
+  }
+  while( cache->len < HASHCACHE_MAX && fread(&rec, sizeof(rec), 1, f) == 1 )
+    cache_insert(cache, &rec);
+  fclose(f);
+}
+
+bool hashcache_get(struct HashCache *cache, struct stat *st, uint64_t *hash) {
+  /* Set <hash> to the remembered hash of the file <st> describes.
+     Return false if it isn't known, or the file has changed since. */
+  bool found=false;
+  size_t i;
+
+  pthread_mutex_lock(&cache->lock);
+  if( cache->cap > 0 ) {
+    i = rec_slot(cache->recs, cache->cap, st->st_dev, st->st_ino);
+    if( rec_matches(&cache->recs[i], st) ) {
+      *hash = cache->recs[i].hash;
+      found = true;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return found;
+}
+
+void hashcache_put(struct HashCache *cache, struct stat *st, uint64_t hash) {
+  /* Remember <hash> for the file <st> describes. */
+  struct HashRec rec;
+
+  rec.dev = st->st_dev;
+  rec.ino = st->st_ino;
+  rec.size = st->st_size;
+  rec.mtime_sec = st->st_mtim.tv_sec;
+  rec.mtime_nsec = st->st_mtim.tv_nsec;
+  rec.hash = hash;
+  pthread_mutex_lock(&cache->lock);
+  if( cache->len < HASHCACHE_MAX ) {
+    cache_insert(cache, &rec);
+    cache->dirty = true;
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void hashcache_save(struct HashCache *cache) {
+  /* Write <cache> back out if it learned anything, and free it. */
+  char *tmp=NULL;
+  FILE *f;
+  size_t i;
+  int fd;
+
+  if( cache->dirty && cache->path != NULL
+      && (tmp = malloc(strlen(cache->path) + 8)) != NULL ) {
+    /* replace it whole, from a file nobody else can have made or be
+       writing, so a concurrent run never sees half a file */
+    sprintf(tmp, "%s.XXXXXX", cache->path);
+    fd = mkostemp(tmp, O_CLOEXEC);
+    f = fd != -1 ? fdopen(fd, "w") : NULL;
+    if( f == NULL && fd != -1 ) {
+      close(fd);
+      unlink(tmp);
+    }
+    if( f != NULL ) {
+      bool okay = true;
+      for( i = 0; okay && i < cache->cap; i++ ) {
+	if( cache->recs[i].ino != 0 )
+	  okay = fwrite(&cache->recs[i], sizeof(cache->recs[i]), 1, f) == 1;
+      }
+      if( fclose(f) == 0 && okay )
+	rename(tmp, cache->path);
+      else
+	unlink(tmp);
+    }
+  }
+  free(tmp);
+  free(cache->recs);
+  free(cache->path);
+  pthread_mutex_destroy(&cache->lock);
+}
@@ -0,0 +1,31 @@
+#ifndef hashcache_h
+#define hashcache_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define HASHCACHE_MAX (1 << 20)	/* entries kept on disk */
+
+struct HashRec {
+  uint64_t dev, ino, size;
+  int64_t mtime_sec, mtime_nsec;
+  uint64_t hash;
+};
+
+struct HashCache {
+  /* Content hashes of files, keyed by inode and modification time. */
+  pthread_mutex_t lock;
+  char *path;
+  struct HashRec *recs;		/* open-addressed; ino == 0 is empty */
+  size_t cap, len;
+  bool dirty;
+};
+
+void hashcache_load(struct HashCache *cache, char *path);
+bool hashcache_get(struct HashCache *cache, struct stat *st, uint64_t *hash);
+void hashcache_put(struct HashCache *cache, struct stat *st, uint64_t hash);
+void hashcache_save(struct HashCache *cache);
+
+#endif
@@ -0,0 +1,899 @@
+/* Talk to the stack daemon on behalf of another program; see libfls.h.
+   The `fls' client is a front end over these. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "libfls.h"
+#include "fls.h"
+#include "comm.h"
+#include "cmdexec.h"
+
+#define HASHES_SUFFIX ".hashes"
+#define RATES_SUFFIX ".rates"
+#define PIPELINE_MAX 256	/* commands sent before reading their replies */
+
+
+static int fail(struct Fls *fls, const char *fmt, ...) {
+  /* Leave a message for fls_error(), and return -1. */
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(fls->err, sizeof(fls->err), fmt, ap);
+  va_end(ap);
+  return -1;
+}
+
+static int send_cmd(struct Fls *fls, char *cmd) {
+  /* Send <cmd>, for the stack <fls> has selected. */
+  char buf[MSG_MAX];
+
+  if( fls->s == -1 )
+    return fail(fls, "not connected");
+  if( fls->stack[0] != '\0' ) {
+    snprintf(buf, sizeof(buf), "%s %s", cmd, fls->stack);
+    cmd = buf;
+  }
+  if( !soc_put(fls->soc, cmd) )
+    return fail(fls, "cannot send `%s': %s", cmd, strerror(errno));
+  return 0;
+}
+
+static int send_data(struct Fls *fls, char *data) {
+  /* Send <data> that goes with a command.  The daemon reads it whatever
+     it makes of the command, so there's no waiting to be asked for it;
+     nothing goes until a reply is wanted. */
+
+  if( !soc_put(fls->soc, data) )
+    return fail(fls, "cannot send `%s': %s", data, strerror(errno));
+  return 0;
+}
+
+static int recv_reply(struct Fls *fls, char *buf) {
+  /* Read the daemon's next string into <buf> of FILEPATH_MAX bytes. */
+
+  if( fls->s == -1 )
+    return fail(fls, "not connected");
+  if( soc_get(fls->soc, buf, FILEPATH_MAX) <= 0 )
+    return fail(fls, "lost the connection to the daemon");
+  return 0;
+}
+
+static int recv_status(struct Fls *fls) {
+  /* Read the daemon's status, and its complaint if it isn't okay.
+     Return 0 if it is. */
+  char buf[FILEPATH_MAX];
+
+  if( recv_reply(fls, buf) == -1 )
+    return -1;
+  if( strcmp(buf, MSG_SUCCESS) == 0 )
+    return 0;
+  if( recv_reply(fls, buf) == -1 )
+    return -1;
+  return fail(fls, "%s", buf);
+}
+
+static int recv_picked(struct Fls *fls, char *buf, int *fd) {
+  /* Read the status and the reply to a pick into <buf> of FILEPATH_MAX
+     bytes, setting <fd> to the descriptor that came with it, or -1. */
+  char status[FILEPATH_MAX];
+  int n;
+
+  *fd = -1;
+  if( recv_reply(fls, status) == -1 )
+    return -1;
+  if( strcmp(status, MSG_SUCCESS_FD) == 0 )
+    n = soc_get_fd(fls->soc, buf, FILEPATH_MAX, fd);
+  else
+    n = soc_get(fls->soc, buf, FILEPATH_MAX);
+  if( n <= 0 )
+    return fail(fls, "lost the connection to the daemon");
+  if( strcmp(status, MSG_SUCCESS) != 0 && strcmp(status, MSG_SUCCESS_FD) != 0 )
+    return fail(fls, "%s", buf);
+  return 0;
+}
+
+static int copy_out(struct Fls *fls, char *reply, char *buf, size_t size) {
+  /* Hand <reply> back in the caller's <buf> of <size> bytes, if any. */
+
+  if( buf == NULL )
+    return 0;
+  if( strlen(reply) >= size )
+    return fail(fls, "%s", strerror(ERANGE));
+  strcpy(buf, reply);
+  return 0;
+}
+
+static int resolve(const char *file, char *path) {
+  /* Put the absolute path to <file> in <path> of FILEPATH_MAX bytes, with
+     a slash at the end if it is a directory.
+     Return -1 (with errno set) if it can't be found. */
+  struct stat st;
+  char *real;
+  bool dir;
+
+  real = realpath(file, NULL);
+  if( real == NULL )
+    return -1;
+  dir = stat(real, &st) == 0 && S_ISDIR(st.st_mode) && strcmp(real, "/") != 0;
+  if( strlen(real) + dir >= FILEPATH_MAX ) {
+    free(real);
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  sprintf(path, "%s%s", real, dir ? "/" : "");
+  free(real);
+  return 0;
+}
+
+
+int fls_default_path(char *buf, size_t size) {
+  /* Put the socket path `fls' itself uses for this user in <buf> of
+     <size> bytes.  Return -1 if there's no user, or no room. */
+  char *user=getenv("USER");
+
+  if( user == NULL || (size_t)snprintf(buf, size, "/tmp/%s%s", user, PROGRAM_NAME) >= size )
+    return -1;
+  return 0;
+}
+
+static bool peer_trusted(int s) {
+  /* Is the daemon on the other end of <s> run by root, or by us?  Anyone
+     can be listening at a path in /tmp before the real one is. */
+  struct ucred cred;
+  socklen_t len=sizeof(cred);
+
+  if( getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 )
+    return false;
+  return cred.uid == 0 || cred.uid == geteuid();
+}
+
+int fls_open(struct Fls *fls, const char *soc_path) {
+  /* Connect <fls> to the daemon listening at <soc_path>.  The system
+     daemon is only talked to if it's root's, or our own.
+     Whether or not it works, <fls> is to be closed with fls_close(). */
+  char own[FILEPATH_MAX];
+  const char *base=soc_path;
+  int err;
+
+  fls->s = -1;
+  fls->soc = NULL;
+  fls->stack[0] = '\0';
+  fls->err[0] = '\0';
+  fls->rates = NULL;
+  /* everyone shares a system daemon, but not their caches */
+  if( strcmp(soc_path, FLS_SYSTEM_PATH) == 0 && fls_default_path(own, sizeof(own)) == 0 )
+    base = own;
+  fls->hashes = malloc(strlen(base) + sizeof(HASHES_SUFFIX));
+  fls->rates = malloc(strlen(base) + sizeof(RATES_SUFFIX));
+  fls->soc = malloc(sizeof(*fls->soc));
+  if( fls->hashes == NULL || fls->rates == NULL || fls->soc == NULL )
+    return fail(fls, "%s", strerror(ENOMEM));
+  sprintf(fls->hashes, "%s%s", base, HASHES_SUFFIX);
+  sprintf(fls->rates, "%s%s", base, RATES_SUFFIX);
+
+  fls->s = soc_connect(soc_path);
+  if( fls->s == -1 ) {
+    err = errno;
+    if( err == ECONNREFUSED || err == ENOENT )
+      return fail(fls, "No-one listening at `%s'", soc_path);
+    return fail(fls, "cannot connect to `%s': %s", soc_path, strerror(err));
+  }
+  if( strcmp(soc_path, FLS_SYSTEM_PATH) == 0 && !peer_trusted(fls->s) ) {
+    close(fls->s);
+    fls->s = -1;
+    return fail(fls, "daemon at `%s' isn't run by root; not trusting it", soc_path);
+  }
+  soc_init(fls->soc, fls->s);
+  return 0;
+}
+
+void fls_close(struct Fls *fls) {
+  if( fls->s != -1 ) {
+    soc_free(fls->soc);
+    close(fls->s);
+  }
+  fls->s = -1;
+  free(fls->soc);
+  fls->soc = NULL;
+  free(fls->hashes);
+  fls->hashes = NULL;
+  free(fls->rates);
+  fls->rates = NULL;
+}
+
+const char *fls_error(struct Fls *fls) {
+  /* Return what the last failure on <fls> was about. */
+
+  return fls->err;
+}
+
+
+int fls_select(struct Fls *fls, const char *name) {
+  /* Work on the stack called <name> from now on; NULL or "" means the
+     default one.  It needn't exist yet: pushing to it makes it. */
+
+  if( name == NULL )
+    name = "";
+  if( !stack_name_okay(name) )
+    return fail(fls, "bad stack name `%s'", name);
+  strcpy(fls->stack, name);
+  return 0;
+}
+
+int fls_create(struct Fls *fls) {
+  /* Make the selected stack, empty.  It is an error if it exists. */
+
+  if( send_cmd(fls, CMD_CREATE) == -1 || recv_status(fls) == -1 )
+    return -1;
+  return 0;
+}
+
+int fls_destroy(struct Fls *fls) {
+  /* Get rid of the selected stack, and whatever is in it. */
+
+  if( send_cmd(fls, CMD_DESTROY) == -1 || recv_status(fls) == -1 )
+    return -1;
+  return 0;
+}
+
+int fls_stacks(struct Fls *fls,
+	       void (*each)(const char *name, int files, size_t bytes, void *arg),
+	       void *arg) {
+  /* Call <each> with <arg> for every stack the daemon has, in no
+     particular order, with how many files it holds and how much of the
+     daemon's memory they take.  Return how many stacks there were. */
+  char buf[FILEPATH_MAX], *name;
+  int i, n, files;
+  size_t bytes;
+
+  if( send_cmd(fls, CMD_STACKS) == -1 || recv_status(fls) == -1
+      || recv_reply(fls, buf) == -1 )
+    return -1;
+  n = atoi(buf);
+  for( i = 0; i < n; i++ ) {
+    if( recv_reply(fls, buf) == -1 )
+      return -1;
+    files = strtol(buf, &name, 10);
+    bytes = strtoul(name, &name, 10);
+    if( *name == ' ' )
+      name++;
+    if( each != NULL )
+      each(name, files, bytes, arg);
+  }
+  return n;
+}
+
+int fls_size(struct Fls *fls) {
+  /* Return how many files are in the stack. */
+  char buf[FILEPATH_MAX];
+
+  if( send_cmd(fls, CMD_SIZE) == -1 || recv_reply(fls, buf) == -1 )
+    return -1;
+  return atoi(buf);
+}
+
+static int push_with(struct Fls *fls, char *cmd, const char *file, char *buf,
+		     size_t size) {
+  /* Put <file> on the stack with <cmd>; see fls_push(). */
+  char path[FILEPATH_MAX], reply[FILEPATH_MAX];
+
+  if( resolve(file, path) == -1 )
+    return fail(fls, "%s", strerror(errno));
+  if( send_cmd(fls, cmd) == -1 || send_data(fls, path) == -1
+      || recv_status(fls) == -1 || recv_status(fls) == -1
+      || recv_reply(fls, reply) == -1 )
+    return -1;
+  if( strcmp(reply, path) != 0 )
+    return fail(fls, "path sent not the same as path pushed");
+  return copy_out(fls, reply, buf, size);
+}
+
+static int pop_with(struct Fls *fls, char *cmd, char *buf, size_t size) {
+  /* Take a file off the stack with <cmd>; see fls_pop(). */
+  char reply[FILEPATH_MAX];
+
+  if( send_cmd(fls, cmd) == -1 || recv_status(fls) == -1
+      || recv_reply(fls, reply) == -1 )
+    return -1;
+  return copy_out(fls, reply, buf, size);
+}
+
+int fls_push(struct Fls *fls, const char *file, char *buf, size_t size) {
+  /* Push <file> onto the stack, and put the path it was pushed as in
+     <buf> of <size> bytes (unless <buf> is NULL). */
+
+  return push_with(fls, CMD_PUSH, file, buf, size);
+}
+
+int fls_unshift(struct Fls *fls, const char *file, char *buf, size_t size) {
+  /* Like fls_push(), but put <file> at the bottom of the stack. */
+
+  return push_with(fls, CMD_UNSHIFT, file, buf, size);
+}
+
+int fls_pick_fd(struct Fls *fls, int n, char *buf, size_t size, int *fd) {
+  /* Put the <n>th file from the top of the stack (or, if <n> is negative,
+     the -<n>th from the bottom) in <buf> of <size> bytes, as it was
+     pushed, leaving it there.  Set <fd> to a descriptor for it if it was
+     pushed with fls_push_fd(), for the caller to close, or else -1. */
+  char num[MSG_MAX], reply[FILEPATH_MAX];
+
+  *fd = -1;
+  sprintf(num, "%d", n);
+  if( send_cmd(fls, CMD_PICK) == -1 || send_data(fls, num) == -1
+      || recv_status(fls) == -1 || recv_picked(fls, reply, fd) == -1 )
+    return -1;
+  if( copy_out(fls, reply, buf, size) == -1 ) {
+    if( *fd != -1 )
+      close(*fd);
+    *fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+int fls_fd_path(struct Fls *fls, int fd, char *buf, size_t size) {
+  /* Put where the file fls_pick_fd() gave <fd> for is now in <buf> of
+     <size> bytes, the way it would have been pushed from there. */
+  char proc[64], path[FILEPATH_MAX];
+  struct stat st;
+  ssize_t len;
+
+  sprintf(proc, "/proc/self/fd/%d", fd);
+  len = readlink(proc, path, sizeof(path) - 2);
+  if( len == -1 || fstat(fd, &st) == -1 )
+    return fail(fls, "cannot find it: %s", strerror(errno));
+  path[len] = '\0';
+  if( st.st_nlink == 0 )
+    return fail(fls, "deleted after it was pushed");
+  if( S_ISDIR(st.st_mode) && strcmp(path, "/") != 0 )
+    strcat(path, "/");
+  return copy_out(fls, path, buf, size);
+}
+
+int fls_pick(struct Fls *fls, int n, char *buf, size_t size) {
+  /* Like fls_pick_fd(), but put where the file is now in <buf>: it will
+     have followed the file if it was renamed since it was pushed by
+     descriptor. */
+  char path[FILEPATH_MAX], why[FLS_ERR_MAX];
+  int fd, ret;
+
+  if( fls_pick_fd(fls, n, path, sizeof(path), &fd) == -1 )
+    return -1;
+  if( fd == -1 )
+    return copy_out(fls, path, buf, size);
+  ret = fls_fd_path(fls, fd, buf, size);
+  close(fd);
+  if( ret == -1 ) {
+    strcpy(why, fls->err);
+    return fail(fls, "`%s' %s", path, why);
+  }
+  return 0;
+}
+
+int fls_picks(struct Fls *fls, const int *positions, int n,
+	      void (*each)(int i, const char *path, int fd, void *arg), void *arg) {
+  /* Pick the files at the <n> <positions> as fls_pick_fd() would, calling
+     <each> with <arg> for each in turn: its index in <positions>, the
+     path it was pushed as, and its descriptor (for <each> to close) or
+     -1.  The picks go to the daemon in batches, each sent before any of
+     its answers is read.  Return -1 if any couldn't be picked; the others
+     are still handed to <each>. */
+  char num[MSG_MAX], reply[FILEPATH_MAX], why[FLS_ERR_MAX];
+  int i, j, m, fd, ret=0;
+
+  for( i = 0; i < n; i += m ) {
+    m = n - i < PIPELINE_MAX ? n - i : PIPELINE_MAX;
+    for( j = i; j < i + m; j++ ) {
+      sprintf(num, "%d", positions[j]);
+      if( send_cmd(fls, CMD_PICK) == -1 || send_data(fls, num) == -1 )
+	return -1;
+    }
+    /* every answer is read, so the next batch starts in step */
+    for( j = i; j < i + m; j++ ) {
+      if( recv_status(fls) == -1 || recv_picked(fls, reply, &fd) == -1 ) {
+	if( ret == 0 )
+	  strcpy(why, fls->err);
+	ret = -1;
+      } else if( each != NULL )
+	each(j, reply, fd, arg);
+      else if( fd != -1 )
+	close(fd);
+    }
+  }
+  if( ret == -1 )
+    return fail(fls, "%s", why);
+  return 0;
+}
+
+int fls_pop(struct Fls *fls, char *buf, size_t size) {
+  /* Pop the top file off the stack, into <buf> of <size> bytes (unless
+     <buf> is NULL). */
+
+  return pop_with(fls, CMD_POP, buf, size);
+}
+
+int fls_shift(struct Fls *fls, char *buf, size_t size) {
+  /* Like fls_pop(), but take the file at the bottom of the stack: the
+     first one pushed. */
+
+  return pop_with(fls, CMD_SHIFT, buf, size);
+}
+
+int fls_rotate(struct Fls *fls, int n) {
+  /* Move the top <n> files to the bottom of the stack, or, if <n> is
+     negative, the bottom -<n> to the top. */
+  char num[MSG_MAX];
+
+  sprintf(num, "%d", n);
+  if( send_cmd(fls, CMD_ROTATE) == -1 || send_data(fls, num) == -1
+      || recv_status(fls) == -1 || recv_status(fls) == -1 )
+    return -1;
+  return 0;
+}
+
+int fls_swap(struct Fls *fls) {
+  /* Swap the top two files in the stack. */
+
+  if( send_cmd(fls, CMD_SWAP) == -1 || recv_status(fls) == -1 )
+    return -1;
+  return 0;
+}
+
+int fls_unique(struct Fls *fls, bool on) {
+  /* Have the stack refuse a path that is in it already, if <on>, or take
+     it again, as it does to begin with.  It makes the stack if need be. */
+
+  if( send_cmd(fls, CMD_UNIQUE) == -1 || send_data(fls, on ? "1" : "0") == -1
+      || recv_status(fls) == -1 || recv_status(fls) == -1 )
+    return -1;
+  return 0;
+}
+
+int fls_clashes(struct Fls *fls, void (*each)(const char *name, void *arg),
+		void *arg) {
+  /* Call <each> with <arg> for every name that more than one file in the
+     stack has, ignoring the directories they are in.  Return how many
+     names there were, which is usually none. */
+  char buf[FILEPATH_MAX];
+  int i, n;
+
+  if( send_cmd(fls, CMD_CLASHES) == -1 || recv_status(fls) == -1
+      || recv_reply(fls, buf) == -1 )
+    return -1;
+  n = atoi(buf);
+  for( i = 0; i < n; i++ ) {
+    if( recv_reply(fls, buf) == -1 )
+      return -1;
+    if( each != NULL )
+      each(buf, arg);
+  }
+  return n;
+}
+
+int fls_stale(struct Fls *fls, void (*each)(int n, const char *now, void *arg),
+	      void *arg) {
+  /* Call <each> with <arg> for every entry the daemon has seen deleted or
+     renamed since it was pushed, in order from the top: its position,
+     counting from 0, and where it is now, or NULL if it's gone.  Return
+     how many there were, which is usually none. */
+  char buf[FILEPATH_MAX], *p;
+  int i, n;
+
+  if( send_cmd(fls, CMD_STALE) == -1 || recv_status(fls) == -1
+      || recv_reply(fls, buf) == -1 )
+    return -1;
+  n = atoi(buf);
+  for( i = 0; i < n; i++ ) {
+    if( recv_reply(fls, buf) == -1 )
+      return -1;
+    p = strchr(buf, ' ');
+    if( p == NULL )
+      return fail(fls, "bad reply `%s'", buf);
+    *p++ = '\0';
+    if( each != NULL )
+      each(atoi(buf), strncmp(p, "moved ", 6) == 0 ? p + 6 : NULL, arg);
+  }
+  return n;
+}
+
+int fls_insert(struct Fls *fls, int n, const char *file, char *buf, size_t size) {
+  /* Like fls_push(), but put <file> in as the <n>th from the top of the
+     stack (or, if <n> is negative, the -<n>th from the bottom). */
+  char num[MSG_MAX], path[FILEPATH_MAX], reply[FILEPATH_MAX];
+
+  if( resolve(file, path) == -1 )
+    return fail(fls, "%s", strerror(errno));
+  sprintf(num, "%d", n);
+  if( send_cmd(fls, CMD_INSERT) == -1 || send_data(fls, num) == -1
+      || send_data(fls, path) == -1 || recv_status(fls) == -1
+      || recv_status(fls) == -1 || recv_reply(fls, reply) == -1 )
+    return -1;
+  return copy_out(fls, reply, buf, size);
+}
+
+int fls_push_fd(struct Fls *fls, int n, const char *file, char *buf, size_t size) {
+  /* Like fls_insert(), but have the daemon hold an O_PATH descriptor for
+     <file> as well, so that the file can be found when it is picked even
+     if it has been renamed meanwhile. */
+  char num[MSG_MAX], path[FILEPATH_MAX], reply[FILEPATH_MAX];
+  int fd, ret;
+
+  if( resolve(file, path) == -1 )
+    return fail(fls, "%s", strerror(errno));
+  fd = open(path, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+  if( fd == -1 )
+    return fail(fls, "%s", strerror(errno));
+  sprintf(num, "%d", n);
+  if( send_cmd(fls, CMD_PUSHFD) == -1 || send_data(fls, num) == -1 )
+    ret = -1;
+  else if( !soc_put_fd(fls->soc, path, fd) )
+    ret = fail(fls, "cannot send `%s': %s", path, strerror(errno));
+  else
+    ret = 0;
+  /* what goes is a copy */
+  close(fd);
+  if( ret == -1 || recv_status(fls) == -1 || recv_status(fls) == -1
+      || recv_reply(fls, reply) == -1 )
+    return -1;
+  return copy_out(fls, reply, buf, size);
+}
+
+int fls_remove(struct Fls *fls, int n, char *buf, size_t size) {
+  /* Take the <n>th file from the top of the stack (or, if <n> is
+     negative, the -<n>th from the bottom) out of it, into <buf> of <size>
+     bytes (unless <buf> is NULL). */
+  char num[MSG_MAX], reply[FILEPATH_MAX];
+
+  sprintf(num, "%d", n);
+  if( send_cmd(fls, CMD_REMOVE) == -1 || send_data(fls, num) == -1
+      || recv_status(fls) == -1 || recv_status(fls) == -1
+      || recv_reply(fls, reply) == -1 )
+    return -1;
+  return copy_out(fls, reply, buf, size);
+}
+
+int fls_take(struct Fls *fls, int from, int to,
+	     void (*each)(const char *path, void *arg), void *arg) {
+  /* Take the files from the <from>th to the <to>th from the top of the
+     stack out of it in one go, calling <each> with <arg> for each, top
+     first.  Negative positions count from the bottom.
+     Return how many there were. */
+  char buf[FILEPATH_MAX];
+  int i, n;
+
+  sprintf(buf, "%d %d", from, to);
+  if( send_cmd(fls, CMD_TAKE) == -1 || send_data(fls, buf) == -1
+      || recv_status(fls) == -1 || recv_status(fls) == -1
+      || recv_reply(fls, buf) == -1 )
+    return -1;
+  n = atoi(buf);
+  for( i = 0; i < n; i++ ) {
+    if( recv_reply(fls, buf) == -1 )
+      return -1;
+    if( each != NULL )
+      each(buf, arg);
+  }
+  return n;
+}
+
+int fls_find(struct Fls *fls, enum MatchKind kind, const char *pattern,
+	     void (*each)(int n, const char *path, void *arg), void *arg) {
+  /* Call <each> with <arg> for every file in the stack that matches
+     <pattern> as <kind> says, top first, with where it is (from 0 at the
+     top).  The daemon does the looking.  Return how many there were. */
+  char buf[FILEPATH_MAX], *path;
+  int i, n, at;
+
+  if( (size_t)snprintf(buf, sizeof(buf), "%s %s", match_word(kind), pattern) >= sizeof(buf) )
+    return fail(fls, "pattern too long");
+  if( send_cmd(fls, CMD_FIND) == -1 || send_data(fls, buf) == -1
+      || recv_status(fls) == -1 || recv_status(fls) == -1
+      || recv_reply(fls, buf) == -1 )
+    return -1;
+  n = atoi(buf);
+  for( i = 0; i < n; i++ ) {
+    if( recv_reply(fls, buf) == -1 )
+      return -1;
+    at = strtol(buf, &path, 10);
+    if( *path == ' ' )
+      path++;
+    if( each != NULL )
+      each(at, path, arg);
+  }
+  return n;
+}
+
+struct Found {
+  int *positions, n, max;
+};
+
+static void found(int n, const char *path, void *arg) {
+  struct Found *f = arg;
+
+  if( f->n < f->max )
+    f->positions[f->n++] = n;
+}
+
+static int parse_index(struct Fls *fls, const char *spec, int size, int *positions) {
+  /* Fill <positions> with the entries <spec> names in a stack of <size>,
+     counting from 0 at the top, and return how many there are.
+     <spec> is a comma-separated list of positions as `fls -p' numbers
+     them, from 1 at the top, or from -1 at the bottom, and of ranges
+     "FROM..TO" of them. */
+  const char *p=spec;
+  char *end, *seen;
+  int from, to, step, n=0;
+
+  seen = calloc(size > 0 ? size : 1, 1);
+  if( seen == NULL )
+    return fail(fls, "%s", strerror(ENOMEM));
+  do {
+    from = strtol(p, &end, 10);
+    to = from;
+    if( end != p && strncmp(end, "..", 2) == 0 ) {
+      p = end + 2;
+      to = strtol(p, &end, 10);
+    }
+    if( end == p || (*end != ',' && *end != '\0') || from == 0 || to == 0 ) {
+      free(seen);
+      return fail(fls, "bad index `%s'", spec);
+    }
+    /* down to 0-based, from the top */
+    from = from > 0 ? from - 1 : from + size;
+    to = to > 0 ? to - 1 : to + size;
+    if( from < 0 || from >= size || to < 0 || to >= size ) {
+      free(seen);
+      return fail(fls, "index `%s' goes past the %d file%s in the stack",
+		  spec, size, size == 1 ? "" : "s");
+    }
+    step = from <= to ? 1 : -1;
+    for( ; ; from += step ) {
+      if( seen[from]++ ) {
+	free(seen);
+	return fail(fls, "index `%s' names file %d twice", spec, from + 1);
+      }
+      positions[n++] = from;
+      if( from == to )
+	break;
+    }
+    p = end + 1;
+  } while( *end == ',' );
+  free(seen);
+  return n;
+}
+
+int fls_targets(struct Fls *fls, struct Action action, int **positions) {
+  /* Set <positions> to a new array of where the files <action> takes are
+     in the stack, counting from 0 at the top, in the order it takes them:
+     those <action.index> names, or all that match <action.match>, or else
+     the top <action.num>; from the bottom up, with ACTION_FIFO.
+     Return how many there are. */
+  struct Found f;
+  int i, n, size=fls_size(fls);
+
+  *positions = NULL;
+  if( size == -1 )
+    return -1;
+  if( action.index == NULL && action.match == NULL && action.num > size )
+    return fail(fls, "asked for %d file%s, only %d in stack",
+		action.num, action.num == 1 ? "" : "s", size);
+  /* a stack holds each entry no more than once */
+  *positions = malloc((action.index != NULL || action.match != NULL ? size : action.num)
+		      * sizeof(**positions) + 1);
+  if( *positions == NULL )
+    return fail(fls, "%s", strerror(ENOMEM));
+  if( action.index != NULL ) {
+    n = parse_index(fls, action.index, size, *positions);
+  } else if( action.match != NULL ) {
+    f.positions = *positions;
+    f.n = 0;
+    f.max = size;
+    n = fls_find(fls, action.match_kind, action.match, found, &f);
+    if( n != -1 )
+      n = f.n;
+    if( n == 0 )
+      n = fail(fls, "nothing in the stack matches `%s'", action.match);
+    for( i = 0; n != -1 && (action.flags & ACTION_FIFO) && i < n / 2; i++ ) {
+      int swap = f.positions[i];
+      f.positions[i] = f.positions[n - 1 - i];
+      f.positions[n - 1 - i] = swap;
+    }
+  } else {
+    n = action.num;
+    for( i = 0; i < n; i++ )
+      (*positions)[i] = action.flags & ACTION_FIFO ? size - 1 - i : i;
+  }
+  if( n == -1 ) {
+    free(*positions);
+    *positions = NULL;
+  }
+  return n;
+}
+
+static int cmp_deeper(const void *a, const void *b) {
+  return *(const int *)b - *(const int *)a;
+}
+
+int fls_remove_all(struct Fls *fls, const int *positions, int n) {
+  /* Take the files at the <n> <positions> from fls_targets() out of the
+     stack, deepest first so the others stay where they are.  The removes
+     go in batches like fls_picks(), so one that fails doesn't stop the
+     rest of its batch. */
+  char num[MSG_MAX], reply[FILEPATH_MAX], why[FLS_ERR_MAX];
+  int *order, i, j, m, ret=0;
+
+  order = malloc(n * sizeof(*order) + 1);
+  if( order == NULL )
+    return fail(fls, "%s", strerror(ENOMEM));
+  memcpy(order, positions, n * sizeof(*order));
+  qsort(order, n, sizeof(*order), cmp_deeper);
+  for( i = 0; i < n && ret == 0; i += m ) {
+    m = n - i < PIPELINE_MAX ? n - i : PIPELINE_MAX;
+    for( j = i; j < i + m; j++ ) {
+      sprintf(num, "%d", order[j]);
+      if( send_cmd(fls, CMD_REMOVE) == -1 || send_data(fls, num) == -1 ) {
+	free(order);
+	return -1;
+      }
+    }
+    for( j = i; j < i + m; j++ ) {
+      if( (recv_status(fls) == -1 || recv_status(fls) == -1
+	   || recv_reply(fls, reply) == -1) && ret == 0 ) {
+	strcpy(why, fls->err);
+	ret = -1;
+      }
+    }
+  }
+  free(order);
+  if( ret == -1 )
+    return fail(fls, "%s", why);
+  return 0;
+}
+
+struct Sources {
+  struct Fls *fls;
+  char **paths;
+  int bad;			/* the first that couldn't be found, or -1 */
+  char why[FILEPATH_MAX + FLS_ERR_MAX];
+};
+
+static void source(int i, const char *path, int fd, void *arg) {
+  /* Note where the <i>th file picked for fls_act() is now. */
+  struct Sources *s = arg;
+  char now[FILEPATH_MAX];
+
+  if( fd == -1 )
+    s->paths[i] = strdup(path);
+  else {
+    if( fls_fd_path(s->fls, fd, now, sizeof(now)) == 0 )
+      s->paths[i] = strdup(now);
+    else if( s->bad == -1 ) {
+      snprintf(s->why, sizeof(s->why), "`%s' %s", path, s->fls->err);
+      s->bad = i;
+    }
+    close(fd);
+  }
+}
+
+int fls_act(struct Fls *fls, struct Action action, char **dests, int ndest,
+	    int *popped) {
+  /* Do <action> (COPY, MOVE, SYMLINK, LINK, CLONE or ARCHIVE) to the files fls_targets() says
+     it takes, into each of the <ndest> <dests> (or the current directory
+     if there are none), then take them out of the stack, up to the first
+     that didn't make it.  Set <popped> to how many were.  Nothing is
+     printed; how far it got, and how many CLONE reflinked, go in
+     Action.progress if it's set.
+     Return 0 if they all made it. */
+  struct ActionDef *def=action_def(action.type);
+  char **sources=NULL, *here[]={"."};
+  struct Sources found;
+  int i, n, *positions, *status=NULL, ret=0;
+
+  *popped = 0;
+  if( def == NULL || def->exargv[0] == NULL )
+    return fail(fls, "action %d does not take files from the stack", action.type);
+  if( action.index == NULL && action.match == NULL && action.num < 1 )
+    return fail(fls, "nothing to %s", def->verb);
+  if( ndest == 0 ) {
+    dests = here;
+    ndest = 1;
+  }
+  if( action.hashes == NULL )
+    action.hashes = fls->hashes;
+
+  n = fls_targets(fls, action, &positions);
+  if( n == -1 )
+    return -1;
+  action.num = n;
+  sources = calloc(n + 1, sizeof(*sources));
+  status = calloc(n + 1, sizeof(*status));
+  if( sources == NULL || status == NULL ) {
+    ret = fail(fls, "%s", strerror(ENOMEM));
+    goto out;
+  }
+  found = (struct Sources){fls, sources, -1, ""};
+  if( fls_picks(fls, positions, n, source, &found) == -1 ) {
+    ret = -1;
+    goto out;
+  }
+  if( found.bad != -1 ) {
+    ret = fail(fls, "%s", found.why);
+    goto out;
+  }
+  for( i = 0; i < n; i++ ) {
+    if( sources[i] == NULL ) {
+      ret = fail(fls, "%s", strerror(ENOMEM));
+      goto out;
+    }
+  }
+
+  action_run(action, sources, n, dests, ndest, status);
+  for( i = 0; i < n && status[i] == 0; i++ )
+    ;
+  if( fls_remove_all(fls, positions, i) == -1 )
+    ret = -1;
+  else {
+    *popped = i;
+    if( i < n )
+      ret = fail(fls, "%s `%s' unsuccessful", def->verb, sources[i]);
+  }
+
+ out:
+  for( i = 0; sources != NULL && i < n; i++ )
+    free(sources[i]);
+  free(sources);
+  free(status);
+  free(positions);
+  return ret;
+}
+int fls_report(struct Fls *fls, const char *line) {
+  /* Tell the daemon how a transfer is going, in one <line> for
+     fls_progress() to pass on; "" says it's over. */
+
+  if( send_cmd(fls, CMD_REPORT) == -1 || send_data(fls, (char *)line) == -1
+      || recv_status(fls) == -1 || recv_status(fls) == -1 )
+    return -1;
+  return 0;
+}
+
+int fls_progress(struct Fls *fls, char *buf, size_t size) {
+  /* Put the last line fls_report() gave the daemon in <buf> of <size>
+     bytes, or "" if no transfer is going.  This is answered even while
+     another client is working on the stack. */
+  char reply[FILEPATH_MAX];
+
+  if( send_cmd(fls, CMD_PROGRESS) == -1 || recv_status(fls) == -1
+      || recv_reply(fls, reply) == -1 )
+    return -1;
+  return copy_out(fls, reply, buf, size);
+}
+
+int fls_release(struct Fls *fls) {
+  /* Let other connections of ours at the stacks until the next command;
+     until then, one connection keeps them to itself, so that what it
+     picks is still there to pop. */
+
+  if( send_cmd(fls, CMD_RELEASE) == -1 || recv_status(fls) == -1 )
+    return -1;
+  return 0;
+}
+
+int fls_stop(struct Fls *fls) {
+  /* Tell the daemon to shut down, losing whatever is in the stack. */
+  char buf[FILEPATH_MAX];
+
+  if( send_cmd(fls, CMD_STOP) == -1 || recv_reply(fls, buf) == -1 )
+    return -1;
+  if( strcmp(buf, MSG_SUCCESS) != 0 )
+    return fail(fls, "the daemon doesn't want to stop");
+  return 0;
+}
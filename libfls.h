@@ -0,0 +1,74 @@
+#ifndef libfls_h
+#define libfls_h
+
+/* libfls: work the file stack from another program, without running
+   `fls' for every operation.
+   Nothing here exits or prompts.  Functions that can fail return -1 and
+   leave a message for fls_error(); a handle holds all of its own state,
+   so separate handles can be used from separate threads. */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "action.h"
+
+#define FLS_ERR_MAX 256
+#define FLS_NAME_MAX 64
+#define FLS_SYSTEM_PATH "/tmp/fls-system"	/* where a system daemon listens */
+
+struct Soc;
+
+struct Fls {
+  int s;			/* connected to the daemon, or -1 */
+  struct Soc *soc;		/* what's buffered either way on <s> */
+  char stack[FLS_NAME_MAX];	/* which stack to work on; "" for the default */
+  char *hashes;			/* cache file for ACTION_SKIP_IDENTICAL */
+  char *rates;			/* how fast pops went, for plans */
+  char err[FLS_ERR_MAX];	/* what went wrong last */
+};
+
+int fls_default_path(char *buf, size_t size);
+int fls_open(struct Fls *fls, const char *soc_path);
+void fls_close(struct Fls *fls);
+const char *fls_error(struct Fls *fls);
+
+int fls_select(struct Fls *fls, const char *name);
+int fls_create(struct Fls *fls);
+int fls_destroy(struct Fls *fls);
+int fls_stacks(struct Fls *fls,
+	       void (*each)(const char *name, int files, size_t bytes, void *arg),
+	       void *arg);
+
+int fls_size(struct Fls *fls);
+int fls_push(struct Fls *fls, const char *file, char *buf, size_t size);
+int fls_pick(struct Fls *fls, int n, char *buf, size_t size);
+int fls_pick_fd(struct Fls *fls, int n, char *buf, size_t size, int *fd);
+int fls_picks(struct Fls *fls, const int *positions, int n,
+	      void (*each)(int i, const char *path, int fd, void *arg), void *arg);
+int fls_fd_path(struct Fls *fls, int fd, char *buf, size_t size);
+int fls_pop(struct Fls *fls, char *buf, size_t size);
+int fls_unshift(struct Fls *fls, const char *file, char *buf, size_t size);
+int fls_shift(struct Fls *fls, char *buf, size_t size);
+int fls_insert(struct Fls *fls, int n, const char *file, char *buf, size_t size);
+int fls_push_fd(struct Fls *fls, int n, const char *file, char *buf, size_t size);
+int fls_remove(struct Fls *fls, int n, char *buf, size_t size);
+int fls_take(struct Fls *fls, int from, int to,
+	     void (*each)(const char *path, void *arg), void *arg);
+int fls_find(struct Fls *fls, enum MatchKind kind, const char *pattern,
+	     void (*each)(int n, const char *path, void *arg), void *arg);
+int fls_rotate(struct Fls *fls, int n);
+int fls_swap(struct Fls *fls);
+int fls_unique(struct Fls *fls, bool on);
+int fls_stale(struct Fls *fls, void (*each)(int n, const char *now, void *arg),
+	      void *arg);
+int fls_clashes(struct Fls *fls, void (*each)(const char *name, void *arg),
+		void *arg);
+int fls_targets(struct Fls *fls, struct Action action, int **positions);
+int fls_remove_all(struct Fls *fls, const int *positions, int n);
+int fls_act(struct Fls *fls, struct Action action, char **dests, int ndest,
+	    int *popped);
+int fls_report(struct Fls *fls, const char *line);
+int fls_progress(struct Fls *fls, char *buf, size_t size);
+int fls_release(struct Fls *fls);
+int fls_stop(struct Fls *fls);
+
+#endif
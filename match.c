@@ -0,0 +1,125 @@
+/* Match stacked paths against what a client is looking for, without a
+   round trip per entry.  Substrings are found 16 bytes at a time. */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <limits.h>
+#include <fnmatch.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "match.h"
+
+
+static void glob_literal(struct Match *m) {
+  /* Set <m>'s literal to the longest run of its glob with no wildcards in
+     it, which every match must contain, so most paths can be turned away
+     by a substring search before fnmatch() sees them. */
+  const char *p=m->pat, *run=NULL, *q;
+  size_t len=0;
+
+  m->litlen = 0;
+  for( ; ; p++ ) {
+    if( *p == '\0' || strchr("*?[\\", *p) != NULL ) {
+      if( run != NULL && len > m->litlen && len < sizeof(m->lit) ) {
+	memcpy(m->lit, run, len);
+	m->litlen = len;
+      }
+      run = NULL;
+      len = 0;
+      /* a bracket stands for one character, so skip over what's in it;
+	 a `]' straight after the `[' (or `[!') is part of it */
+      if( *p == '[' ) {
+	q = p + 1;
+	if( *q == '!' || *q == '^' )
+	  q++;
+	q = *q != '\0' ? strchr(q + 1, ']') : NULL;
+	if( q != NULL )
+	  p = q;
+      } else if( *p == '\\' && p[1] != '\0' )
+	p++;
+      if( *p == '\0' )
+	break;
+    } else if( run == NULL ) {
+      run = p;
+      len = 1;
+    } else
+      len++;
+  }
+  m->lit[m->litlen] = '\0';
+}
+
+
+const char *match_find(const char *hay, size_t n, const char *needle, size_t k) {
+  /* Return where <needle> of <k> bytes first is in <hay> of <n>, or NULL.
+     Compare its first and last bytes against 16 places at once, and only
+     look closer where both agree. */
+#ifdef __SSE2__
+  __m128i first, last, a, b;
+  unsigned mask;
+  size_t i=0;
+
+  if( k < 2 || k > n )
+    return k == 0 ? hay : k == 1 ? memchr(hay, needle[0], n) : NULL;
+  first = _mm_set1_epi8(needle[0]);
+  last = _mm_set1_epi8(needle[k - 1]);
+  for( ; i + k + 15 <= n; i += 16 ) {
+    a = _mm_loadu_si128((const __m128i *)(hay + i));
+    b = _mm_loadu_si128((const __m128i *)(hay + i + k - 1));
+    mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+					   _mm_cmpeq_epi8(b, last)));
+    while( mask != 0 ) {
+      size_t at = i + __builtin_ctz(mask);
+      if( memcmp(hay + at + 1, needle + 1, k - 2) == 0 )
+	return hay + at;
+      mask &= mask - 1;
+    }
+  }
+  return memmem(hay + i, n - i, needle, k);
+#else
+  return memmem(hay, n, needle, k);
+#endif
+}
+
+void match_init(struct Match *m, enum MatchKind kind, const char *pat) {
+  /* Set up <m> to look for <pat>, as <kind> says. */
+
+  m->kind = kind;
+  m->pat = pat;
+  m->len = strlen(pat);
+  m->whole = strchr(pat, '/') != NULL;
+  m->litlen = 0;
+  m->lit[0] = '\0';
+  if( kind == MATCH_GLOB )
+    glob_literal(m);
+}
+
+bool match_path(struct Match *m, const char *path) {
+  /* Return whether <path> is what <m> is looking for. */
+  char base[NAME_MAX + 1];
+  const char *name;
+  size_t n=strlen(path), len;
+
+  switch( m->kind ) {
+  case MATCH_PREFIX:
+    return n >= m->len && memcmp(path, m->pat, m->len) == 0;
+  case MATCH_SUBSTR:
+    return match_find(path, n, m->pat, m->len) != NULL;
+  case MATCH_GLOB:
+    if( match_find(path, n, m->lit, m->litlen) == NULL )
+      return false;
+    if( m->whole )
+      return fnmatch(m->pat, path, 0) == 0;
+    /* directories are stacked with a slash on the end */
+    len = n > 1 && path[n - 1] == '/' ? n - 1 : n;
+    for( name = path + len; name > path && name[-1] != '/'; name-- )
+      ;
+    len -= name - path;
+    if( len >= sizeof(base) )
+      return false;
+    memcpy(base, name, len);
+    base[len] = '\0';
+    return fnmatch(m->pat, base, 0) == 0;
+  }
+  return false;
+}
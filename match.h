@@ -0,0 +1,21 @@
+#ifndef match_h
+#define match_h
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "action.h"
+
+struct Match {
+  enum MatchKind kind;
+  const char *pat;
+  size_t len;
+  bool whole;			/* globs with a slash see the whole path */
+  char lit[256];		/* what any match must contain; may be "" */
+  size_t litlen;
+};
+
+void match_init(struct Match *m, enum MatchKind kind, const char *pat);
+bool match_path(struct Match *m, const char *path);
+const char *match_find(const char *hay, size_t n, const char *needle, size_t k);
+
+#endif
@@ -0,0 +1,123 @@
+/* Count the strings in a stack, so we can tell whether one is in it
+   without looking through the lot. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "fls.h"
+#include "pathidx.h"
+
+
+size_t str_hash(const char *s) {
+  /* FNV-1a; names are short, and this spreads them well enough. */
+  uint64_t h=0xcbf29ce484222325ULL;
+
+  while( *s )
+    h = (h ^ (unsigned char)*s++) * 0x100000001b3ULL;
+  return h;
+}
+
+static size_t ref_hash(const void *scope, const char *key) {
+  return str_hash(key) ^ (uintptr_t)scope * 0x9e3779b97f4a7c15ull;
+}
+
+static struct PathRef **ref_link(struct PathIdx *idx, const void *scope,
+				 const char *key) {
+  /* Return the link to <key>'s entry within <scope> in <idx>, or to the
+     NULL at the end of its bucket if it has none. */
+  struct PathRef **link=&idx->buckets[ref_hash(scope, key) & (idx->nbucket - 1)];
+
+  while( *link != NULL && ((*link)->scope != scope || strcmp((*link)->key, key) != 0) )
+    link = &(*link)->next;
+  return link;
+}
+
+static void idx_grow(struct PathIdx *idx) {
+  /* Double the buckets once <idx> is more than three-quarters full. */
+  struct PathRef **buckets, *ref, *next;
+  size_t nbucket, i, b;
+
+  if( idx->len * 4 < idx->nbucket * 3 )
+    return;
+  nbucket = idx->nbucket * 2;
+  buckets = calloc(nbucket, sizeof(*buckets));
+  if( buckets == NULL )
+    return;		/* longer chains, but still correct */
+  for( i = 0; i < idx->nbucket; i++ ) {
+    for( ref = idx->buckets[i]; ref != NULL; ref = next ) {
+      next = ref->next;
+      b = ref_hash(ref->scope, ref->key) & (nbucket - 1);
+      ref->next = buckets[b];
+      buckets[b] = ref;
+    }
+  }
+  free(idx->buckets);
+  idx->buckets = buckets;
+  idx->nbucket = nbucket;
+}
+
+
+void pathidx_init(struct PathIdx *idx) {
+  /* Set up <idx> with nothing in it. */
+
+  idx->nbucket = PATHIDX_MIN;
+  idx->buckets = xmalloc(idx->nbucket * sizeof(*idx->buckets));
+  memset(idx->buckets, 0, idx->nbucket * sizeof(*idx->buckets));
+  idx->len = 0;
+}
+
+int pathidx_count(struct PathIdx *idx, const void *scope, const char *key) {
+  /* Return how many times <key> is in <idx>, within <scope>. */
+  struct PathRef *ref=*ref_link(idx, scope, key);
+
+  return ref == NULL ? 0 : ref->count;
+}
+
+int pathidx_add(struct PathIdx *idx, const void *scope, const char *key) {
+  /* Count one more <key> within <scope> in <idx>, and return how many
+     there are now. */
+  struct PathRef **link=ref_link(idx, scope, key), *ref;
+
+  if( *link != NULL )
+    return ++(*link)->count;
+  idx_grow(idx);
+  ref = xmalloc(sizeof(*ref) + strlen(key) + 1);
+  ref->scope = scope;
+  strcpy(ref->key, key);
+  ref->count = 1;
+  link = &idx->buckets[ref_hash(scope, key) & (idx->nbucket - 1)];
+  ref->next = *link;
+  *link = ref;
+  idx->len++;
+  return 1;
+}
+
+int pathidx_del(struct PathIdx *idx, const void *scope, const char *key) {
+  /* Count one fewer <key> within <scope> in <idx>, and return how many
+     are left. */
+  struct PathRef **link=ref_link(idx, scope, key), *ref=*link;
+
+  if( ref == NULL )
+    return 0;
+  if( --ref->count > 0 )
+    return ref->count;
+  *link = ref->next;
+  free(ref);
+  idx->len--;
+  return 0;
+}
+
+void pathidx_free(struct PathIdx *idx) {
+  /* Forget everything in <idx>. */
+  struct PathRef *ref;
+  size_t i;
+
+  for( i = 0; i < idx->nbucket; i++ ) {
+    while( (ref = idx->buckets[i]) != NULL ) {
+      idx->buckets[i] = ref->next;
+      free(ref);
+    }
+  }
+  free(idx->buckets);
+  idx->len = 0;
+}
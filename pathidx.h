@@ -0,0 +1,30 @@
+#ifndef pathidx_h
+#define pathidx_h
+
+#include <stddef.h>
+
+#define PATHIDX_MIN 16		/* buckets to start with */
+
+struct PathRef {
+  const void *scope;		/* what <key> is within, or NULL */
+  int count;			/* how many times it is in */
+  struct PathRef *next;		/* in the same bucket */
+  char key[];
+};
+
+struct PathIdx {
+  /* How many times each string is in something, found in constant time.
+     A string can be taken within a scope, such as the directory a name
+     is in, so the same string in two of them counts twice over. */
+  struct PathRef **buckets;
+  size_t nbucket, len;
+};
+
+size_t str_hash(const char *s);
+void pathidx_init(struct PathIdx *idx);
+int pathidx_count(struct PathIdx *idx, const void *scope, const char *key);
+int pathidx_add(struct PathIdx *idx, const void *scope, const char *key);
+int pathidx_del(struct PathIdx *idx, const void *scope, const char *key);
+void pathidx_free(struct PathIdx *idx);
+
+#endif
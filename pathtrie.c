@@ -0,0 +1,197 @@
+/* Keep the paths on the stacks as the directory each is in and the rest,
+   with every directory kept once, however many entries share it: stacked
+   paths tend to share long prefixes, and this way those cost next to
+   nothing.  A path is put back together when it's wanted.
+   Directories are found by their parent and name in constant time.
+   Everything that changes them, or looks a path up among them, goes under
+   the lock the stacks are under, as another user's stacks may be changing
+   the same buckets; putting an entry's own path back together needs
+   nothing, as its directories stay while it does. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "comm.h"
+#include "pathtrie.h"
+
+static struct PathDir **buckets;
+static size_t nbucket, ndirs;
+
+
+static size_t dir_hash(const struct PathDir *parent, const char *name,
+		       size_t len) {
+  /* FNV-1a, as str_hash() is, over <name>'s <len> bytes and <parent>. */
+  uint64_t h=0xcbf29ce484222325ULL ^ (uintptr_t)parent;
+
+  while( len-- > 0 )
+    h = (h ^ (unsigned char)*name++) * 0x100000001b3ULL;
+  return h;
+}
+
+static size_t name_len(const struct PathDir *d) {
+  return d->len - (d->parent != NULL ? d->parent->len : 0) - 1;
+}
+
+static size_t base_of(const char *path) {
+  /* Return where the last part of <path> starts: after the last slash,
+     but for one at the very end. */
+  size_t i=strlen(path);
+
+  if( i > 0 && path[i - 1] == '/' )
+    i--;
+  while( i > 0 && path[i - 1] != '/' )
+    i--;
+  return i;
+}
+
+static void dirs_grow(void) {
+  /* Double the buckets once they are more than three-quarters full. */
+  struct PathDir **grown, *d, *next;
+  size_t n, i, b;
+
+  if( buckets != NULL && ndirs * 4 < nbucket * 3 )
+    return;
+  n = buckets != NULL ? nbucket * 2 : PATHTRIE_MIN;
+  grown = calloc(n, sizeof(*grown));
+  if( grown == NULL )
+    return;		/* longer chains, but still correct */
+  for( i = 0; i < nbucket; i++ ) {
+    for( d = buckets[i]; d != NULL; d = next ) {
+      next = d->next;
+      b = dir_hash(d->parent, d->name, name_len(d)) & (n - 1);
+      d->next = grown[b];
+      grown[b] = d;
+    }
+  }
+  free(buckets);
+  buckets = grown;
+  nbucket = n;
+}
+
+static struct PathDir **dir_link(struct PathDir *parent, const char *name,
+				 size_t len) {
+  /* Return the link to the directory <name>, of <len> bytes, in <parent>,
+     or to the NULL at the end of its bucket. */
+  struct PathDir **link;
+
+  link = &buckets[dir_hash(parent, name, len) & (nbucket - 1)];
+  while( *link != NULL && ((*link)->parent != parent || name_len(*link) != len
+			   || memcmp((*link)->name, name, len) != 0) )
+    link = &(*link)->next;
+  return link;
+}
+
+static void dir_put(struct PathDir *d) {
+  /* Let go of <d>, and of each parent in turn, once nothing is in it. */
+  struct PathDir **link, *parent;
+
+  for( ; d != NULL && d->refs == 0; d = parent ) {
+    parent = d->parent;
+    link = dir_link(parent, d->name, name_len(d));
+    *link = d->next;
+    ndirs--;
+    free(d);
+    if( parent != NULL )
+      parent->refs--;
+  }
+}
+
+
+struct PathEntry *pathtrie_intern(const char *path) {
+  /* Return a new entry for <path>, for pathtrie_release() to free, sharing
+     whichever of its directories are kept already.  Return NULL if it's
+     too long, or there's no room for it. */
+  struct PathDir *dir=NULL, **link, *d;
+  struct PathEntry *e;
+  size_t base=base_of(path), len=strlen(path), start, end;
+
+  if( len >= FILEPATH_MAX )
+    return NULL;
+  e = malloc(sizeof(*e) + len - base + 1);
+  if( e == NULL )
+    return NULL;
+  for( start = 0; start < base; start = end + 1 ) {
+    end = start + strcspn(path + start, "/");
+    if( buckets == NULL || (link = dir_link(dir, path + start, end - start), *link == NULL) ) {
+      dirs_grow();
+      if( buckets == NULL || (d = malloc(sizeof(*d) + end - start + 1)) == NULL ) {
+	dir_put(dir);
+	free(e);
+	return NULL;
+      }
+      d->parent = dir;
+      d->refs = 0;
+      d->len = end + 1;
+      memcpy(d->name, path + start, end - start);
+      d->name[end - start] = '\0';
+      link = dir_link(dir, path + start, end - start);
+      d->next = *link;
+      *link = d;
+      ndirs++;
+      if( dir != NULL )
+	dir->refs++;
+    }
+    dir = *link;
+  }
+  if( dir != NULL )
+    dir->refs++;
+  e->dir = dir;
+  strcpy(e->base, path + base);
+  return e;
+}
+
+bool pathtrie_find(const char *path, struct PathDir **dir, const char **base) {
+  /* Set <dir> to the directory <path> is in, and <base> to the rest of
+     it, as pathtrie_intern() would, without keeping anything new.
+     Return false if its directory isn't kept, so no entry has it. */
+  size_t end=base_of(path), start;
+  struct PathDir **link;
+
+  *dir = NULL;
+  *base = path + end;
+  for( start = 0; start < end; start += strcspn(path + start, "/") + 1 ) {
+    if( buckets == NULL )
+      return false;
+    link = dir_link(*dir, path + start, strcspn(path + start, "/"));
+    if( *link == NULL )
+      return false;
+    *dir = *link;
+  }
+  return true;
+}
+
+size_t pathtrie_cost(const char *path) {
+  /* Return the most memory an entry for <path> can keep: its own, and
+     that of every directory it's in, as if it shared none of them. */
+  size_t base=base_of(path), i, n=0;
+
+  for( i = 0; i < base; i++ )
+    n += path[i] == '/';
+  return sizeof(struct PathEntry) + strlen(path) + 1 + n * sizeof(struct PathDir);
+}
+
+char *pathtrie_path(const struct PathEntry *e, char *buf) {
+  /* Put <e>'s path together in <buf>, of FILEPATH_MAX bytes, and return
+     it. */
+  const struct PathDir *d;
+  char *p=buf + (e->dir != NULL ? e->dir->len : 0);
+  size_t len;
+
+  strcpy(p, e->base);
+  for( d = e->dir; d != NULL; d = d->parent ) {
+    len = name_len(d);
+    *--p = '/';
+    p -= len;
+    memcpy(p, d->name, len);
+  }
+  return buf;
+}
+
+void pathtrie_release(struct PathEntry *e) {
+  /* Free <e>, and whichever of its directories nothing else is in. */
+
+  if( e->dir != NULL ) {
+    e->dir->refs--;
+    dir_put(e->dir);
+  }
+  free(e);
+}
@@ -0,0 +1,33 @@
+#ifndef pathtrie_h
+#define pathtrie_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PATHTRIE_MIN 64		/* buckets to start with */
+
+struct PathDir {
+  /* A directory, kept once for every entry in it on every stack, and
+     every directory under it.  Its path is its parents' names and its
+     own, each followed by a slash; "/" is the one named "". */
+  struct PathDir *parent;	/* NULL at the top */
+  struct PathDir *next;		/* in the same bucket */
+  uint32_t refs;		/* entries in it, and directories under it */
+  uint32_t len;			/* of its whole path */
+  char name[];
+};
+
+struct PathEntry {
+  /* A path on a stack: the directory it is in, and the rest of it. */
+  struct PathDir *dir;		/* NULL if it has no slash, but maybe at the end */
+  char base[];			/* ending in a slash if it did */
+};
+
+struct PathEntry *pathtrie_intern(const char *path);
+bool pathtrie_find(const char *path, struct PathDir **dir, const char **base);
+size_t pathtrie_cost(const char *path);
+char *pathtrie_path(const struct PathEntry *e, char *buf);
+void pathtrie_release(struct PathEntry *e);
+
+#endif
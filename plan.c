@@ -0,0 +1,365 @@
+/* Work out what popping files would do, and how long it would take,
+   without doing any of it. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include "comm.h"
+#include "plan.h"
+#include "progress.h"
+
+/* filesystems that can share data between files, for CLONE */
+#define BTRFS_MAGIC 0x9123683e
+#define XFS_MAGIC 0x58465342
+#define BCACHEFS_MAGIC 0xca451a4e
+
+struct Rate {
+  unsigned long src, dst;	/* devices */
+  double rate;			/* bytes/second */
+};
+
+static const char *op_words[] = {
+  "rename", "reflink", "link", "symlink", "copy", "cross-device", "archive",
+};
+
+
+const char *plan_op_word(enum PlanOp op) {
+  /* Return what the plan calls <op>. */
+
+  return op_words[op];
+}
+
+static int rates_load(const char *rates, struct Rate *r) {
+  /* Read what's known about device pairs from the file <rates> into <r>
+     of PLAN_RATES_MAX.  Return how many there are; none if it isn't there,
+     or isn't a file of our own. */
+  struct stat sb;
+  FILE *f;
+  int n=0, fd;
+
+  if( rates == NULL
+      || (fd = open(rates, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1 )
+    return 0;
+  if( fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_uid != geteuid()
+      || (f = fdopen(fd, "r")) == NULL ) {
+    close(fd);
+    return 0;
+  }
+  while( n < PLAN_RATES_MAX
+	 && fscanf(f, "%lu %lu %lf", &r[n].src, &r[n].dst, &r[n].rate) == 3 ) {
+    if( r[n].rate > 0 )
+      n++;
+  }
+  fclose(f);
+  return n;
+}
+
+double plan_rate(const char *rates, dev_t src, dev_t dst) {
+  /* Return how fast data went from device <src> to <dst> before, as kept
+     in the file <rates>, or 0 if we never saw. */
+  struct Rate r[PLAN_RATES_MAX];
+  int i, n;
+
+  n = rates_load(rates, r);
+  for( i = 0; i < n; i++ ) {
+    if( r[i].src == src && r[i].dst == dst )
+      return r[i].rate;
+  }
+  return 0;
+}
+
+void plan_rate_record(const char *rates, dev_t src, dev_t dst, long bytes,
+		      double secs) {
+  /* Remember in the file <rates> that <bytes> went from device <src> to
+     <dst> in <secs>, averaged in with what went before.  Too little to
+     tell by is ignored, and so is failing to write it down. */
+  struct Rate r[PLAN_RATES_MAX];
+  char tmp[FILEPATH_MAX];
+  double rate;
+  FILE *f;
+  int i, n, fd;
+
+  if( rates == NULL || bytes < PLAN_RATE_MIN || secs <= 0 )
+    return;
+  rate = bytes / secs;
+  n = rates_load(rates, r);
+  for( i = 0; i < n && (r[i].src != src || r[i].dst != dst); i++ )
+    ;
+  if( i < n )
+    rate = (3 * r[i].rate + rate) / 4;
+  else if( n == PLAN_RATES_MAX )
+    /* the first were seen longest ago */
+    memmove(&r[0], &r[1], --n * sizeof(*r));
+  if( i >= n )
+    i = n++;
+  r[i] = (struct Rate){src, dst, rate};
+
+  /* a file only we can have made, so nothing planted is written through,
+     and no other pop is writing it at the same time */
+  if( snprintf(tmp, sizeof(tmp), "%s.XXXXXX", rates) >= (int)sizeof(tmp)
+      || (fd = mkostemp(tmp, O_CLOEXEC)) == -1 )
+    return;
+  f = fdopen(fd, "w");
+  if( f == NULL ) {
+    close(fd);
+    unlink(tmp);
+    return;
+  }
+  for( i = 0; i < n; i++ )
+    fprintf(f, "%lu %lu %.0f\n", r[i].src, r[i].dst, r[i].rate);
+  if( fclose(f) != 0 || rename(tmp, rates) == -1 )
+    unlink(tmp);
+}
+
+static bool dev_of(const char *path, dev_t *dev) {
+  /* Set <dev> to the device <path> is on, or would be if it were made.
+     Return false if even its directory isn't there. */
+  struct stat st;
+  char *copy;
+  bool found;
+
+  if( stat(path, &st) == 0 ) {
+    *dev = st.st_dev;
+    return true;
+  }
+  copy = strdup(path);
+  if( copy == NULL )
+    return false;
+  found = stat(dirname(copy), &st) == 0;
+  free(copy);
+  if( found )
+    *dev = st.st_dev;
+  return found;
+}
+
+static bool reflinkable(const char *path) {
+  /* Can files on the filesystem at <path> share their data? */
+  struct statfs fs;
+
+  if( statfs(path, &fs) == -1 )
+    return false;
+  return fs.f_type == BTRFS_MAGIC || fs.f_type == XFS_MAGIC
+    || fs.f_type == BCACHEFS_MAGIC;
+}
+
+static char *target_of(const char *source, const char *dest, bool into) {
+  /* Return where <source> ends up, going <into> the directory <dest> or
+     to <dest> itself. */
+  char *copy, *base, *target;
+  size_t len;
+
+  if( !into )
+    return strdup(dest);
+  copy = strdup(source);
+  if( copy == NULL )
+    return NULL;
+  len = strlen(copy);
+  if( len > 1 && copy[len-1] == '/' )
+    copy[len-1] = '\0';
+  base = basename(copy);
+  len = strlen(dest);
+  target = malloc(len + strlen(base) + 2);
+  if( target != NULL )
+    sprintf(target, "%s%s%s", dest, len > 0 && dest[len-1] == '/' ? "" : "/", base);
+  free(copy);
+  return target;
+}
+
+static void plan_entry(struct Plan *plan, struct PlanEntry *e,
+		       enum ActionType type, const char *rates) {
+  /* Fill in how <e> gets to its target by <type>, and add it to <plan>. */
+  struct Progress pg;
+  struct stat st;
+  dev_t src=0, dst=0;
+  bool known;
+
+  progress_init(&pg);
+  progress_count(&pg, &e->source, 1);
+  e->files = pg.total_files > 0 ? pg.total_files : 0;
+  e->bytes = pg.total_bytes > 0 ? pg.total_bytes : 0;
+  progress_free(&pg);
+
+  known = dev_of(e->source, &src) && dev_of(e->target, &dst);
+  if( !known )
+    e->error = "no such file or directory";
+  switch (type) {
+  case MOVE:
+    e->op = src == dst ? PLAN_RENAME : PLAN_CROSS;
+    break;
+  case LINK:
+    e->op = PLAN_LINK;
+    if( src != dst )
+      e->error = "cannot link across devices";
+    break;
+  case CLONE:
+    e->op = src != dst ? PLAN_CROSS : reflinkable(e->source) ? PLAN_REFLINK : PLAN_COPY;
+    break;
+  case SYMLINK:
+    e->op = PLAN_SYMLINK;
+    break;
+  case ARCHIVE:
+    e->op = PLAN_ARCHIVE;
+    break;
+  default:
+    e->op = src == dst ? PLAN_COPY : PLAN_CROSS;
+    break;
+  }
+  if( e->op == PLAN_COPY || e->op == PLAN_CROSS || e->op == PLAN_ARCHIVE )
+    e->moved = e->bytes;
+  /* an archive is only overwritten the once */
+  e->overwrites = lstat(e->target, &st) == 0
+    && (type != ARCHIVE || plan->n == 0);
+  if( e->moved > 0 && e->error == NULL ) {
+    e->rate = plan_rate(rates, src, dst);
+    if( e->rate == 0 )
+      plan->secs = -1;
+    else if( plan->secs >= 0 )
+      plan->secs += e->moved / e->rate;
+  }
+
+  plan->files += e->files;
+  plan->bytes += e->bytes;
+  plan->moved += e->moved;
+  plan->overwrites += e->overwrites;
+  plan->errors += e->error != NULL;
+  plan->n++;
+}
+
+int plan_build(struct Plan *plan, struct Action action, char **sources, int n,
+	       char **dests, int ndest, const char *rates) {
+  /* Set <plan> to what <action> would do with the <n> <sources> and the
+     <ndest> <dests>, one entry for each source and destination, timed by
+     how fast each pair of devices went before according to the file
+     <rates>.  Nothing is changed on the disk.  <plan> is to be freed
+     with plan_free() either way.
+     Return -1 if we run out of memory. */
+  struct PlanEntry *e;
+  struct stat st;
+  bool into;
+  int i, j;
+
+  memset(plan, 0, sizeof(*plan));
+  plan->type = action.type;
+  plan->entries = calloc((size_t)n * ndest, sizeof(*plan->entries));
+  if( plan->entries == NULL && n > 0 ) {
+    fprintf(stderr, "plan_build: %s\n", strerror(ENOMEM));
+    return -1;
+  }
+  for( j = 0; j < ndest; j++ ) {
+    into = action.type != ARCHIVE && stat(dests[j], &st) == 0 && S_ISDIR(st.st_mode);
+    for( i = 0; i < n; i++ ) {
+      e = &plan->entries[plan->n];
+      e->source = strdup(sources[i]);
+      e->target = target_of(sources[i], dests[j], into);
+      if( e->source == NULL || e->target == NULL ) {
+	fprintf(stderr, "plan_build: %s\n", strerror(ENOMEM));
+	free(e->source);
+	free(e->target);
+	return -1;
+      }
+      plan_entry(plan, e, action.type, rates);
+    }
+  }
+  return 0;
+}
+
+void plan_free(struct Plan *plan) {
+  int i;
+
+  for( i = 0; i < plan->n; i++ ) {
+    free(plan->entries[i].source);
+    free(plan->entries[i].target);
+  }
+  free(plan->entries);
+  plan->entries = NULL;
+  plan->n = 0;
+}
+
+void plan_print(struct Plan *plan, FILE *out) {
+  /* Write <plan> to <out> for people: a line for each entry, then the
+     totals. */
+  char b1[PROGRESS_HUMAN_MAX], b2[PROGRESS_HUMAN_MAX];
+  struct PlanEntry *e;
+  long secs;
+  int i;
+
+  for( i = 0; i < plan->n; i++ ) {
+    e = &plan->entries[i];
+    fprintf(out, "%-12s %6s  %s -> %s", plan_op_word(e->op),
+	    progress_human(e->bytes, b1), e->source, e->target);
+    if( e->error != NULL )
+      fprintf(out, " (fails: %s)", e->error);
+    else if( e->overwrites )
+      fprintf(out, " (overwrites)");
+    fputc('\n', out);
+  }
+  fprintf(out, "%d entr%s, %ld file%s, %s; %s to move", plan->n,
+	  plan->n == 1 ? "y" : "ies", plan->files, plan->files == 1 ? "" : "s",
+	  progress_human(plan->bytes, b1), progress_human(plan->moved, b2));
+  secs = plan->secs + 0.5;
+  if( plan->moved == 0 )
+    ;
+  else if( plan->secs < 0 )
+    fprintf(out, ", time unknown (no earlier runs between these devices)");
+  else
+    fprintf(out, ", about %ld:%02ld", secs / 60, secs % 60);
+  fputc('\n', out);
+  if( plan->overwrites > 0 )
+    fprintf(out, "%d overwrite%s\n", plan->overwrites, plan->overwrites == 1 ? "" : "s");
+  if( plan->errors > 0 )
+    fprintf(out, "%d would fail\n", plan->errors);
+}
+
+static void json_str(FILE *out, const char *s) {
+  /* Write <s> to <out> as a JSON string. */
+
+  fputc('"', out);
+  for( ; *s != '\0'; s++ ) {
+    if( *s == '"' || *s == '\\' )
+      fprintf(out, "\\%c", *s);
+    else if( (unsigned char)*s < 0x20 )
+      fprintf(out, "\\u%04x", *s);
+    else
+      fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+void plan_print_json(struct Plan *plan, FILE *out) {
+  /* Write <plan> to <out> as a JSON object, for other programs. */
+  struct PlanEntry *e;
+  int i;
+
+  fprintf(out, "{\"entries\": [");
+  for( i = 0; i < plan->n; i++ ) {
+    e = &plan->entries[i];
+    fprintf(out, "%s\n  {\"op\": \"%s\", \"source\": ", i > 0 ? "," : "",
+	    plan_op_word(e->op));
+    json_str(out, e->source);
+    fprintf(out, ", \"target\": ");
+    json_str(out, e->target);
+    fprintf(out, ", \"files\": %ld, \"bytes\": %ld, \"moved\": %ld, "
+	    "\"overwrites\": %s, \"rate\": %.0f, \"error\": ", e->files,
+	    e->bytes, e->moved, e->overwrites ? "true" : "false", e->rate);
+    if( e->error != NULL )
+      json_str(out, e->error);
+    else
+      fprintf(out, "null");
+    fputc('}', out);
+  }
+  fprintf(out, "%s],\n \"files\": %ld, \"bytes\": %ld, \"moved\": %ld, "
+	  "\"overwrites\": %d, \"errors\": %d, \"seconds\": ",
+	  plan->n > 0 ? "\n" : "", plan->files, plan->bytes, plan->moved,
+	  plan->overwrites, plan->errors);
+  if( plan->secs < 0 )
+    fprintf(out, "null}\n");
+  else
+    fprintf(out, "%.1f}\n", plan->secs);
+}
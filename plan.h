@@ -0,0 +1,53 @@
+#ifndef plan_h
+#define plan_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "action.h"
+
+#define PLAN_RATES_MAX 256	/* device pairs remembered */
+#define PLAN_RATE_MIN (16L << 20) /* bytes a pop has to move to be timed */
+
+enum PlanOp {
+  PLAN_RENAME,			/* same filesystem; nothing is read */
+  PLAN_REFLINK,			/* shares the data; nothing is read */
+  PLAN_LINK,
+  PLAN_SYMLINK,
+  PLAN_COPY,			/* read and written on the one device */
+  PLAN_CROSS,			/* from one device to another */
+  PLAN_ARCHIVE,
+};
+
+struct PlanEntry {
+  char *source, *target;
+  enum PlanOp op;
+  long files, bytes;		/* in the source, counting everything under it */
+  long moved;			/* of those bytes that have to be copied */
+  bool overwrites;		/* <target> is there already */
+  const char *error;		/* why it can't work, or NULL */
+  double rate;			/* bytes/second seen before, or 0 if never */
+};
+
+struct Plan {
+  /* What popping some files would do, worked out without doing it. */
+  enum ActionType type;
+  struct PlanEntry *entries;
+  int n;
+  long files, bytes, moved;
+  int overwrites, errors;
+  double secs;			/* for the bytes moved, or -1 if a rate is unknown */
+};
+
+int plan_build(struct Plan *plan, struct Action action, char **sources, int n,
+	       char **dests, int ndest, const char *rates);
+void plan_free(struct Plan *plan);
+void plan_print(struct Plan *plan, FILE *out);
+void plan_print_json(struct Plan *plan, FILE *out);
+const char *plan_op_word(enum PlanOp op);
+
+double plan_rate(const char *rates, dev_t src, dev_t dst);
+void plan_rate_record(const char *rates, dev_t src, dev_t dst, long bytes,
+		      double secs);
+
+#endif
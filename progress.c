@@ -0,0 +1,175 @@
+/* Count what a transfer has done, cheaply enough to do it from the copy
+   loop, and say how it's going. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include "progress.h"
+
+#define COUNT_FDS 64		/* open at once while counting */
+
+/* nftw() takes no argument to pass along, so counting is one at a time */
+static pthread_mutex_t counting=PTHREAD_MUTEX_INITIALIZER;
+static struct Progress *counted;
+static long count_files, count_bytes;
+
+
+void progress_init(struct Progress *pg) {
+  /* Set up <pg> with nothing done, and nothing known about what's to do. */
+  int i;
+
+  memset(pg, 0, sizeof(*pg));
+  pg->total_files = pg->total_bytes = -1;
+  clock_gettime(CLOCK_MONOTONIC, &pg->start);
+  for( i = 0; i < PROGRESS_SLOTS; i++ )
+    pthread_mutex_init(&pg->file[i].lock, NULL);
+}
+
+void progress_free(struct Progress *pg) {
+  int i;
+
+  for( i = 0; i < PROGRESS_SLOTS; i++ )
+    pthread_mutex_destroy(&pg->file[i].lock);
+}
+
+static int count_one(const char *path, const struct stat *st, int type,
+		     struct FTW *ftw) {
+  if( type == FTW_F && S_ISREG(st->st_mode) ) {
+    count_files++;
+    count_bytes += st->st_size;
+  }
+  return __atomic_load_n(&counted->stop, __ATOMIC_RELAXED);
+}
+
+void progress_count(struct Progress *pg, char **sources, int n) {
+  /* Count the plain files in the <n> <sources>, and everything under
+     them, and how big they are, into <pg>'s totals.  Give up if <pg> is
+     told to stop first.  This reads every directory, so is best done
+     alongside the transfer rather than before it. */
+  int i;
+
+  pthread_mutex_lock(&counting);
+  counted = pg;
+  count_files = count_bytes = 0;
+  for( i = 0; i < n && !__atomic_load_n(&pg->stop, __ATOMIC_RELAXED); i++ )
+    nftw(sources[i], count_one, COUNT_FDS, FTW_PHYS);
+  if( !__atomic_load_n(&pg->stop, __ATOMIC_RELAXED) ) {
+    __atomic_store_n(&pg->total_bytes, count_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&pg->total_files, count_files, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&counting);
+}
+
+void progress_file(struct Progress *pg, int slot, const char *path, long size) {
+  /* Say the copier in <slot> has started on <path>, of <size> bytes. */
+  struct ProgressFile *f;
+  size_t len;
+
+  if( pg == NULL || slot < 0 )
+    return;
+  f = &pg->file[slot % PROGRESS_SLOTS];
+  len = strlen(path);
+  if( len >= PROGRESS_NAME_MAX )
+    path += len - (PROGRESS_NAME_MAX - 1);
+  pthread_mutex_lock(&f->lock);
+  strcpy(f->name, path);
+  f->size = size;
+  __atomic_store_n(&f->done, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&f->lock);
+}
+
+void progress_add(struct Progress *pg, int slot, long bytes) {
+  /* Count <bytes> more copied by the copier in <slot>, or by no copier
+     in particular if it is -1. */
+
+  if( pg == NULL )
+    return;
+  __atomic_add_fetch(&pg->bytes, bytes, __ATOMIC_RELAXED);
+  if( slot >= 0 )
+    __atomic_add_fetch(&pg->file[slot % PROGRESS_SLOTS].done, bytes, __ATOMIC_RELAXED);
+}
+
+void progress_done(struct Progress *pg, int slot) {
+  /* Count a file finished by the copier in <slot> (or -1). */
+  struct ProgressFile *f;
+
+  if( pg == NULL )
+    return;
+  __atomic_add_fetch(&pg->files, 1, __ATOMIC_RELAXED);
+  if( slot < 0 )
+    return;
+  f = &pg->file[slot % PROGRESS_SLOTS];
+  pthread_mutex_lock(&f->lock);
+  f->name[0] = '\0';
+  pthread_mutex_unlock(&f->lock);
+}
+
+void progress_cloned(struct Progress *pg) {
+  /* Count a file that was reflinked, rather than copied. */
+
+  if( pg != NULL )
+    __atomic_add_fetch(&pg->cloned, 1, __ATOMIC_RELAXED);
+}
+
+char *progress_human(double n, char *buf) {
+  /* Write <n> bytes into <buf> of PROGRESS_HUMAN_MAX the way people read
+     them, and return it. */
+  const char *units="BKMGTP";
+
+  while( n >= 1000 && units[1] != '\0' ) {
+    n /= 1024;
+    units++;
+  }
+  sprintf(buf, n < 10 && *units != 'B' ? "%.1f%c" : "%.0f%c", n, *units);
+  return buf;
+}
+
+int progress_line(struct Progress *pg, char *buf, size_t size) {
+  /* Describe how far <pg> has got in one line in <buf> of <size> bytes:
+     files and bytes done (out of how many, once that's known), the rate,
+     how long is left, and the biggest file in flight.
+     Return its length, as snprintf() does. */
+  struct timespec now;
+  struct ProgressFile *f;
+  long files, bytes, total_files, total_bytes, big=0, done=0;
+  double secs, rate;
+  char b1[PROGRESS_HUMAN_MAX], b2[PROGRESS_HUMAN_MAX], b3[PROGRESS_HUMAN_MAX], name[PROGRESS_NAME_MAX];
+  int len, i;
+
+  files = __atomic_load_n(&pg->files, __ATOMIC_RELAXED);
+  bytes = __atomic_load_n(&pg->bytes, __ATOMIC_RELAXED);
+  total_files = __atomic_load_n(&pg->total_files, __ATOMIC_RELAXED);
+  total_bytes = __atomic_load_n(&pg->total_bytes, __ATOMIC_RELAXED);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  secs = (now.tv_sec - pg->start.tv_sec) + (now.tv_nsec - pg->start.tv_nsec) / 1e9;
+  rate = secs > 0 ? bytes / secs : 0;
+
+  if( total_files < 0 )
+    len = snprintf(buf, size, "%ld files, %s, %s/s", files,
+		   progress_human(bytes, b1), progress_human(rate, b3));
+  else
+    len = snprintf(buf, size, "%ld/%ld files, %s/%s, %s/s", files, total_files,
+		   progress_human(bytes, b1), progress_human(total_bytes, b2),
+		   progress_human(rate, b3));
+  if( total_bytes >= bytes && rate > 0 && (size_t)len < size ) {
+    long left = (total_bytes - bytes) / rate;
+    len += snprintf(buf + len, size - len, ", %ld:%02ld left", left / 60, left % 60);
+  }
+
+  for( i = 0; i < PROGRESS_SLOTS; i++ ) {
+    f = &pg->file[i];
+    pthread_mutex_lock(&f->lock);
+    if( f->name[0] != '\0' && f->size > big ) {
+      strcpy(name, f->name);
+      big = f->size;
+      done = __atomic_load_n(&f->done, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&f->lock);
+  }
+  if( big > 0 && (size_t)len < size )
+    len += snprintf(buf + len, size - len, "; %s %ld%%", name, done * 100 / big);
+  return len;
+}
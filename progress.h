@@ -0,0 +1,41 @@
+#ifndef progress_h
+#define progress_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+
+#define PROGRESS_SLOTS 32	/* files in flight at once; COPY_THREADS_MAX */
+#define PROGRESS_NAME_MAX 64	/* of each one's name that's kept */
+#define PROGRESS_CHUNK (8L << 20) /* copied between updates, at most */
+#define PROGRESS_HUMAN_MAX 16	/* for progress_human() */
+
+struct ProgressFile {
+  pthread_mutex_t lock;		/* for <name> */
+  char name[PROGRESS_NAME_MAX];	/* the end of its path, or "" if idle */
+  long size, done;
+};
+
+struct Progress {
+  /* How far a transfer has got.  The copy engine adds to these as it
+     goes, and anything may read them meanwhile. */
+  long files, bytes;		/* finished */
+  long cloned;			/* of <files>, sharing their data with the source */
+  long total_files, total_bytes;	/* to do, or -1 until they're counted */
+  bool stop;			/* give up counting */
+  struct timespec start;
+  struct ProgressFile file[PROGRESS_SLOTS];	/* by worker */
+};
+
+void progress_init(struct Progress *pg);
+void progress_free(struct Progress *pg);
+void progress_count(struct Progress *pg, char **sources, int n);
+void progress_file(struct Progress *pg, int slot, const char *path, long size);
+void progress_add(struct Progress *pg, int slot, long bytes);
+void progress_done(struct Progress *pg, int slot);
+void progress_cloned(struct Progress *pg);
+char *progress_human(double n, char *buf);
+int progress_line(struct Progress *pg, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,191 @@
+/* Keep the stacks in a file while there's no daemon to hold them, so the
+   next one starts where the last left off.  Each record is a string, the
+   way they go down the socket, its first letter saying what it is: the
+   uid whose stacks follow, a stack of theirs, or an entry in it. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "fls.h"
+#include "comm.h"
+#include "snapshot.h"
+
+#define REC_UID 'u'		/* then the uid */
+#define REC_STACK 's'		/* then '1' if it's unique, '0' if not, then the name */
+#define REC_ENTRY 'e'		/* then the path */
+
+
+static void put(FILE *f, char kind, const char *s) {
+  putc(kind, f);
+  fwrite(s, 1, strlen(s) + 1, f);
+}
+
+static char *entry_now(struct Stack *st, int n, char *buf) {
+  /* Put where the <n>th entry in <st> is to be found again in <buf>, and
+     return it: a descriptor held for it can't be kept, but where it says
+     the file is now can.  One deleted since stays as it was pushed. */
+  char proc[64];
+  struct stat sb;
+  ssize_t len;
+  int fd;
+
+  fd = stacktab_fd(st, n);
+  if( fd == -1 )
+    return stacktab_path(st, n, buf);
+  sprintf(proc, "/proc/self/fd/%d", fd);
+  len = readlink(proc, buf, FILEPATH_MAX - 2);
+  if( len == -1 || fstat(fd, &sb) == -1 || sb.st_nlink == 0 )
+    return stacktab_path(st, n, buf);
+  buf[len] = '\0';
+  if( S_ISDIR(sb.st_mode) && strcmp(buf, "/") != 0 )
+    strcat(buf, "/");
+  return buf;
+}
+
+FILE *snapshot_create(const char *path) {
+  /* Start a snapshot to go at <path>; it only goes there once
+     snapshot_commit() has it all.  Return NULL if we can't. */
+  char tmp[FILEPATH_MAX];
+  FILE *f;
+  int fd;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  /* whatever is there already isn't ours to write through */
+  unlink(tmp);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if( fd == -1 ) {
+    fprintf(stderr, "daemon: cannot create `%s': %s\n", tmp, strerror(errno));
+    return NULL;
+  }
+  f = fdopen(fd, "w");
+  if( f == NULL ) {
+    perror("daemon: fdopen");
+    close(fd);
+    unlink(tmp);
+    return NULL;
+  }
+  fwrite(SNAPSHOT_MAGIC, 1, sizeof(SNAPSHOT_MAGIC), f);
+  return f;
+}
+
+void snapshot_add(FILE *f, uid_t uid, struct StackTab *tab) {
+  /* Put <uid>'s stacks, <tab>, in the snapshot being written to <f>,
+     each from the top down.  Anything that couldn't be written shows when
+     it's committed. */
+  char buf[FILEPATH_MAX + 16];
+  struct Stack *st;
+  size_t i;
+  int n;
+
+  sprintf(buf, "%u", (unsigned)uid);
+  put(f, REC_UID, buf);
+  for( i = 0; i < tab->nbucket; i++ ) {
+    for( st = tab->buckets[i]; st != NULL; st = st->next ) {
+      snprintf(buf, sizeof(buf), "%c%s", st->unique ? '1' : '0', st->name);
+      put(f, REC_STACK, buf);
+      for( n = 0; n < st->dq.len; n++ )
+	put(f, REC_ENTRY, entry_now(st, n, buf));
+    }
+  }
+}
+
+bool snapshot_commit(FILE *f, const char *path) {
+  /* Finish the snapshot being written to <f>, and put it at <path> in
+     place of any there, once it's on the disk.  Return false if it
+     couldn't be, leaving whatever was at <path>. */
+  char tmp[FILEPATH_MAX];
+  bool ok;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  ok = fflush(f) == 0 && !ferror(f) && fsync(fileno(f)) == 0;
+  if( fclose(f) != 0 )
+    ok = false;
+  if( ok && rename(tmp, path) == 0 )
+    return true;
+  fprintf(stderr, "daemon: cannot save `%s': %s\n", path, strerror(errno));
+  unlink(tmp);
+  return false;
+}
+
+long snapshot_load(const char *path,
+		   struct StackTab *(*tab_of)(uid_t uid, void *arg), void *arg) {
+  /* Put what the snapshot at <path> has back on the stacks, each user's in
+     the table <tab_of> gives with <arg> for their uid, under the entries
+     there already; then remove it, as it's all in the daemon now.
+     Return how many entries were restored, 0 if there was no snapshot, or
+     -1 if it couldn't be read.  Only one of our own is read at all. */
+  struct StackTab *tab=NULL;
+  struct Stack *st=NULL;
+  struct stat sb;
+  char *buf=NULL, *p, *end;
+  ssize_t len;
+  size_t got;
+  long n=0, lost=0;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if( fd == -1 ) {
+    if( errno == ENOENT )
+      return 0;
+    fprintf(stderr, "daemon: cannot open `%s': %s\n", path, strerror(errno));
+    return -1;
+  }
+  if( fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_uid != geteuid() ) {
+    fprintf(stderr, "daemon: `%s' isn't a snapshot of ours\n", path);
+    n = -1;
+    goto out;
+  }
+  buf = xmalloc(sb.st_size + 1);
+  for( got = 0; got < (size_t)sb.st_size; got += len ) {
+    len = read(fd, buf + got, sb.st_size - got);
+    if( len == -1 && errno == EINTR )
+      len = 0;
+    else if( len <= 0 )
+      break;
+  }
+  if( got < sizeof(SNAPSHOT_MAGIC) || memcmp(buf, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ) {
+    fprintf(stderr, "daemon: `%s' isn't a snapshot of ours\n", path);
+    n = -1;
+    goto out;
+  }
+  /* a record cut short at the end still ends */
+  buf[got] = '\0';
+  end = buf + got;
+  for( p = buf + sizeof(SNAPSHOT_MAGIC); p < end; p += strlen(p) + 1 ) {
+    switch( *p ) {
+    case REC_UID:
+      tab = tab_of(strtoul(p + 1, NULL, 10), arg);
+      st = NULL;
+      break;
+    case REC_STACK:
+      st = NULL;
+      if( tab == NULL || p[1] == '\0' )
+	break;
+      st = stacktab_get(tab, p + 2);
+      if( st == NULL )
+	st = stacktab_create(tab, p + 2);
+      if( st != NULL )
+	st->unique = p[1] == '1';
+      break;
+    case REC_ENTRY:
+      if( st != NULL && stacktab_insert(tab, st, -1, p + 1, -1) )
+	n++;
+      else
+	lost++;
+      break;
+    }
+  }
+  if( lost > 0 )
+    printf("daemon: %ld entries in `%s' didn't fit\n", lost, path);
+  unlink(path);
+
+ out:
+  free(buf);
+  close(fd);
+  return n;
+}
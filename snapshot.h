@@ -0,0 +1,18 @@
+#ifndef snapshot_h
+#define snapshot_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "stacktab.h"
+
+#define SNAPSHOT_SUFFIX ".snapshot"	/* after the socket's path */
+#define SNAPSHOT_MAGIC "fls snapshot 1"
+
+FILE *snapshot_create(const char *path);
+void snapshot_add(FILE *f, uid_t uid, struct StackTab *tab);
+bool snapshot_commit(FILE *f, const char *path);
+long snapshot_load(const char *path,
+		   struct StackTab *(*tab_of)(uid_t uid, void *arg), void *arg);
+
+#endif
@@ -1,75 +1,236 @@
-/* Maintain a dynamically allocated stack of strings. */
+/* Maintain a dynamically allocated double-ended stack: a ring that can be
+   pushed and popped at either end, in constant time.  And an inbox, for
+   strings bound for one that other threads can't touch. */
 
 #include <stdlib.h>
 #include <string.h>
 #include "fls.h"
 #include "stack.h"
 
-Node **stack_new() {
-  /* Return a blank stack. */
-  Node **stack=xmalloc(sizeof(*stack));
+static int slot(struct Deque *dq, int n) {
+  /* Return where the <n>th item from the top of <dq> lives. */
+  return (dq->head + n) & (dq->cap - 1);
+}
+
+static void deque_grow(struct Deque *dq) {
+  /* Make room in <dq> for one more item. */
+  void **ring;
+  int cap, i;
 
-  *stack = NULL;
-  return stack;
+  if( dq->len < dq->cap )
+    return;
+  cap = dq->cap ? dq->cap * 2 : DEQUE_MIN;
+  ring = xmalloc(cap * sizeof(*ring));
+  for( i = 0; i < dq->len; i++ )
+    ring[i] = dq->ring[slot(dq, i)];
+  free(dq->ring);
+  dq->ring = ring;
+  dq->cap = cap;
+  dq->head = 0;
 }
 
-void stack_push(char *dat, Node **stack) {
-  /* Push <dat> onto <stack>. */
-  Node *new=xmalloc(sizeof(*new));
 
-  new->dat = xstrdup(dat);
-  new->next = *stack;
-  *stack = new;
+void deque_init(struct Deque *dq) {
+  /* Set up <dq> empty; it takes no memory until something goes in. */
+
+  dq->ring = NULL;
+  dq->cap = dq->head = dq->len = 0;
 }
 
-bool stack_drop(Node **stack) {
-  /* Drop the top item from <stack>. */
-  Node *dropnode=*stack;
+void deque_push(struct Deque *dq, void *dat) {
+  /* Push <dat> onto the top of <dq>. */
 
-  if( dropnode == NULL )
-    return false;
-  *stack = (*stack)->next;
-  free(dropnode->dat);
-  free(dropnode);
-  return true;
+  deque_grow(dq);
+  dq->head = slot(dq, -1);
+  dq->ring[dq->head] = dat;
+  dq->len++;
+}
+
+void deque_unshift(struct Deque *dq, void *dat) {
+  /* Slip <dat> in under the bottom of <dq>. */
+
+  deque_grow(dq);
+  dq->ring[slot(dq, dq->len)] = dat;
+  dq->len++;
+}
+
+void *deque_pop(struct Deque *dq) {
+  /* Take the top item off <dq>, and return it, or NULL if it's empty. */
+  void *dat;
+
+  if( dq->len == 0 )
+    return NULL;
+  dat = dq->ring[dq->head];
+  dq->head = slot(dq, 1);
+  dq->len--;
+  return dat;
 }
 
-char *stack_peek(Node **stack) {
-  /* Return the top item of <stack>. */
+void *deque_shift(struct Deque *dq) {
+  /* The same, for the bottom item. */
 
-  if( *stack == NULL )
+  if( dq->len == 0 )
     return NULL;
-  return (*stack)->dat;
+  dq->len--;
+  return dq->ring[slot(dq, dq->len)];
 }
 
-char *stack_nth(int n, Node **stack) {
-  /* Return the <n>th item of <stack>. */
+void *deque_nth(struct Deque *dq, int n) {
+  /* Return the <n>th item from the top of <dq>, or, if <n> is negative,
+     the -<n>th from the bottom. */
 
-  if( *stack == NULL )
+  if( n < 0 )
+    n += dq->len;
+  if( n < 0 || n >= dq->len )
     return NULL;
-  if( n > 0 )
-    return stack_nth( n-1, &((*stack)->next) );
-  else
-    return stack_peek(stack);
+  return dq->ring[slot(dq, n)];
 }
 
-int stack_len(Node **stack) {
-  /* Return the number of items in <stack>. */
-  Node *elt=*stack;
-  int i=0;
+bool deque_insert(struct Deque *dq, int n, void *dat) {
+  /* Put <dat> in <dq> so it becomes the <n>th item from the top, or, if
+     <n> is negative, the -<n>th from the bottom.  The items on whichever
+     side is shorter move over to make room.
+     Return false if <dq> isn't that deep. */
+  int i;
 
-  while( elt != NULL ) {
-    elt = elt->next;
-    i++;
+  if( n < 0 )
+    n += dq->len + 1;
+  if( n < 0 || n > dq->len )
+    return false;
+  deque_grow(dq);
+  if( n < dq->len / 2 ) {
+    dq->head = slot(dq, -1);
+    for( i = 0; i < n; i++ )
+      dq->ring[slot(dq, i)] = dq->ring[slot(dq, i + 1)];
+  } else {
+    for( i = dq->len; i > n; i-- )
+      dq->ring[slot(dq, i)] = dq->ring[slot(dq, i - 1)];
   }
-  return i;
+  dq->ring[slot(dq, n)] = dat;
+  dq->len++;
+  return true;
 }
 
-void stack_free(Node **stack) {
-  /* Drop all items from <stack>. */
+void *deque_remove(struct Deque *dq, int n) {
+  /* Take the <n>th item from the top of <dq> (or, if <n> is negative, the
+     -<n>th from the bottom) out, closing the gap from whichever side is
+     shorter.  Return it, or NULL if <dq> isn't that deep. */
+  void *dat;
   int i;
 
-  while( stack_drop(stack) )
+  if( n < 0 )
+    n += dq->len;
+  if( n < 0 || n >= dq->len )
+    return NULL;
+  dat = dq->ring[slot(dq, n)];
+  if( n < dq->len / 2 ) {
+    for( i = n; i > 0; i-- )
+      dq->ring[slot(dq, i)] = dq->ring[slot(dq, i - 1)];
+    dq->head = slot(dq, 1);
+  } else {
+    for( i = n; i < dq->len - 1; i++ )
+      dq->ring[slot(dq, i)] = dq->ring[slot(dq, i + 1)];
+  }
+  dq->len--;
+  return dat;
+}
+
+void deque_rotate(struct Deque *dq, int n) {
+  /* Move the top <n> items of <dq> to the bottom, in order, or, if <n> is
+     negative, the bottom -<n> to the top.  Each step is constant time,
+     and it goes whichever way round takes fewer. */
+
+  if( dq->len == 0 )
+    return;
+  n %= dq->len;
+  if( n < 0 )
+    n += dq->len;
+  if( n > dq->len / 2 )
+    n -= dq->len;
+  for( ; n > 0; n-- ) {
+    dq->ring[slot(dq, dq->len)] = dq->ring[dq->head];
+    dq->head = slot(dq, 1);
+  }
+  for( ; n < 0; n++ ) {
+    dq->head = slot(dq, -1);
+    dq->ring[dq->head] = dq->ring[slot(dq, dq->len)];
+  }
+}
+
+bool deque_swap(struct Deque *dq) {
+  /* Swap the top two items of <dq>. */
+  void *top;
+
+  if( dq->len < 2 )
+    return false;
+  top = dq->ring[dq->head];
+  dq->ring[dq->head] = dq->ring[slot(dq, 1)];
+  dq->ring[slot(dq, 1)] = top;
+  return true;
+}
+
+void deque_free(struct Deque *dq) {
+  /* Drop all items from <dq>; freeing them is up to the caller. */
+
+  free(dq->ring);
+  deque_init(dq);
+}
+
+void inbox_init(struct Inbox *in) {
+  in->top = NULL;
+  in->len = 0;
+}
+
+bool inbox_push(struct Inbox *in, const char *name, const char *dat, int max) {
+  /* Leave <dat>, bound for the stack <name>, in <in>, unless it has <max>
+     waiting already.  Safe to call from any number of threads at once. */
+  struct InboxEntry *e;
+
+  if( __atomic_add_fetch(&in->len, 1, __ATOMIC_RELAXED) > max ) {
+    __atomic_sub_fetch(&in->len, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  e = xmalloc(sizeof(*e));
+  e->name = xstrdup((char *)name);
+  e->dat = xstrdup((char *)dat);
+  e->next = __atomic_load_n(&in->top, __ATOMIC_RELAXED);
+  /* a failed swap leaves what's on top now in <e->next>, to try again on */
+  while( !__atomic_compare_exchange_n(&in->top, &e->next, e, true,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED) )
     ;
-  free(stack);
+  return true;
+}
+
+struct InboxEntry *inbox_take(struct Inbox *in) {
+  /* Empty <in>, and return what was in it, the first left first, for the
+     caller to free with inbox_entry_free(). */
+  struct InboxEntry *e, *next, *first=NULL;
+  int n=0;
+
+  e = __atomic_exchange_n(&in->top, NULL, __ATOMIC_ACQUIRE);
+  /* they come off newest first */
+  for( ; e != NULL; e = next ) {
+    next = e->next;
+    e->next = first;
+    first = e;
+    n++;
+  }
+  __atomic_sub_fetch(&in->len, n, __ATOMIC_RELAXED);
+  return first;
+}
+
+void inbox_entry_free(struct InboxEntry *e) {
+  free(e->name);
+  free(e->dat);
+  free(e);
+}
+
+void inbox_free(struct Inbox *in) {
+  /* Drop everything waiting in <in>. */
+  struct InboxEntry *e, *next;
+
+  for( e = inbox_take(in); e != NULL; e = next ) {
+    next = e->next;
+    inbox_entry_free(e);
+  }
 }
@@ -1,17 +1,52 @@
+#ifndef stack_h
+#define stack_h
+
 #include <stdbool.h>
 
-#define STACK_MAX 100
+#define STACK_MAX 65536
+#define DEQUE_MIN 8		/* slots to start with */
+
+struct Deque {
+  /* Items in a ring, the top at <ring>[<head>], the bottom <len> - 1
+     slots after it.  They are the caller's, to allocate and free. */
+  void **ring;
+  int cap;			/* slots in <ring>; a power of two, or 0 */
+  int head, len;
+};
 
-typedef struct StackNode {
+struct InboxEntry {
+  char *name;			/* of the stack it is for */
   char *dat;
-  struct StackNode *next;
-} Node;
+  struct InboxEntry *next;
+};
+
+struct Inbox {
+  /* Strings pushed from any thread without a lock, to be taken all at
+     once by whichever owns where they go.  A Treiber stack: a push swings
+     <top> to its entry by compare-and-swap, and a take swaps in NULL, so
+     no entry is looked at by one thread once another could have freed
+     it, and nothing more is needed to reclaim them. */
+  struct InboxEntry *top;
+  int len;
+};
+
+
+void deque_init(struct Deque *dq);
+void deque_push(struct Deque *dq, void *dat);
+void deque_unshift(struct Deque *dq, void *dat);
+void *deque_pop(struct Deque *dq);
+void *deque_shift(struct Deque *dq);
+void *deque_nth(struct Deque *dq, int n);
+bool deque_insert(struct Deque *dq, int n, void *dat);
+void *deque_remove(struct Deque *dq, int n);
+void deque_rotate(struct Deque *dq, int n);
+bool deque_swap(struct Deque *dq);
+void deque_free(struct Deque *dq);
 
+void inbox_init(struct Inbox *in);
+bool inbox_push(struct Inbox *in, const char *name, const char *dat, int max);
+struct InboxEntry *inbox_take(struct Inbox *in);
+void inbox_entry_free(struct InboxEntry *e);
+void inbox_free(struct Inbox *in);
 
-Node **stack_new();
-void stack_push(char *dat, Node **stack);
-bool stack_drop(Node **stack);
-char *stack_peek(Node **stack);
-char *stack_nth(int n, Node **stack);
-int stack_len(Node **stack);
-void stack_free(Node **stack);
+#endif
@@ -0,0 +1,348 @@
+/* Keep any number of named stacks in one daemon, found by name in
+   constant time. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "fls.h"
+#include "comm.h"
+#include "stacktab.h"
+#include "watch.h"
+
+
+static char *path_base(char *path, char *buf) {
+  /* Return the last part of <path>, in <buf> if need be, without the
+     slash a directory ends with. */
+  char *end=path + strlen(path), *base;
+
+  if( end > path + 1 && end[-1] == '/' )
+    end--;
+  for( base = end; base > path && base[-1] != '/'; base-- )
+    ;
+  if( *end == '\0' )
+    return base;
+  memcpy(buf, base, end - base);
+  buf[end - base] = '\0';
+  return buf;
+}
+
+static size_t node_bytes(char *dat) {
+  /* the slot, the entry with the directories it's in, and the most it
+     can add to the indexes: the name, and the name with any slash */
+  char buf[strlen(dat) + 1];
+
+  return sizeof(void *) + pathtrie_cost(dat)
+    + 2 * (sizeof(struct PathRef) + strlen(path_base(dat, buf)) + 2);
+}
+
+static void index_add(struct Stack *st, struct PathEntry *e, char *dat) {
+  /* Count <e>, whose path is <dat>, in <st>'s indexes. */
+  char buf[strlen(dat) + 1];
+
+  pathidx_add(&st->paths, e->dir, e->base);
+  if( pathidx_add(&st->names, NULL, path_base(dat, buf)) == 2 )
+    st->clashes++;
+  watch_add(dat);
+}
+
+static void index_del(struct Stack *st, struct PathEntry *e, char *dat) {
+  char buf[strlen(dat) + 1];
+
+  pathidx_del(&st->paths, e->dir, e->base);
+  if( pathidx_del(&st->names, NULL, path_base(dat, buf)) == 1 )
+    st->clashes--;
+  watch_del(dat);
+}
+
+static size_t stack_bytes(char *name) {
+  return sizeof(struct Stack) + strlen(name) + 1;
+}
+
+static size_t fd_bucket(struct PathEntry *entry, size_t nbucket) {
+  /* entries are told apart by where they are, not what they say */
+  return ((uintptr_t)entry >> 4) * 0x9e3779b97f4a7c15ull >> 32 & (nbucket - 1);
+}
+
+static bool fd_hold(struct Stack *st, struct PathEntry *entry, int fd) {
+  /* Keep <fd> for <entry>.  Return false if there's no room to. */
+  struct FdRef **buckets, *ref, *next;
+  size_t nbucket, i, b;
+
+  if( st->nfds >= st->nfdbucket ) {
+    nbucket = st->nfdbucket ? st->nfdbucket * 2 : FDREF_MIN;
+    buckets = calloc(nbucket, sizeof(*buckets));
+    if( buckets == NULL )
+      return false;
+    for( i = 0; i < st->nfdbucket; i++ ) {
+      for( ref = st->fds[i]; ref != NULL; ref = next ) {
+	next = ref->next;
+	b = fd_bucket(ref->entry, nbucket);
+	ref->next = buckets[b];
+	buckets[b] = ref;
+      }
+    }
+    free(st->fds);
+    st->fds = buckets;
+    st->nfdbucket = nbucket;
+  }
+  ref = malloc(sizeof(*ref));
+  if( ref == NULL )
+    return false;
+  b = fd_bucket(entry, st->nfdbucket);
+  *ref = (struct FdRef){entry, fd, st->fds[b]};
+  st->fds[b] = ref;
+  st->nfds++;
+  return true;
+}
+
+static struct FdRef **fd_find(struct Stack *st, struct PathEntry *entry) {
+  /* Return the link to <entry>'s descriptor, or NULL if it has none. */
+  struct FdRef **link;
+
+  if( st->nfds == 0 )
+    return NULL;
+  link = &st->fds[fd_bucket(entry, st->nfdbucket)];
+  for( ; *link != NULL; link = &(*link)->next ) {
+    if( (*link)->entry == entry )
+      return link;
+  }
+  return NULL;
+}
+
+static int fd_drop(struct Stack *st, struct PathEntry *entry) {
+  /* Forget <entry>'s descriptor, and return it, or -1 if it had none. */
+  struct FdRef **link=fd_find(st, entry), *ref;
+  int fd;
+
+  if( link == NULL )
+    return -1;
+  ref = *link;
+  *link = ref->next;
+  fd = ref->fd;
+  free(ref);
+  st->nfds--;
+  return fd;
+}
+
+static void tab_grow(struct StackTab *tab) {
+  /* Double the buckets once <tab> is more than three-quarters full. */
+  struct Stack **buckets, *st, *next;
+  size_t nbucket, i, b;
+
+  if( tab->len * 4 < tab->nbucket * 3 )
+    return;
+  nbucket = tab->nbucket * 2;
+  buckets = calloc(nbucket, sizeof(*buckets));
+  if( buckets == NULL )
+    return;		/* longer chains, but still correct */
+  for( i = 0; i < tab->nbucket; i++ ) {
+    for( st = tab->buckets[i]; st != NULL; st = next ) {
+      next = st->next;
+      b = str_hash(st->name) & (nbucket - 1);
+      st->next = buckets[b];
+      buckets[b] = st;
+    }
+  }
+  free(tab->buckets);
+  tab->buckets = buckets;
+  tab->nbucket = nbucket;
+}
+
+
+void stacktab_init(struct StackTab *tab, size_t max_len, size_t max_bytes,
+		   size_t max_fds) {
+  /* Set up <tab> with no stacks in it, to hold no more than <max_len>
+     stacks, <max_bytes> bytes and <max_fds> descriptors. */
+
+  tab->nbucket = STACKTAB_MIN;
+  tab->buckets = xmalloc(tab->nbucket * sizeof(*tab->buckets));
+  memset(tab->buckets, 0, tab->nbucket * sizeof(*tab->buckets));
+  tab->len = 0;
+  tab->bytes = 0;
+  tab->max_len = max_len;
+  tab->max_bytes = max_bytes;
+  tab->fds = 0;
+  tab->max_fds = max_fds;
+}
+
+struct Stack *stacktab_get(struct StackTab *tab, char *name) {
+  /* Return the stack called <name>, or NULL if there isn't one. */
+  struct Stack *st;
+
+  for( st = tab->buckets[str_hash(name) & (tab->nbucket - 1)]; st != NULL; st = st->next ) {
+    if( strcmp(st->name, name) == 0 )
+      return st;
+  }
+  return NULL;
+}
+
+struct Stack *stacktab_create(struct StackTab *tab, char *name) {
+  /* Add an empty stack called <name>, and return it.
+     Return NULL if there is one already, or no room for another. */
+  struct Stack *st;
+  size_t b;
+
+  if( stacktab_get(tab, name) != NULL || tab->len >= tab->max_len
+      || tab->bytes + stack_bytes(name) > tab->max_bytes )
+    return NULL;
+  tab_grow(tab);
+  st = xmalloc(sizeof(*st));
+  st->name = xstrdup(name);
+  deque_init(&st->dq);
+  pathidx_init(&st->paths);
+  pathidx_init(&st->names);
+  st->clashes = 0;
+  st->unique = false;
+  st->fds = NULL;
+  st->nfdbucket = st->nfds = 0;
+  st->bytes = 0;
+  b = str_hash(name) & (tab->nbucket - 1);
+  st->next = tab->buckets[b];
+  tab->buckets[b] = st;
+  tab->len++;
+  tab->bytes += stack_bytes(name);
+  return st;
+}
+
+bool stacktab_destroy(struct StackTab *tab, char *name) {
+  /* Remove the stack called <name>, and everything in it.
+     Return false if there was no such stack. */
+  struct Stack **link, *st;
+  struct FdRef *ref;
+  struct PathEntry *e;
+  char buf[FILEPATH_MAX];
+  size_t i;
+
+  link = &tab->buckets[str_hash(name) & (tab->nbucket - 1)];
+  while( *link != NULL && strcmp((*link)->name, name) != 0 )
+    link = &(*link)->next;
+  if( *link == NULL )
+    return false;
+  st = *link;
+  *link = st->next;
+  for( i = 0; i < st->nfdbucket; i++ ) {
+    while( (ref = st->fds[i]) != NULL ) {
+      st->fds[i] = ref->next;
+      close(ref->fd);
+      free(ref);
+    }
+  }
+  free(st->fds);
+  tab->fds -= st->nfds;
+  pathidx_free(&st->paths);
+  pathidx_free(&st->names);
+  /* it's out of <tab> already, so none of it counts as stacked */
+  while( (e = deque_pop(&st->dq)) != NULL ) {
+    watch_del(pathtrie_path(e, buf));
+    pathtrie_release(e);
+  }
+  deque_free(&st->dq);
+  tab->bytes -= st->bytes;
+  tab->len--;
+  tab->bytes -= stack_bytes(st->name);
+  free(st->name);
+  free(st);
+  return true;
+}
+
+bool stacktab_insert(struct StackTab *tab, struct Stack *st, int n, char *dat,
+		     int fd) {
+  /* Put <dat> in <st> as its <n>th item from the top (or from the
+     bottom, counting from -1, if <n> is negative), counting it against
+     <tab>, and hold on to <fd> for it unless that is -1.
+     Return false if that would go over <tab>'s quota, or <st> isn't that
+     deep; <fd> is still the caller's then. */
+  size_t bytes=node_bytes(dat) + (fd != -1 ? sizeof(struct FdRef) : 0);
+  struct PathEntry *e;
+
+  if( tab->bytes + bytes > tab->max_bytes
+      || (fd != -1 && tab->fds >= tab->max_fds)
+      || (e = pathtrie_intern(dat)) == NULL )
+    return false;
+  if( !deque_insert(&st->dq, n, e) ) {
+    pathtrie_release(e);
+    return false;
+  }
+  if( fd != -1 ) {
+    if( !fd_hold(st, e, fd) ) {
+      deque_remove(&st->dq, n);
+      pathtrie_release(e);
+      return false;
+    }
+    tab->fds++;
+  }
+  index_add(st, e, dat);
+  st->bytes += bytes;
+  tab->bytes += bytes;
+  return true;
+}
+
+char *stacktab_remove(struct StackTab *tab, struct Stack *st, int n) {
+  /* Take the <n>th item out of <st>, counting as stacktab_insert() does.
+     Return its path, for the caller to free, or NULL if <st> isn't that
+     deep. */
+  struct PathEntry *e=deque_remove(&st->dq, n);
+  char buf[FILEPATH_MAX], *dat;
+  size_t bytes;
+  int fd;
+
+  if( e == NULL )
+    return NULL;
+  dat = xstrdup(pathtrie_path(e, buf));
+  index_del(st, e, dat);
+  bytes = node_bytes(dat);
+  fd = fd_drop(st, e);
+  if( fd != -1 ) {
+    close(fd);
+    bytes += sizeof(struct FdRef);
+    tab->fds--;
+  }
+  st->bytes -= bytes;
+  tab->bytes -= bytes;
+  pathtrie_release(e);
+  return dat;
+}
+
+int stacktab_fd(struct Stack *st, int n) {
+  /* Return the descriptor held for the <n>th item in <st>, counting as
+     deque_nth() does, or -1 if there is none. */
+  struct PathEntry *e=deque_nth(&st->dq, n);
+  struct FdRef **link;
+
+  if( e == NULL || (link = fd_find(st, e)) == NULL )
+    return -1;
+  return (*link)->fd;
+}
+
+char *stacktab_path(struct Stack *st, int n, char *buf) {
+  /* Put the path of the <n>th item in <st>, counting as deque_nth()
+     does, in <buf> of FILEPATH_MAX bytes, and return it; or return NULL
+     if <st> isn't that deep. */
+  struct PathEntry *e=deque_nth(&st->dq, n);
+
+  return e == NULL ? NULL : pathtrie_path(e, buf);
+}
+
+int stacktab_count(struct Stack *st, const char *path) {
+  /* Return how many times <path> is in <st>.  It's looked up in the trie
+     every table shares, so this goes under whatever lock changes to any
+     of them do. */
+  struct PathDir *dir;
+  const char *base;
+
+  if( !pathtrie_find(path, &dir, &base) )
+    return 0;
+  return pathidx_count(&st->paths, dir, base);
+}
+
+void stacktab_free(struct StackTab *tab) {
+  /* Destroy every stack in <tab>. */
+  size_t i;
+
+  for( i = 0; i < tab->nbucket; i++ ) {
+    while( tab->buckets[i] != NULL )
+      stacktab_destroy(tab, tab->buckets[i]->name);
+  }
+  free(tab->buckets);
+}
@@ -0,0 +1,58 @@
+#ifndef stacktab_h
+#define stacktab_h
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "stack.h"
+#include "pathidx.h"
+#include "pathtrie.h"
+
+#define STACKTAB_MAX 65536		/* stacks in one daemon */
+#define STACKTAB_BYTES_MAX (64 << 20)	/* held by all of them together */
+#define USER_STACKS_MAX 1024		/* the same, for each user of a system daemon */
+#define USER_BYTES_MAX (4 << 20)
+#define USER_FDS_MAX 256		/* descriptors held for each user of a system daemon */
+#define STACKTAB_MIN 64			/* buckets to start with */
+#define FDREF_MIN 16
+
+struct FdRef {
+  struct PathEntry *entry;	/* the one in the stack it was pushed with */
+  int fd;			/* O_PATH, so it follows the file if it's renamed */
+  struct FdRef *next;		/* in the same bucket */
+};
+
+struct Stack {
+  char *name;			/* "" for the default stack */
+  struct Deque dq;		/* of PathEntry */
+  struct PathIdx paths;		/* how many times each path is in <dq>, by directory */
+  struct PathIdx names;		/* and each path's last part */
+  int clashes;			/* names in more than once */
+  bool unique;			/* refuse a path that is in already */
+  struct FdRef **fds;		/* descriptors held for entries, by entry */
+  size_t nfdbucket, nfds;
+  size_t bytes;			/* held by its paths, their slots and indexes */
+  struct Stack *next;		/* in the same bucket */
+};
+
+struct StackTab {
+  struct Stack **buckets;
+  size_t nbucket, len;
+  size_t bytes;			/* held by every stack, names included */
+  size_t fds;			/* descriptors held for every stack */
+  size_t max_len, max_bytes, max_fds;	/* the quota on those */
+};
+
+void stacktab_init(struct StackTab *tab, size_t max_len, size_t max_bytes,
+		   size_t max_fds);
+struct Stack *stacktab_get(struct StackTab *tab, char *name);
+struct Stack *stacktab_create(struct StackTab *tab, char *name);
+bool stacktab_destroy(struct StackTab *tab, char *name);
+bool stacktab_insert(struct StackTab *tab, struct Stack *st, int n, char *dat,
+		     int fd);
+int stacktab_fd(struct Stack *st, int n);
+char *stacktab_path(struct Stack *st, int n, char *buf);
+int stacktab_count(struct Stack *st, const char *path);
+char *stacktab_remove(struct StackTab *tab, struct Stack *st, int n);
+void stacktab_free(struct StackTab *tab);
+
+#endif
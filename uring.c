@@ -0,0 +1,541 @@
+/* Copy files asynchronously through io_uring, driven with raw system
+   calls so there is nothing to link against. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "fls.h"
+#include "uring.h"
+
+enum UringOp {
+  OP_OPEN_IN,
+  OP_OPEN_OUT,
+  OP_READ,
+  OP_WRITE,
+  OP_CLOSE,
+};
+
+struct Ring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+  unsigned entries, queued;
+};
+
+struct Slot {
+  /* One file being copied. */
+  struct UringJob *job;
+  char *buf;
+  int in, out[URING_DEST_MAX];
+  int inflight;			/* operations the kernel still owns */
+  int writing;			/* destinations still writing this chunk */
+  int err;
+  off_t off;			/* start of the current chunk */
+  unsigned len;			/* of the current chunk */
+  unsigned done[URING_DEST_MAX]; /* how much of it each has written */
+};
+
+struct Uring {
+  struct Ring ring;
+  struct Slot slots[URING_SLOTS];
+  char *bufs;
+  int bufsize;
+  int busy;			/* slots in use */
+  unsigned inflight;		/* sqes submitted, cqes not yet seen */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t room;		/* for submitters, when the queue is full */
+  struct UringJob *head, *tail;
+  int queued;			/* jobs between head and tail */
+  bool closing;
+  int broken;			/* errno value, once the ring stops working */
+};
+
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nargs) {
+  return syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+
+static void ring_free(struct Ring *ring) {
+  if( ring->sqes != NULL && ring->sqes != MAP_FAILED )
+    munmap(ring->sqes, ring->sqes_len);
+  if( ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED
+      && ring->cq_ptr != ring->sq_ptr )
+    munmap(ring->cq_ptr, ring->cq_len);
+  if( ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED )
+    munmap(ring->sq_ptr, ring->sq_len);
+  if( ring->fd != -1 )
+    close(ring->fd);
+}
+
+static bool ring_init(struct Ring *ring, unsigned entries) {
+  /* Set up and map an io_uring with <entries> submission slots.
+     Return false if the kernel won't give us one. */
+  struct io_uring_params p;
+  char *sq, *cq;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&p, 0, sizeof(p));
+  ring->fd = sys_setup(entries, &p);
+  if( ring->fd == -1 )
+    return false;
+
+  ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+    if( ring->cq_len > ring->sq_len )
+      ring->sq_len = ring->cq_len;
+    ring->cq_len = ring->sq_len;
+  }
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ|PROT_WRITE,
+		      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if( ring->sq_ptr == MAP_FAILED )
+    goto fail;
+  if( p.features & IORING_FEAT_SINGLE_MMAP )
+    ring->cq_ptr = ring->sq_ptr;
+  else {
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if( ring->cq_ptr == MAP_FAILED )
+      goto fail;
+  }
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if( ring->sqes == MAP_FAILED )
+    goto fail;
+
+  sq = ring->sq_ptr;
+  cq = ring->cq_ptr;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  ring->entries = p.sq_entries;
+  return true;
+
+ fail:
+  ring_free(ring);
+  return false;
+}
+
+static bool ring_supports(struct Ring *ring, int *ops, int nops) {
+  /* Return whether the kernel knows every opcode in <ops>. */
+  struct io_uring_probe *probe;
+  size_t len=sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+  bool okay=true;
+  int i;
+
+  probe = calloc(1, len);
+  if( probe == NULL )
+    return false;
+  if( sys_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == -1 )
+    okay = false;
+  for( i = 0; okay && i < nops; i++ ) {
+    if( ops[i] > probe->last_op
+	|| !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) )
+      okay = false;
+  }
+  free(probe);
+  return okay;
+}
+
+static int ring_submit(struct Ring *ring, unsigned wait) {
+  /* Hand queued sqes to the kernel, and wait for <wait> completions. */
+  int n;
+
+  do {
+    n = sys_enter(ring->fd, ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+  } while( n == -1 && errno == EINTR );
+  if( n >= 0 )
+    ring->queued -= n;
+  return n;
+}
+
+static struct io_uring_sqe *ring_sqe(struct Ring *ring) {
+  /* Return a blank sqe at the tail of the submission queue. */
+  unsigned tail=*ring->sq_tail, index;
+  struct io_uring_sqe *sqe;
+
+  while( tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries ) {
+    if( ring_submit(ring, 0) == -1 )
+      return NULL;
+  }
+  index = tail & *ring->sq_mask;
+  sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued++;
+  return sqe;
+}
+
+
+static struct io_uring_sqe *slot_prep(struct Uring *u, struct Slot *slot,
+				      enum UringOp op, int d) {
+  /* Queue the next operation <op> for <slot> (and its destination <d>),
+     and return its sqe. */
+  struct io_uring_sqe *sqe=ring_sqe(&u->ring);
+  int index=slot - u->slots;
+
+  if( sqe == NULL ) {
+    /* the ring is broken; nothing more will complete for this slot */
+    u->broken = errno;
+    if( slot->err == 0 )
+      slot->err = errno;
+    return NULL;
+  }
+  sqe->user_data = (uint64_t)index << 16 | d << 8 | op;
+  switch( op ) {
+  case OP_OPEN_IN:
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = slot->job->srcdir;
+    sqe->addr = (uintptr_t)slot->job->srcname;
+    sqe->open_flags = O_RDONLY|O_NOFOLLOW|O_CLOEXEC;
+    break;
+  case OP_OPEN_OUT:
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = slot->job->dstdir[d];
+    sqe->addr = (uintptr_t)slot->job->dstname;
+    sqe->open_flags = O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC;
+    sqe->len = slot->job->mode & 07777;
+    break;
+  case OP_READ:
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = slot->in;
+    sqe->addr = (uintptr_t)slot->buf;
+    sqe->len = u->bufsize;
+    sqe->off = slot->off;
+    sqe->buf_index = index;
+    break;
+  case OP_WRITE:
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = slot->out[d];
+    sqe->addr = (uintptr_t)(slot->buf + slot->done[d]);
+    sqe->len = slot->len - slot->done[d];
+    sqe->off = slot->off + slot->done[d];
+    sqe->buf_index = index;
+    break;
+  case OP_CLOSE:
+    /* the fd to close is filled in by the caller */
+    sqe->opcode = IORING_OP_CLOSE;
+    break;
+  }
+  slot->inflight++;
+  u->inflight++;
+  return sqe;
+}
+
+static void slot_close_fd(struct Uring *u, struct Slot *slot, int d, int *fd) {
+  /* Close <fd> (for destination <d>) through the ring if we still can. */
+  struct io_uring_sqe *sqe;
+
+  if( *fd == -1 )
+    return;
+  sqe = slot_prep(u, slot, OP_CLOSE, d);
+  if( sqe != NULL )
+    sqe->fd = *fd;
+  else
+    close(*fd);
+  *fd = -1;
+}
+
+static void slot_close(struct Uring *u, struct Slot *slot) {
+  /* Close whatever <slot> has open; the job is done when they are. */
+  int d;
+
+  slot_close_fd(u, slot, 0, &slot->in);
+  for( d = 0; d < slot->job->ndst; d++ )
+    slot_close_fd(u, slot, d, &slot->out[d]);
+}
+
+static void slot_start(struct Uring *u, struct Slot *slot, struct UringJob *job) {
+  int d;
+
+  slot->job = job;
+  slot->in = -1;
+  slot->err = 0;
+  slot->off = 0;
+  slot->len = 0;
+  slot->writing = 0;
+  slot_prep(u, slot, OP_OPEN_IN, 0);
+  for( d = 0; d < job->ndst; d++ ) {
+    slot->out[d] = -1;
+    slot_prep(u, slot, OP_OPEN_OUT, d);
+  }
+  u->busy++;
+}
+
+static void slot_complete(struct Uring *u, struct Slot *slot, enum UringOp op,
+			  int d, int res) {
+  /* Move <slot> along after operation <op> on destination <d> finished
+     with <res>. */
+  int i;
+
+  slot->inflight--;
+  if( op == OP_WRITE && res == 0 )
+    res = -EIO;			/* would spin forever */
+  if( res < 0 && slot->err == 0 )
+    slot->err = -res;
+
+  switch( op ) {
+  case OP_OPEN_IN:
+  case OP_OPEN_OUT:
+    if( res >= 0 )
+      *(op == OP_OPEN_IN ? &slot->in : &slot->out[d]) = res;
+    if( slot->inflight > 0 )
+      return;			/* wait for the others */
+    if( slot->err == 0 )
+      slot_prep(u, slot, OP_READ, 0);
+    else
+      slot_close(u, slot);
+    break;
+  case OP_READ:
+    if( res <= 0 ) {
+      slot_close(u, slot);
+      break;
+    }
+    /* every destination writes from the same buffer at once */
+    slot->len = res;
+    slot->writing = slot->job->ndst;
+    for( i = 0; i < slot->job->ndst; i++ ) {
+      slot->done[i] = 0;
+      slot_prep(u, slot, OP_WRITE, i);
+    }
+    if( slot->job->hash != NULL )
+      hash_update(slot->job->hash, slot->buf, res);
+    break;
+  case OP_WRITE:
+    if( res > 0 )
+      slot->done[d] += res;
+    if( slot->err == 0 && slot->done[d] < slot->len ) {
+      slot_prep(u, slot, OP_WRITE, d);
+      break;
+    }
+    if( --slot->writing > 0 )
+      break;			/* wait for the other destinations */
+    if( slot->err != 0 ) {
+      slot_close(u, slot);
+    } else {
+      slot->off += slot->len;
+      slot_prep(u, slot, OP_READ, 0);
+    }
+    break;
+  case OP_CLOSE:
+    break;
+  }
+
+  if( slot->inflight == 0 ) {
+    struct UringJob *job = slot->job;
+    slot->job = NULL;
+    u->busy--;
+    job->done(job, slot->err, slot->off);
+  }
+}
+
+static struct UringJob *uring_next(struct Uring *u, bool wait) {
+  /* Take the next queued job, waiting for one if <wait>.
+     Return NULL if there is none (or we are closing down). */
+  struct UringJob *job;
+
+  pthread_mutex_lock(&u->lock);
+  while( wait && u->head == NULL && !u->closing )
+    pthread_cond_wait(&u->cond, &u->lock);
+  job = u->head;
+  if( job != NULL ) {
+    u->head = job->next;
+    if( u->head == NULL )
+      u->tail = NULL;
+    u->queued--;
+    pthread_cond_signal(&u->room);
+  }
+  pthread_mutex_unlock(&u->lock);
+  return job;
+}
+
+static void uring_fail(struct Uring *u) {
+  /* The ring is broken: fail every job, running or still to come, with
+     u->broken, closing what they have open ourselves. */
+  struct UringJob *job;
+  int i, d;
+
+  fprintf(stderr, "uring: %s, giving up on the ring\n", strerror(u->broken));
+  for( i = 0; i < URING_SLOTS; i++ ) {
+    struct Slot *slot=&u->slots[i];
+    if( slot->job == NULL )
+      continue;
+    if( slot->in != -1 )
+      close(slot->in);
+    for( d = 0; d < slot->job->ndst; d++ ) {
+      if( slot->out[d] != -1 )
+	close(slot->out[d]);
+    }
+    job = slot->job;
+    slot->job = NULL;
+    job->done(job, u->broken, slot->off);
+  }
+  u->busy = 0;
+  while( (job = uring_next(u, true)) != NULL )
+    job->done(job, u->broken, 0);
+}
+
+static void *uring_run(void *arg) {
+  /* Keep every slot busy until we are told to close and run dry. */
+  struct Uring *u=arg;
+  struct io_uring_cqe *cqe;
+  int i;
+
+  while(1) {
+    for( i = 0; i < URING_SLOTS && u->busy < URING_SLOTS; i++ ) {
+      struct UringJob *job;
+      if( u->slots[i].job != NULL )
+	continue;
+      /* only sleep when there's nothing for the kernel to do */
+      job = uring_next(u, u->busy == 0);
+      if( job == NULL )
+	break;
+      slot_start(u, &u->slots[i], job);
+    }
+    if( u->broken == 0 && u->busy > 0 && ring_submit(&u->ring, 1) == -1 )
+      u->broken = errno;
+    if( u->broken != 0 ) {
+      uring_fail(u);
+      break;
+    }
+    if( u->busy == 0 )
+      break;			/* closing, and nothing left */
+
+    while( *u->ring.cq_head != __atomic_load_n(u->ring.cq_tail, __ATOMIC_ACQUIRE) ) {
+      unsigned head = *u->ring.cq_head;
+      uint64_t data;
+      int res;
+      cqe = &u->ring.cqes[head & *u->ring.cq_mask];
+      data = cqe->user_data;
+      res = cqe->res;
+      __atomic_store_n(u->ring.cq_head, head + 1, __ATOMIC_RELEASE);
+      u->inflight--;
+      slot_complete(u, &u->slots[data >> 16], data & 0xff, (data >> 8) & 0xff, res);
+    }
+  }
+  return NULL;
+}
+
+
+struct Uring *uring_start(int bufsize) {
+  /* Start an io_uring copy engine with <bufsize> byte buffers.
+     Return NULL if the kernel can't do it, so the caller can fall back. */
+  int ops[]={IORING_OP_OPENAT, IORING_OP_READ_FIXED,
+	     IORING_OP_WRITE_FIXED, IORING_OP_CLOSE};
+  struct iovec iov[URING_SLOTS];
+  struct Uring *u;
+  int i;
+
+  u = calloc(1, sizeof(*u));
+  if( u == NULL )
+    return NULL;
+  u->ring.fd = -1;
+  if( !ring_init(&u->ring, URING_ENTRIES) )
+    goto fail;
+  if( !ring_supports(&u->ring, ops, sizeof(ops) / sizeof(*ops)) )
+    goto fail;
+
+  u->bufsize = bufsize;
+  u->bufs = mmap(NULL, (size_t)bufsize * URING_SLOTS, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if( u->bufs == MAP_FAILED ) {
+    u->bufs = NULL;
+    goto fail;
+  }
+  for( i = 0; i < URING_SLOTS; i++ ) {
+    u->slots[i].buf = u->bufs + (size_t)i * bufsize;
+    iov[i].iov_base = u->slots[i].buf;
+    iov[i].iov_len = bufsize;
+  }
+  if( sys_register(u->ring.fd, IORING_REGISTER_BUFFERS, iov, URING_SLOTS) == -1 )
+    goto fail;
+
+  pthread_mutex_init(&u->lock, NULL);
+  pthread_cond_init(&u->cond, NULL);
+  pthread_cond_init(&u->room, NULL);
+  if( pthread_create(&u->thread, NULL, uring_run, u) != 0 ) {
+    pthread_cond_destroy(&u->room);
+    pthread_cond_destroy(&u->cond);
+    pthread_mutex_destroy(&u->lock);
+    goto fail;
+  }
+  return u;
+
+ fail:
+  if( verbose )
+    printf("uring: unavailable (%s), using synchronous copy\n", strerror(errno));
+  if( u->bufs != NULL )
+    munmap(u->bufs, (size_t)bufsize * URING_SLOTS);
+  ring_free(&u->ring);
+  free(u);
+  return NULL;
+}
+
+void uring_submit(struct Uring *u, struct UringJob *job) {
+  /* Queue <job> for the engine, waiting while URING_QUEUE_MAX are queued
+     already, as each holds its directories open.  Safe to call from any
+     thread but the engine's. */
+
+  job->next = NULL;
+  pthread_mutex_lock(&u->lock);
+  while( u->queued >= URING_QUEUE_MAX )
+    pthread_cond_wait(&u->room, &u->lock);
+  u->queued++;
+  if( u->tail == NULL )
+    u->head = job;
+  else
+    u->tail->next = job;
+  u->tail = job;
+  pthread_cond_signal(&u->cond);
+  pthread_mutex_unlock(&u->lock);
+}
+
+void uring_finish(struct Uring *u) {
+  /* Wait for every submitted job to finish, and tear the engine down. */
+
+  pthread_mutex_lock(&u->lock);
+  u->closing = true;
+  pthread_cond_signal(&u->cond);
+  pthread_mutex_unlock(&u->lock);
+  pthread_join(u->thread, NULL);
+
+  pthread_cond_destroy(&u->room);
+  pthread_cond_destroy(&u->cond);
+  pthread_mutex_destroy(&u->lock);
+  munmap(u->bufs, (size_t)u->bufsize * URING_SLOTS);
+  ring_free(&u->ring);
+  free(u);
+}
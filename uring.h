@@ -0,0 +1,31 @@
+#ifndef uring_h
+#define uring_h
+
+#include <sys/types.h>
+#include "hash.h"
+
+#define URING_SLOTS 32		/* files in flight, one registered buffer each */
+#define URING_ENTRIES 256
+#define URING_QUEUE_MAX (4 * URING_SLOTS) /* jobs waiting for a slot */
+#define URING_DEST_MAX 8
+
+struct UringJob {
+  /* Copy <srcname> in <srcdir> to a new <dstname> in each of the <ndst>
+     <dstdir>s, reading it only once.
+     <done> is called from the engine thread with 0 or an errno value,
+     and the number of bytes copied. */
+  int srcdir, dstdir[URING_DEST_MAX], ndst;
+  char *srcname, *dstname;
+  mode_t mode;
+  struct Hash *hash;		/* fed everything read, if not NULL */
+  void (*done)(struct UringJob *job, int err, long bytes);
+  struct UringJob *next;
+};
+
+struct Uring;
+
+struct Uring *uring_start(int bufsize);
+void uring_submit(struct Uring *u, struct UringJob *job);
+void uring_finish(struct Uring *u);
+
+#endif
@@ -0,0 +1,480 @@
+/* Keep track, through inotify, of stacked files that have been deleted or
+   renamed since they were pushed, so they can be found out before a pop
+   starts rather than halfway through it.
+   Each directory with something stacked in it has one watch, however
+   many entries share it; the entries themselves cost nothing here.  Only
+   those an event has touched get a mark, saying where they went. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "watch.h"
+#include "pathidx.h"
+
+#define DIR_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+		    | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct WatchDir {
+  char *path;			/* ending in a slash */
+  int wd;			/* or -1 once the watch is gone */
+  int count;			/* stacked entries in it */
+  bool unsure;			/* events may have been missed */
+  struct WatchDir *next;	/* in the same bucket, by path */
+  struct WatchDir *wd_next;	/* and by watch */
+};
+
+struct Mark {
+  char *path;
+  char *now;			/* where it was renamed to, or NULL if gone */
+  struct Mark *next;		/* in the same bucket */
+};
+
+struct Table {
+  void **buckets;
+  size_t nbucket, len;
+};
+
+static int ifd=-1;
+static bool (*is_stacked)(const char *path);
+static struct Table dirs, wds, marks;
+static size_t nunsure;
+static bool unsure_all;		/* the queue overflowed, and nobody looked since */
+static bool overflowed;		/* since watch_read() last said */
+static uint32_t from_cookie;	/* the last IN_MOVED_FROM, to pair with its IN_MOVED_TO */
+static char *from_path;
+
+
+static bool table_init(struct Table *t) {
+  t->nbucket = WATCH_MIN;
+  t->len = 0;
+  t->buckets = calloc(t->nbucket, sizeof(*t->buckets));
+  return t->buckets != NULL;
+}
+
+static struct WatchDir **dir_link(const char *path) {
+  /* Return the link to the directory <path>, or to the NULL at the end of
+     its bucket. */
+  struct WatchDir **link;
+
+  link = (struct WatchDir **)&dirs.buckets[str_hash(path) & (dirs.nbucket - 1)];
+  while( *link != NULL && strcmp((*link)->path, path) != 0 )
+    link = &(*link)->next;
+  return link;
+}
+
+static struct WatchDir **wd_link(int wd) {
+  /* The same, for the directory watched by <wd>. */
+  struct WatchDir **link;
+
+  link = (struct WatchDir **)&wds.buckets[(size_t)wd & (wds.nbucket - 1)];
+  while( *link != NULL && (*link)->wd != wd )
+    link = &(*link)->wd_next;
+  return link;
+}
+
+static struct Mark **mark_link(const char *path) {
+  struct Mark **link;
+
+  link = (struct Mark **)&marks.buckets[str_hash(path) & (marks.nbucket - 1)];
+  while( *link != NULL && strcmp((*link)->path, path) != 0 )
+    link = &(*link)->next;
+  return link;
+}
+
+static void dirs_grow(void) {
+  /* Double the buckets of both directory tables once they are more than
+     three-quarters full. */
+  void **by_path, **by_wd;
+  struct WatchDir *d, *next;
+  size_t nbucket, i, b;
+
+  if( dirs.len * 4 < dirs.nbucket * 3 )
+    return;
+  nbucket = dirs.nbucket * 2;
+  by_path = calloc(nbucket, sizeof(*by_path));
+  by_wd = calloc(nbucket, sizeof(*by_wd));
+  if( by_path == NULL || by_wd == NULL ) {
+    free(by_path);
+    free(by_wd);
+    return;		/* longer chains, but still correct */
+  }
+  for( i = 0; i < dirs.nbucket; i++ ) {
+    for( d = dirs.buckets[i]; d != NULL; d = next ) {
+      next = d->next;
+      b = str_hash(d->path) & (nbucket - 1);
+      d->next = by_path[b];
+      by_path[b] = d;
+    }
+    for( d = wds.buckets[i]; d != NULL; d = next ) {
+      next = d->wd_next;
+      b = (size_t)d->wd & (nbucket - 1);
+      d->wd_next = by_wd[b];
+      by_wd[b] = d;
+    }
+  }
+  free(dirs.buckets);
+  free(wds.buckets);
+  dirs.buckets = by_path;
+  wds.buckets = by_wd;
+  dirs.nbucket = wds.nbucket = nbucket;
+}
+
+static void marks_grow(void) {
+  void **buckets;
+  struct Mark *m, *next;
+  size_t nbucket, i, b;
+
+  if( marks.len * 4 < marks.nbucket * 3 )
+    return;
+  nbucket = marks.nbucket * 2;
+  buckets = calloc(nbucket, sizeof(*buckets));
+  if( buckets == NULL )
+    return;
+  for( i = 0; i < marks.nbucket; i++ ) {
+    for( m = marks.buckets[i]; m != NULL; m = next ) {
+      next = m->next;
+      b = str_hash(m->path) & (nbucket - 1);
+      m->next = buckets[b];
+      buckets[b] = m;
+    }
+  }
+  free(marks.buckets);
+  marks.buckets = buckets;
+  marks.nbucket = nbucket;
+}
+
+static bool parent(const char *path, char *dir) {
+  /* Put the directory <path> is in, with its slash, in <dir>.
+     Return false if it is the root, and in nothing. */
+  size_t len=strlen(path);
+
+  if( len > 1 && path[len-1] == '/' )
+    len--;
+  while( len > 0 && path[len-1] != '/' )
+    len--;
+  if( len == 0 )
+    return false;
+  memcpy(dir, path, len);
+  dir[len] = '\0';
+  return true;
+}
+
+static bool mark(const char *path, const char *now) {
+  /* Note that <path> has moved to <now>, or is gone if that is NULL.
+     Past WATCH_MARKS_MAX, it is only found out when it is used; return
+     false then. */
+  struct Mark **link=mark_link(path), *m;
+  char *copy=NULL;
+
+  if( now != NULL && (copy = strdup(now)) == NULL )
+    return false;
+  if( *link != NULL ) {
+    free((*link)->now);
+    (*link)->now = copy;
+    return true;
+  }
+  if( marks.len >= WATCH_MARKS_MAX || (m = malloc(sizeof(*m))) == NULL ) {
+    free(copy);
+    return false;
+  }
+  m->path = strdup(path);
+  if( m->path == NULL ) {
+    free(copy);
+    free(m);
+    return false;
+  }
+  m->now = copy;
+  m->next = *link;
+  *link = m;
+  marks.len++;
+  marks_grow();
+  return true;
+}
+
+static void unmark(const char *path) {
+  /* Forget anything that happened to <path>. */
+  struct Mark **link=mark_link(path), *m=*link;
+
+  if( m == NULL )
+    return;
+  *link = m->next;
+  free(m->path);
+  free(m->now);
+  free(m);
+  marks.len--;
+}
+
+static void dir_unsure(struct WatchDir *d) {
+  if( !d->unsure )
+    nunsure++;
+  d->unsure = true;
+}
+
+static void dir_unwatch(struct WatchDir *d) {
+  /* Take <d> out of the table by watch, its watch being gone. */
+  struct WatchDir **link;
+
+  if( d->wd == -1 )
+    return;
+  link = wd_link(d->wd);
+  if( *link == d )
+    *link = d->wd_next;
+  d->wd = -1;
+}
+
+
+int watch_init(bool (*stacked)(const char *path)) {
+  /* Start watching, asking <stacked> whether a path an event is about is
+     in any stack, and so worth noting.
+     Return the descriptor to poll for events, or -1 if we can't watch;
+     everything then reads as okay. */
+
+  if( !table_init(&dirs) || !table_init(&wds) || !table_init(&marks) ) {
+    fprintf(stderr, "watch_init: %s\n", strerror(ENOMEM));
+    watch_free();
+    return -1;
+  }
+  ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if( ifd == -1 ) {
+    perror("watch_init: inotify_init1");
+    watch_free();
+    return -1;
+  }
+  is_stacked = stacked;
+  return ifd;
+}
+
+void watch_add(const char *path) {
+  /* Watch the directory <path> has been stacked in, if nothing else in
+     it has been.  Past WATCH_DIRS_MAX directories, or the kernel's limit,
+     it goes unwatched. */
+  char dir[strlen(path) + 1];
+  struct WatchDir **link, *d;
+  int wd;
+
+  if( ifd == -1 || !parent(path, dir) )
+    return;
+  link = dir_link(dir);
+  if( *link != NULL ) {
+    (*link)->count++;
+    return;
+  }
+  if( dirs.len >= WATCH_DIRS_MAX )
+    return;
+  wd = inotify_add_watch(ifd, dir, DIR_EVENTS);
+  /* another path to a directory we watch already is left to that */
+  if( wd == -1 || *wd_link(wd) != NULL )
+    return;
+  d = malloc(sizeof(*d));
+  if( d == NULL || (d->path = strdup(dir)) == NULL ) {
+    free(d);
+    inotify_rm_watch(ifd, wd);
+    return;
+  }
+  d->wd = wd;
+  d->count = 1;
+  d->unsure = false;
+  d->next = *link;
+  *link = d;
+  d->wd_next = NULL;
+  *wd_link(wd) = d;
+  dirs.len++;
+  dirs_grow();
+}
+
+void watch_del(const char *path) {
+  /* Stop watching for <path>, which has been taken out of a stack, and
+     its directory if nothing else stacked is in it. */
+  char dir[strlen(path) + 1];
+  struct WatchDir **link, *d;
+
+  if( ifd == -1 )
+    return;
+  if( !is_stacked(path) )
+    unmark(path);
+  if( !parent(path, dir) )
+    return;
+  link = dir_link(dir);
+  d = *link;
+  if( d == NULL || --d->count > 0 )
+    return;
+  *link = d->next;
+  if( d->wd != -1 )
+    inotify_rm_watch(ifd, d->wd);
+  dir_unwatch(d);
+  if( d->unsure )
+    nunsure--;
+  free(d->path);
+  free(d);
+  dirs.len--;
+}
+
+static void event(struct inotify_event *ev) {
+  /* Note what <ev> says happened to anything stacked. */
+  struct WatchDir *d;
+  char path[PATH_MAX + NAME_MAX + 2];
+
+  if( ev->mask & IN_Q_OVERFLOW ) {
+    unsure_all = true;
+    overflowed = true;
+    return;
+  }
+  d = *wd_link(ev->wd);
+  if( d == NULL )
+    return;
+  if( ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED) ) {
+    /* what's in it can't be followed any more */
+    dir_unsure(d);
+    if( ev->mask & IN_MOVE_SELF )
+      inotify_rm_watch(ifd, d->wd);
+    if( ev->mask & IN_IGNORED )
+      dir_unwatch(d);
+    return;
+  }
+  if( ev->len == 0 )
+    return;
+  snprintf(path, sizeof(path), "%s%s%s", d->path, ev->name,
+	   ev->mask & IN_ISDIR ? "/" : "");
+
+  if( ev->mask & (IN_DELETE | IN_MOVED_FROM) ) {
+    if( is_stacked(path) )
+      mark(path, NULL);
+    if( ev->mask & IN_MOVED_FROM ) {
+      free(from_path);
+      from_path = strdup(path);
+      from_cookie = ev->cookie;
+    }
+  } else if( ev->mask & IN_MOVED_TO ) {
+    if( from_path != NULL && ev->cookie == from_cookie
+	&& *mark_link(from_path) != NULL )
+      mark(from_path, path);
+    unmark(path);
+  } else if( ev->mask & IN_CREATE ) {
+    unmark(path);
+  }
+}
+
+bool watch_read(void) {
+  /* Take in whatever events are waiting.  Return true if some were lost:
+     until everything stacked has been through watch_recheck(), and then
+     watch_settled() called, every entry is looked at whenever it's asked
+     about. */
+  char buf[WATCH_EVENTS] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  ssize_t n;
+  char *p;
+
+  if( ifd == -1 )
+    return false;
+  while( (n = read(ifd, buf, sizeof(buf))) > 0 ) {
+    for( p = buf; p < buf + n; p += sizeof(*ev) + ev->len ) {
+      ev = (struct inotify_event *)p;
+      event(ev);
+    }
+  }
+  if( n == -1 && errno != EAGAIN && errno != EINTR )
+    perror("watch_read");
+  if( !overflowed )
+    return false;
+  overflowed = false;
+  return true;
+}
+
+bool watch_recheck(const char *path) {
+  /* Look at whether the stacked <path> is still there, as the events that
+     would have said may have been lost, and note it as gone if it isn't.
+     Return false if that couldn't be noted. */
+  struct stat st;
+
+  if( ifd == -1 )
+    return true;
+  if( lstat(path, &st) == 0 ) {
+    unmark(path);
+    return true;
+  }
+  /* where it was renamed to, if we know, still holds */
+  if( errno != ENOENT || *mark_link(path) != NULL )
+    return true;
+  return mark(path, NULL);
+}
+
+void watch_settled(void) {
+  /* Everything stacked has been through watch_recheck(), so the marks can
+     be trusted again. */
+
+  unsure_all = false;
+}
+
+enum WatchState watch_state(const char *path, const char **now) {
+  /* Say what has become of <path> since it was stacked, setting <now> to
+     where it went if it was renamed.  Where events may have been missed,
+     look. */
+  char dir[strlen(path) + 1];
+  struct WatchDir *d;
+  struct Mark *m;
+  struct stat st;
+
+  *now = NULL;
+  if( ifd == -1 )
+    return WATCH_OKAY;
+  m = *mark_link(path);
+  if( m != NULL ) {
+    *now = m->now;
+    return m->now != NULL ? WATCH_MOVED : WATCH_GONE;
+  }
+  if( !unsure_all && nunsure == 0 )
+    return WATCH_OKAY;
+  if( !unsure_all && (!parent(path, dir) || (d = *dir_link(dir)) == NULL || !d->unsure) )
+    return WATCH_OKAY;
+  if( lstat(path, &st) == -1 && errno == ENOENT )
+    return WATCH_GONE;
+  return WATCH_OKAY;
+}
+
+bool watch_any(void) {
+  /* Could anything stacked have gone? */
+
+  return ifd != -1 && (marks.len > 0 || nunsure > 0 || unsure_all);
+}
+
+void watch_free(void) {
+  /* Stop watching, and forget everything. */
+  struct WatchDir *d;
+  struct Mark *m;
+  size_t i;
+
+  for( i = 0; dirs.buckets != NULL && i < dirs.nbucket; i++ ) {
+    while( (d = dirs.buckets[i]) != NULL ) {
+      dirs.buckets[i] = d->next;
+      free(d->path);
+      free(d);
+    }
+  }
+  for( i = 0; marks.buckets != NULL && i < marks.nbucket; i++ ) {
+    while( (m = marks.buckets[i]) != NULL ) {
+      marks.buckets[i] = m->next;
+      free(m->path);
+      free(m->now);
+      free(m);
+    }
+  }
+  free(dirs.buckets);
+  free(wds.buckets);
+  free(marks.buckets);
+  memset(&dirs, 0, sizeof(dirs));
+  memset(&wds, 0, sizeof(wds));
+  memset(&marks, 0, sizeof(marks));
+  free(from_path);
+  from_path = NULL;
+  nunsure = 0;
+  unsure_all = false;
+  overflowed = false;
+  if( ifd != -1 )
+    close(ifd);
+  ifd = -1;
+}
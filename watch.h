@@ -0,0 +1,28 @@
+#ifndef watch_h
+#define watch_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define WATCH_DIRS_MAX 65536	/* directories watched at once */
+#define WATCH_MARKS_MAX 65536	/* entries known to have gone or moved */
+#define WATCH_MIN 64		/* buckets to start with */
+#define WATCH_EVENTS (64 * 1024)	/* read from inotify at once */
+
+enum WatchState {
+  WATCH_OKAY,			/* as far as we know */
+  WATCH_GONE,			/* deleted, or moved somewhere we can't see */
+  WATCH_MOVED,			/* renamed; see where */
+};
+
+int watch_init(bool (*stacked)(const char *path));
+void watch_add(const char *path);
+void watch_del(const char *path);
+bool watch_read(void);
+bool watch_recheck(const char *path);
+void watch_settled(void);
+enum WatchState watch_state(const char *path, const char **now);
+bool watch_any(void);
+void watch_free(void);
+
+#endif